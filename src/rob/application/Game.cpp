@@ -4,6 +4,7 @@
 #include "Window.h"
 #include "../graphics/Graphics.h"
 #include "../audio/AudioSystem.h"
+#include "../thread/JobSystem.h"
 #include "../resource/MasterCache.h"
 #include "../renderer/Renderer.h"
 
@@ -21,6 +22,7 @@ namespace rob
         , m_window(nullptr)
         , m_graphics(nullptr)
         , m_audio(nullptr)
+        , m_jobs(nullptr)
         , m_cache(nullptr)
         , m_renderer(nullptr)
         , m_state(nullptr)
@@ -31,6 +33,8 @@ namespace rob
         m_window = m_staticAlloc.new_object<Window>();
         m_graphics = m_staticAlloc.new_object<Graphics>(m_staticAlloc);
         m_audio = m_staticAlloc.new_object<AudioSystem>(m_staticAlloc);
+        m_jobs = m_staticAlloc.new_object<JobSystem>();
+        m_jobs->Start(JobSystem::GetDefaultWorkerCount());
         m_cache = m_staticAlloc.new_object<MasterCache>(m_graphics, m_audio, m_staticAlloc);
         m_renderer = m_staticAlloc.new_object<Renderer>(m_graphics, m_cache, m_staticAlloc);
 
@@ -47,6 +51,7 @@ namespace rob
         m_stateAlloc.del_object(m_state);
         m_staticAlloc.del_object(m_renderer);
         m_staticAlloc.del_object(m_cache);
+        m_staticAlloc.del_object(m_jobs);
         m_staticAlloc.del_object(m_audio);
         m_staticAlloc.del_object(m_graphics);
         m_staticAlloc.del_object(m_window);
@@ -80,6 +85,7 @@ namespace rob
     {
         m_state->SetAllocator(m_stateAlloc);
         m_state->SetAudio(m_audio);
+        m_state->SetJobs(m_jobs);
         m_state->SetCache(m_cache);
         m_state->SetRenderer(m_renderer);
         m_state->SetWindow(m_window);
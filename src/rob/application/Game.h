@@ -12,6 +12,7 @@ namespace rob
     class Window;
     class Graphics;
     class AudioSystem;
+    class JobSystem;
     class MasterCache;
     class Renderer;
     class GameState;
@@ -58,6 +59,7 @@ namespace rob
         Window *m_window;
         Graphics *m_graphics;
         AudioSystem *m_audio;
+        JobSystem *m_jobs;
         MasterCache *m_cache;
         Renderer *m_renderer;
 
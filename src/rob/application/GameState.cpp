@@ -16,6 +16,7 @@ namespace rob
         , m_time(m_ticker)
         , m_gameTime()
         , m_alloc(nullptr)
+        , m_jobs(nullptr)
         , m_cache(nullptr)
         , m_renderer(nullptr)
         , m_quit(false)
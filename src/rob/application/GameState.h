@@ -19,6 +19,7 @@ namespace rob
     class GameTime;
     class LinearAllocator;
     class AudioSystem;
+    class JobSystem;
     class MasterCache;
 //    class Renderer;
     class Window;
@@ -37,6 +38,9 @@ namespace rob
         void SetAudio(AudioSystem *audio) { m_audio = audio; }
         AudioSystem& GetAudio() { return *m_audio; }
 
+        void SetJobs(JobSystem *jobs) { m_jobs = jobs; }
+        JobSystem& GetJobs() { return *m_jobs; }
+
         void SetCache(MasterCache *cache) { m_cache = cache; }
         MasterCache& GetCache() { return *m_cache; }
 
@@ -90,6 +94,7 @@ namespace rob
     private:
         LinearAllocator *   m_alloc;
         AudioSystem *       m_audio;
+        JobSystem *         m_jobs;
         MasterCache *       m_cache;
         Renderer *          m_renderer;
         Window *            m_window;
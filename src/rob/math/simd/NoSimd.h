@@ -42,6 +42,19 @@ namespace simd
             return v4{ x, y, z, w };
         }
 
+        static ROB_SIMD_NON_NATIVE v4 Load(const type *p)
+        {
+            return v4{ p[0], p[1], p[2], p[3] };
+        }
+
+        static ROB_SIMD_NON_NATIVE void Store(type *p, v4_arg a)
+        {
+            p[0] = a[0];
+            p[1] = a[1];
+            p[2] = a[2];
+            p[3] = a[3];
+        }
+
         static ROB_SIMD_NON_NATIVE v4 MovAxyBxy(v4_arg a, v4_arg b)
         {
             return v4{ a[0], a[1], b[0], b[1] };
@@ -192,12 +205,12 @@ namespace simd
 
         static ROB_SIMD_NON_NATIVE v4 Max(v4_arg a, v4_arg b)
         {
-            return v4{ Max(a[0], b[0]), Max(a[1], b[1]), Max(a[2], b[2]), Max(a[3], b[3]) };
+            return v4{ rob::Max(a[0], b[0]), rob::Max(a[1], b[1]), rob::Max(a[2], b[2]), rob::Max(a[3], b[3]) };
         }
 
         static ROB_SIMD_NON_NATIVE v4 Min(v4_arg a, v4_arg b)
         {
-            return v4{ Min(a[0], b[0]), Min(a[1], b[1]), Min(a[2], b[2]), Min(a[3], b[3]) };
+            return v4{ rob::Min(a[0], b[0]), rob::Min(a[1], b[1]), rob::Min(a[2], b[2]), rob::Min(a[3], b[3]) };
         }
 
         static ROB_SIMD_NON_NATIVE v4 Sqrt(v4_arg a)
@@ -27,6 +27,17 @@ namespace simd
             return _mm_set_ps(w, z, y, x);
         }
 
+        // The pointer must be aligned to 16 bytes.
+        static ROB_SIMD_NATIVE v4 Load(const type *p)
+        {
+            return _mm_load_ps(p);
+        }
+
+        static ROB_SIMD_NATIVE void Store(type *p, v4_arg a)
+        {
+            _mm_store_ps(p, a);
+        }
+
         static ROB_SIMD_NATIVE v4 MovAxyBxy(v4_arg a, v4_arg b)
         {
             return _mm_movelh_ps(a, b);
@@ -0,0 +1,130 @@
+
+#ifndef H_ROB_CHUNK_ARRAY_H
+#define H_ROB_CHUNK_ARRAY_H
+
+#include "LinearAllocator.h"
+#include "../Assert.h"
+
+namespace rob
+{
+
+    // Array that grows by allocating fixed size chunks from a linear allocator.
+    // Elements never move once added, and the memory is never freed, so the
+    // array can only be cleared for reuse.
+    template <class T, size_t ChunkSize = 1024>
+    class ChunkArray
+    {
+        static_assert((ChunkSize & (ChunkSize - 1)) == 0, "Chunk size must be a power of two");
+
+    public:
+        ChunkArray()
+            : m_alloc(nullptr)
+            , m_chunks(nullptr)
+            , m_chunkCount(0)
+            , m_maxChunks(0)
+            , m_size(0)
+        { }
+
+        ChunkArray(const ChunkArray&) = delete;
+        ChunkArray& operator = (const ChunkArray&) = delete;
+
+        void SetAllocator(LinearAllocator &alloc)
+        { m_alloc = &alloc; }
+
+        size_t GetSize() const
+        { return m_size; }
+
+        size_t GetCapacity() const
+        { return m_chunkCount * ChunkSize; }
+
+        size_t GetByteSize() const
+        { return GetArraySize<T>(GetCapacity()) + GetArraySize<T*>(m_maxChunks); }
+
+        T& operator [] (size_t index)
+        {
+            ROB_ASSERT(index < m_size);
+            return m_chunks[index / ChunkSize][index % ChunkSize];
+        }
+
+        const T& operator [] (size_t index) const
+        {
+            ROB_ASSERT(index < m_size);
+            return m_chunks[index / ChunkSize][index % ChunkSize];
+        }
+
+        T& Push()
+        {
+            if (m_size == GetCapacity())
+                AddChunk();
+            const size_t index = m_size++;
+            return m_chunks[index / ChunkSize][index % ChunkSize];
+        }
+
+        void Reserve(size_t capacity)
+        {
+            while (GetCapacity() < capacity)
+                AddChunk();
+        }
+
+        // Returns false if the allocator runs out before the capacity is reached,
+        // in which case the array keeps the chunks it got.
+        bool TryReserve(size_t capacity)
+        {
+            while (GetCapacity() < capacity)
+            {
+                if (!TryAddChunk())
+                    return false;
+            }
+            return true;
+        }
+
+        void Resize(size_t size)
+        {
+            Reserve(size);
+            m_size = size;
+        }
+
+        void Clear()
+        { m_size = 0; }
+
+    private:
+        void AddChunk()
+        {
+            if (!TryAddChunk())
+            {
+                ROB_ASSERT(0);
+            }
+        }
+
+        bool TryAddChunk()
+        {
+            ROB_ASSERT(m_alloc != nullptr);
+            if (m_chunkCount == m_maxChunks)
+            {
+                const size_t maxChunks = (m_maxChunks > 0) ? m_maxChunks * 2 : 8;
+                T **chunks = m_alloc->AllocateArray<T*>(maxChunks);
+                if (chunks == nullptr)
+                    return false;
+                for (size_t i = 0; i < m_chunkCount; i++)
+                    chunks[i] = m_chunks[i];
+                m_chunks = chunks;
+                m_maxChunks = maxChunks;
+            }
+            T *chunk = m_alloc->AllocateArray<T>(ChunkSize);
+            if (chunk == nullptr)
+                return false;
+            m_chunks[m_chunkCount++] = chunk;
+            return true;
+        }
+
+    private:
+        LinearAllocator *m_alloc;
+        T **m_chunks;
+        size_t m_chunkCount;
+        size_t m_maxChunks;
+        size_t m_size;
+    };
+
+} // rob
+
+#endif // H_ROB_CHUNK_ARRAY_H
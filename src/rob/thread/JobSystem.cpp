@@ -0,0 +1,207 @@
+
+#include "JobSystem.h"
+
+#include "../Assert.h"
+#include "../Log.h"
+
+#include <SDL2/SDL.h>
+
+namespace rob
+{
+
+    JobSystem::JobSystem()
+        : m_mutex(nullptr)
+        , m_workCond(nullptr)
+        , m_doneCond(nullptr)
+        , m_workers()
+        , m_workerCount(0)
+        , m_nextThread(1)
+        , m_quit(false)
+        , m_batches()
+        , m_batchHead(0)
+        , m_batchCount(0)
+    {
+        m_mutex = ::SDL_CreateMutex();
+        m_workCond = ::SDL_CreateCond();
+        m_doneCond = ::SDL_CreateCond();
+    }
+
+    JobSystem::~JobSystem()
+    {
+        Stop();
+        ::SDL_DestroyCond(m_doneCond);
+        ::SDL_DestroyCond(m_workCond);
+        ::SDL_DestroyMutex(m_mutex);
+    }
+
+    size_t JobSystem::GetDefaultWorkerCount()
+    {
+        const int cores = ::SDL_GetCPUCount();
+        if (cores <= 1) return 0;
+        return (size_t(cores - 1) < MAX_WORKERS) ? size_t(cores - 1) : MAX_WORKERS;
+    }
+
+    void JobSystem::Start(size_t workerCount)
+    {
+        ROB_ASSERT(m_workerCount == 0);
+        if (workerCount > MAX_WORKERS)
+            workerCount = MAX_WORKERS;
+
+        m_quit = false;
+        m_nextThread = 1;
+        for (size_t i = 0; i < workerCount; i++)
+        {
+            SDL_Thread *thread = ::SDL_CreateThread(&JobSystem::WorkerMain, "JobWorker", this);
+            if (!thread)
+            {
+                log::Error("JobSystem: Could not create worker thread: ", ::SDL_GetError());
+                break;
+            }
+            m_workers[m_workerCount++] = thread;
+        }
+        log::Info("JobSystem: Started ", m_workerCount, " workers");
+    }
+
+    void JobSystem::Stop()
+    {
+        ::SDL_LockMutex(m_mutex);
+        m_quit = true;
+        ::SDL_CondBroadcast(m_workCond);
+        ::SDL_UnlockMutex(m_mutex);
+
+        for (size_t i = 0; i < m_workerCount; i++)
+            ::SDL_WaitThread(m_workers[i], nullptr);
+        m_workerCount = 0;
+    }
+
+    void JobSystem::Submit(JobFunc func, void *data, size_t count, JobCounter &counter)
+    {
+        if (count == 0)
+            return;
+
+        counter.m_count.fetch_add(int(count), std::memory_order_relaxed);
+
+        ::SDL_LockMutex(m_mutex);
+        while (m_batchCount == MAX_BATCHES)
+        {
+            // The queue is full, help to empty it.
+            Job job;
+            const bool popped = PopJob(job);
+            ::SDL_UnlockMutex(m_mutex);
+            if (popped) RunJob(job, 0);
+            ::SDL_LockMutex(m_mutex);
+        }
+
+        Batch &batch = m_batches[(m_batchHead + m_batchCount) % MAX_BATCHES];
+        batch.func = func;
+        batch.data = data;
+        batch.next = 0;
+        batch.end = count;
+        batch.counter = &counter;
+        m_batchCount++;
+
+        ::SDL_CondBroadcast(m_workCond);
+        ::SDL_UnlockMutex(m_mutex);
+    }
+
+    void JobSystem::Wait(JobCounter &counter)
+    {
+        ::SDL_LockMutex(m_mutex);
+        while (!counter.IsDone())
+        {
+            Job job;
+            if (PopJob(job, &counter))
+            {
+                ::SDL_UnlockMutex(m_mutex);
+                RunJob(job, 0);
+                ::SDL_LockMutex(m_mutex);
+            }
+            else
+            {
+                // The remaining jobs are running on the workers.
+                ::SDL_CondWait(m_doneCond, m_mutex);
+            }
+        }
+        ::SDL_UnlockMutex(m_mutex);
+    }
+
+    bool JobSystem::PopJob(Job &job)
+    {
+        if (m_batchCount == 0)
+            return false;
+
+        Batch &batch = m_batches[m_batchHead];
+        job.func = batch.func;
+        job.data = batch.data;
+        job.index = batch.next++;
+        job.counter = batch.counter;
+        if (batch.next == batch.end)
+        {
+            m_batchHead = (m_batchHead + 1) % MAX_BATCHES;
+            m_batchCount--;
+        }
+        return true;
+    }
+
+    // Takes a job of the first batch submitted with the counter. A finished batch
+    // is removed from the middle of the queue by moving the later ones back.
+    bool JobSystem::PopJob(Job &job, const JobCounter *counter)
+    {
+        size_t n = 0;
+        while (n < m_batchCount && m_batches[(m_batchHead + n) % MAX_BATCHES].counter != counter)
+            n++;
+        if (n == m_batchCount)
+            return false;
+
+        Batch &batch = m_batches[(m_batchHead + n) % MAX_BATCHES];
+        job.func = batch.func;
+        job.data = batch.data;
+        job.index = batch.next++;
+        job.counter = batch.counter;
+        if (batch.next == batch.end)
+        {
+            for (; n + 1 < m_batchCount; n++)
+                m_batches[(m_batchHead + n) % MAX_BATCHES] = m_batches[(m_batchHead + n + 1) % MAX_BATCHES];
+            m_batchCount--;
+        }
+        return true;
+    }
+
+    void JobSystem::RunJob(const Job &job, size_t thread)
+    {
+        job.func(job.data, job.index, thread);
+        if (job.counter->m_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            // Taking the lock makes sure that the waiting thread is either
+            // waiting on the condition or has not yet checked the counter.
+            ::SDL_LockMutex(m_mutex);
+            ::SDL_CondBroadcast(m_doneCond);
+            ::SDL_UnlockMutex(m_mutex);
+        }
+    }
+
+    int JobSystem::WorkerMain(void *data)
+    {
+        JobSystem *jobs = static_cast<JobSystem*>(data);
+        const size_t thread = jobs->m_nextThread.fetch_add(1);
+
+        ::SDL_LockMutex(jobs->m_mutex);
+        while (!jobs->m_quit)
+        {
+            Job job;
+            if (jobs->PopJob(job))
+            {
+                ::SDL_UnlockMutex(jobs->m_mutex);
+                jobs->RunJob(job, thread);
+                ::SDL_LockMutex(jobs->m_mutex);
+            }
+            else
+            {
+                ::SDL_CondWait(jobs->m_workCond, jobs->m_mutex);
+            }
+        }
+        ::SDL_UnlockMutex(jobs->m_mutex);
+        return 0;
+    }
+
+} // rob
@@ -0,0 +1,123 @@
+
+#ifndef H_ROB_JOB_SYSTEM_H
+#define H_ROB_JOB_SYSTEM_H
+
+#include "../Types.h"
+
+#include <atomic>
+
+struct SDL_Thread;
+struct SDL_mutex;
+struct SDL_cond;
+
+namespace rob
+{
+
+    // Counts the unfinished jobs of the batches submitted with it.
+    class JobCounter
+    {
+    public:
+        JobCounter() : m_count(0) { }
+        JobCounter(const JobCounter&) = delete;
+        JobCounter& operator = (const JobCounter&) = delete;
+
+        bool IsDone() const
+        { return m_count.load(std::memory_order_acquire) == 0; }
+
+    private:
+        friend class JobSystem;
+        std::atomic<int> m_count;
+    };
+
+    // Runs jobs on a fixed set of worker threads. A batch of jobs calls the same
+    // function with every index of the batch, so that a loop can be split across
+    // the threads. Jobs are submitted and waited for from the main thread only.
+    class JobSystem
+    {
+    public:
+        // The thread index is 0 for the waiting thread and 1..worker count for the
+        // workers, so that jobs can use per-thread data.
+        typedef void (*JobFunc)(void *data, size_t index, size_t thread);
+
+        static const size_t MAX_WORKERS = 15;
+        static const size_t MAX_BATCHES = 64;
+
+    public:
+        JobSystem();
+        JobSystem(const JobSystem&) = delete;
+        JobSystem& operator = (const JobSystem&) = delete;
+        ~JobSystem();
+
+        // Starts the worker threads. With no workers, the jobs run on the thread
+        // that waits for them.
+        void Start(size_t workerCount);
+        void Stop();
+
+        // One worker per core, leaving a core for the main thread.
+        static size_t GetDefaultWorkerCount();
+
+        size_t GetWorkerCount() const
+        { return m_workerCount; }
+
+        // The number of threads that run jobs, including the waiting thread.
+        size_t GetThreadCount() const
+        { return m_workerCount + 1; }
+
+        // Submits jobs func(data, 0, thread) .. func(data, count - 1, thread). The data
+        // must stay valid until the counter is done.
+        void Submit(JobFunc func, void *data, size_t count, JobCounter &counter);
+
+        // Runs the jobs of the counter on the calling thread until the counter is
+        // done. The jobs of other batches are left for the workers, so waiting is
+        // not held up by longer jobs submitted before.
+        void Wait(JobCounter &counter);
+
+        void ParallelFor(JobFunc func, void *data, size_t count)
+        {
+            JobCounter counter;
+            Submit(func, data, count, counter);
+            Wait(counter);
+        }
+
+    private:
+        struct Job
+        {
+            JobFunc func;
+            void *data;
+            size_t index;
+            JobCounter *counter;
+        };
+
+        struct Batch
+        {
+            JobFunc func;
+            void *data;
+            size_t next;
+            size_t end;
+            JobCounter *counter;
+        };
+
+        bool PopJob(Job &job);
+        bool PopJob(Job &job, const JobCounter *counter);
+        void RunJob(const Job &job, size_t thread);
+
+        static int WorkerMain(void *data);
+
+    private:
+        SDL_mutex *m_mutex;
+        SDL_cond *m_workCond;
+        SDL_cond *m_doneCond;
+
+        SDL_Thread *m_workers[MAX_WORKERS];
+        size_t m_workerCount;
+        std::atomic<size_t> m_nextThread;
+        bool m_quit;
+
+        Batch m_batches[MAX_BATCHES];
+        size_t m_batchHead;
+        size_t m_batchCount;
+    };
+
+} // rob
+
+#endif // H_ROB_JOB_SYSTEM_H
@@ -11,34 +11,6 @@
 namespace sneaky
 {
 
-    struct SoundCallback : public b2QueryCallback
-    {
-        const vec2f m_position;
-        const float m_volume;
-
-        explicit SoundCallback(const vec2f &position, const float volume)
-            : m_position(position), m_volume(volume) { }
-
-        bool ReportFixture(b2Fixture *fixture) override
-        {
-            const b2Filter &filter = fixture->GetFilterData();
-            if (filter.categoryBits & GuardBit)
-            {
-                void *userData = fixture->GetBody()->GetUserData();
-                if (userData)
-                {
-                    GameObject *guard = static_cast<GameObject*>(userData);
-                    guard->GetBrain()->ReportSound(m_position, m_volume);
-                }
-            }
-            return true;
-        }
-
-        bool ShouldQueryParticleSystem(const b2ParticleSystem *ps) override
-        { return false; }
-    };
-
-
     void PlayerBrain::OnInitialize()
     {
         b2CircleShape shape;
@@ -88,11 +60,8 @@ namespace sneaky
 
         const vec2f velocity = offset * speed;
         const float volume = (offset * speed).Length2();
-        SoundCallback soundCb(position, volume * 0.5f);
-        b2CircleShape shape;
-        shape.m_radius = 16.0f;
-        const b2Transform &tr = m_owner->GetBody()->GetTransform();
-        m_owner->GetBody()->GetWorld()->QueryShapeAABB(&soundCb, shape, tr);
+        if (volume > 0.0f)
+            m_game->GetSoundBus().Post(position, volume * 0.5f, 16.0f);
 
         if (m_footStepTimer <= 0.0f && volume > 1.0f)
         {
@@ -231,6 +231,7 @@ namespace sneaky
         #endif // ROB_DEBUG
         );
 
+        m_gameData.m_worldSeed = 0;
         m_gameData.m_highScores.Load();
 
         HandleStateChange(STATE_MainMenu);
@@ -10,6 +10,7 @@ namespace sneaky
     struct GameData
     {
         int             m_score;
+        uint32_t        m_worldSeed; // Seed of the next game world, or 0 for a random one
         HighScoreList   m_highScores;
     };
 
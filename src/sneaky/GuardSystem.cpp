@@ -0,0 +1,771 @@
+
+#include "GuardSystem.h"
+#include "GameObject.h"
+#include "SneakyState.h"
+
+#include "rob/application/GameTime.h"
+#include "rob/thread/JobSystem.h"
+#include "rob/Assert.h"
+
+#include <cmath>
+
+namespace sneaky
+{
+
+    static const int MAX_PATH_REPAIRS = 4;
+
+    static const float WALK_SPEED = 4.0f;
+    static const float RUN_SPEED = 8.0f;
+
+    static const GuardSystem::LodTier DEFAULT_LOD_TIERS[] =
+    {
+        { 0.0f, 1 },
+        { 24.0f, 2 },
+        { 48.0f, 4 }
+    };
+
+    // The guards decide in parallel, so each one has a generator of its own
+    // instead of sharing the one of the game.
+    static inline uint32_t NextRandom(uint32_t &state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    GuardSystem::GuardSystem(SneakyState *game)
+        : m_game(game)
+        , m_nav(nullptr)
+        , m_deltaTime(0.0f)
+        , m_guardCount(0)
+        , m_lodTierCount(0)
+        , m_hasLodFocus(false)
+        , m_lodFocus(0.0f, 0.0f)
+        , m_lodViewMin(0.0f, 0.0f)
+        , m_lodViewMax(0.0f, 0.0f)
+        , m_updateIndex(0)
+    {
+        SetLodTiers(DEFAULT_LOD_TIERS, sizeof(DEFAULT_LOD_TIERS) / sizeof(DEFAULT_LOD_TIERS[0]));
+        ResetLodStats();
+    }
+
+    void GuardSystem::SetNavigation(Navigation *nav)
+    { m_nav = nav; }
+
+    void GuardSystem::SetLodTiers(const LodTier *tiers, size_t count)
+    {
+        ROB_ASSERT(count > 0 && count <= MAX_LOD_TIERS);
+        ROB_ASSERT(tiers[0].distance == 0.0f);
+        for (size_t i = 0; i < count; i++)
+        {
+            ROB_ASSERT(tiers[i].interval > 0);
+            ROB_ASSERT(i == 0 || tiers[i - 1].distance < tiers[i].distance);
+            m_lodTiers[i] = tiers[i];
+        }
+        m_lodTierCount = count;
+    }
+
+    void GuardSystem::SetLodFocus(const vec2f &position, const vec2f &viewMin, const vec2f &viewMax)
+    {
+        m_hasLodFocus = true;
+        m_lodFocus = position;
+        m_lodViewMin = viewMin;
+        m_lodViewMax = viewMax;
+    }
+
+    void GuardSystem::ResetLodStats()
+    {
+        for (size_t i = 0; i < MAX_LOD_TIERS; i++)
+        {
+            m_lodStats.ticks[i] = 0;
+            m_lodStats.skips[i] = 0;
+        }
+    }
+
+    size_t GuardSystem::AddGuard(GameObject *guard, uint32_t seed)
+    {
+        ROB_ASSERT(m_nav != nullptr);
+        ROB_ASSERT(m_guardCount < MAX_GUARDS);
+        const size_t i = m_guardCount++;
+
+        m_objects[i] = guard;
+        m_randomStates[i] = seed ? seed : 1;
+
+        b2PolygonShape rightShape, leftShape;
+        rightShape.SetAsBox(0.5f, 1.0f, b2Vec2(0.5f, 2.0f), 0.0f);
+        leftShape.SetAsBox(0.5f, 1.0f, b2Vec2(-0.5f, 2.0f), 0.0f);
+
+        m_rightSensors[i] = GuardLocalSensor();
+        m_rightSensors[i].SetBody(guard->GetBody());
+        m_rightSensors[i].SetShape(&rightShape);
+        m_leftSensors[i] = GuardLocalSensor();
+        m_leftSensors[i].SetBody(guard->GetBody());
+        m_leftSensors[i].SetShape(&leftShape);
+
+        m_agents[i].Reset();
+        m_viewers[i] = m_game->GetVision().AddViewer(guard, &m_agents[i]);
+
+        m_paths[i] = m_nav->ObtainNavPath();
+        m_pathPos[i] = 0;
+        m_pathTickets[i] = InvalidNavTicket;
+        m_pathPending[i] = false;
+        m_pathRepairs[i] = 0;
+
+        m_positions[i] = guard->GetPosition();
+        m_velocities[i] = vec2f::Zero;
+        m_angles[i] = 0.0f;
+        m_sensorBits[i] = 0;
+        m_thinks[i] = true;
+        m_thinkTimes[i] = 0.0f;
+
+        m_stateTimers[i] = 0.0f;
+        m_watchTimers[i] = 0.0f;
+        m_stuckMeters[i] = 0.0f;
+        m_prevPositions[i] = m_positions[i];
+        m_lastKnownPlayerPos[i] = vec2f::Zero;
+        m_soundHeard[i] = false;
+        m_soundSources[i] = vec2f::Zero;
+        m_soundInterests[i] = 0.0f;
+
+        m_outputs[i] = 0;
+        ChangeToWatchState(i);
+        m_stateTimers[i] = GetRandomReal(i, 0.0f, 4.0f);
+        m_navCommands[i] = NavCommand::None; // The path is empty already
+        guard->SetDebugColor(m_debugColors[i]);
+        return i;
+    }
+
+    void GuardSystem::RemoveGuard(size_t guard)
+    {
+        if (!m_objects[guard]) return;
+        m_nav->CancelNavigate(m_pathTickets[guard]);
+        m_nav->ReturnNavPath(m_paths[guard]);
+        m_objects[guard] = nullptr;
+    }
+
+    void GuardSystem::Clear()
+    {
+        for (size_t i = 0; i < m_guardCount; i++)
+            RemoveGuard(i);
+        m_guardCount = 0;
+        m_hasLodFocus = false;
+    }
+
+    float GuardSystem::GetRandomReal(size_t guard, float a, float b)
+    {
+        const float t = float(NextRandom(m_randomStates[guard]) >> 8) / float(1 << 24);
+        return a + (b - a) * t;
+    }
+
+    void GuardSystem::ReportSound(size_t guard, const vec2f &position, float volume)
+    {
+        const float sqrDist = rob::Distance2(m_objects[guard]->GetPosition(), position);
+        if (volume > 0.1f * sqrDist) // volume / sqrDist > 1.0f
+        {
+            HearSound(guard, position, volume / sqrDist);
+        }
+    }
+
+    void GuardSystem::HearSound(size_t guard, const vec2f &position, float volume)
+    {
+        if (m_states[guard] != State::Chase)
+        {
+            if (m_soundHeard[guard])
+            {
+                const float distSqr = rob::Distance2(m_soundSources[guard], position);
+                const float interestDiv = distSqr > 1.0f ? distSqr : 1.0f;
+                m_soundInterests[guard] += volume / interestDiv;
+            }
+            m_soundHeard[guard] = true;
+            m_soundSources[guard] = position;
+        }
+    }
+
+    void GuardSystem::Update(const rob::GameTime &gameTime, rob::JobSystem &jobs)
+    {
+        ROB_ASSERT(m_nav != nullptr);
+        if (m_guardCount == 0) return;
+
+        m_deltaTime = gameTime.GetDeltaSeconds();
+        Gather();
+        jobs.ParallelFor(&GuardSystem::DecideJob, this, (m_guardCount + GUARDS_PER_JOB - 1) / GUARDS_PER_JOB);
+        Apply();
+        m_updateIndex++;
+    }
+
+    // The paths queried on the job system are polled here, as polling frees the
+    // query for reuse.
+    void GuardSystem::Gather()
+    {
+        for (size_t i = 0; i < m_guardCount; i++)
+        {
+            GameObject *guard = m_objects[i];
+            if (!guard) continue;
+
+            const b2Body *body = guard->GetBody();
+            m_positions[i] = guard->GetPosition();
+            m_velocities[i] = FromB2(body->GetLinearVelocity());
+            m_angles[i] = body->GetAngle();
+
+            // The guards of a tier are split to buckets by their slot, and one
+            // bucket thinks on each update.
+            const size_t tier = GetLodTier(i);
+            m_thinkTimes[i] += m_deltaTime;
+            m_thinks[i] = ((m_updateIndex + i) % m_lodTiers[tier].interval) == 0;
+            if (m_thinks[i])
+            {
+                m_sensorBits[i] = (m_rightSensors[i].HitsWall() ? RightHitsWall : 0)
+                    | (m_leftSensors[i].HitsWall() ? LeftHitsWall : 0);
+                m_lodStats.ticks[tier]++;
+            }
+            else
+            {
+                m_lodStats.skips[tier]++;
+            }
+
+            if (m_pathPending[i] && m_nav->PollNavigate(m_pathTickets[i]))
+            {
+                m_pathPending[i] = false;
+                m_pathPos[i] = 0;
+                m_stuckMeters[i] = 0.0f;
+            }
+        }
+    }
+
+    // Guards chasing or seeing the player always think on every update.
+    size_t GuardSystem::GetLodTier(size_t guard) const
+    {
+        if (!m_hasLodFocus || m_states[guard] == State::Chase)
+            return 0;
+        if (m_game->GetVision().GetSighting(m_viewers[guard]).visible)
+            return 0;
+
+        const vec2f position = m_positions[guard];
+        const float dist2 = rob::Distance2(position, m_lodFocus);
+        size_t tier = 0;
+        while (tier + 1 < m_lodTierCount && dist2 >= m_lodTiers[tier + 1].distance * m_lodTiers[tier + 1].distance)
+            tier++;
+
+        const bool onScreen = (position.x >= m_lodViewMin.x && position.x < m_lodViewMax.x) &&
+            (position.y >= m_lodViewMin.y && position.y < m_lodViewMax.y);
+        if (!onScreen && tier + 1 < m_lodTierCount)
+            tier++;
+        return tier;
+    }
+
+    void GuardSystem::DecideJob(void *data, size_t index, size_t thread)
+    {
+        GuardSystem &system = *static_cast<GuardSystem*>(data);
+        const size_t begin = index * GUARDS_PER_JOB;
+        const size_t end = rob::Min(begin + GUARDS_PER_JOB, system.m_guardCount);
+        for (size_t i = begin; i < end; i++)
+        {
+            if (!system.m_objects[i]) continue;
+            if (system.m_thinks[i])
+            {
+                system.Decide(i, system.m_thinkTimes[i]);
+                system.m_thinkTimes[i] = 0.0f;
+            }
+            else
+            {
+                system.Coast(i);
+            }
+        }
+    }
+
+    // Reads the mesh, the vision and the slots of the guard, and writes only the
+    // slots of the guard.
+    void GuardSystem::Decide(size_t guard, float dt)
+    {
+        m_outputs[guard] = 0;
+        m_navCommands[guard] = NavCommand::None;
+
+        if (m_stateTimers[guard] > 0.0f)
+            m_stateTimers[guard] -= dt;
+
+        // The face of the guard is tracked every update, and the queries start from it.
+        m_agents[guard].Update(m_nav->GetMesh(), m_positions[guard]);
+
+        switch (m_states[guard])
+        {
+        case State::Watch:
+            UpdateWatch(guard, dt);
+            break;
+
+        case State::Patrol:
+            UpdatePatrol(guard, dt);
+            break;
+
+        case State::Suspect:
+            UpdateSuspect(guard);
+            break;
+
+        case State::Inspect:
+            UpdateInspect(guard, dt);
+            break;
+
+        case State::Chase:
+            UpdateChase(guard, dt);
+            break;
+        }
+    }
+
+    // Between the updates a guard thinks on, it only keeps heading to the next
+    // vertex of its path. The physics keeps the velocities set on the update
+    // before, and the timers of the guard wait for the time to be passed on.
+    void GuardSystem::Coast(size_t guard)
+    {
+        m_outputs[guard] = 0;
+        m_navCommands[guard] = NavCommand::None;
+
+        // Kept up to date for the vision.
+        m_agents[guard].Update(m_nav->GetMesh(), m_positions[guard]);
+
+        const State state = m_states[guard];
+        if (state != State::Patrol && state != State::Inspect)
+            return;
+
+        const NavPath *path = m_paths[guard];
+        if (!m_pathPending[guard] && m_pathPos[guard] < path->GetLength() &&
+            rob::Distance2(path->GetVertex(m_pathPos[guard]), m_positions[guard]) < 1.0f)
+        {
+            m_pathPos[guard]++;
+        }
+
+        // Stops at the end of the path, or while waiting for one, instead of
+        // walking on until the guard thinks again.
+        if (m_pathPending[guard] || !(m_pathPos[guard] < path->GetLength()))
+        {
+            m_linearVelocities[guard] = vec2f::Zero;
+            m_outputs[guard] |= OutLinearVelocity;
+            return;
+        }
+
+        const vec2f delta = path->GetVertex(m_pathPos[guard]) - m_positions[guard];
+        const vec2f dir = delta.SafeNormalized();
+        m_linearVelocities[guard] = dir * WALK_SPEED;
+        m_rotations[guard] = dir;
+        m_outputs[guard] |= OutLinearVelocity | OutRotation;
+    }
+
+    void GuardSystem::Apply()
+    {
+        for (size_t i = 0; i < m_guardCount; i++)
+        {
+            GameObject *guard = m_objects[i];
+            if (!guard) continue;
+
+            b2Body *body = guard->GetBody();
+            const uint8_t outputs = m_outputs[i];
+            if (outputs & OutLinearVelocity)
+                body->SetLinearVelocity(ToB2(m_linearVelocities[i]));
+            if (outputs & OutRotation)
+                guard->SetRotation(m_rotations[i]);
+            if (outputs & OutAngularVelocity)
+                body->SetAngularVelocity(m_angularVelocities[i]);
+            guard->SetDebugColor(m_debugColors[i]);
+
+            ApplyNavCommand(i);
+
+            if (outputs & OutPlayerCaught)
+                m_game->PlayerCaught(m_positions[i]);
+        }
+    }
+
+    void GuardSystem::ApplyNavCommand(size_t guard)
+    {
+        const NavCommand command = m_navCommands[guard];
+        switch (command)
+        {
+        case NavCommand::None:
+            return;
+
+        case NavCommand::Clear:
+            m_nav->CancelNavigate(m_pathTickets[guard]);
+            m_pathPending[guard] = false;
+            m_paths[guard]->Clear();
+            return;
+
+        // The path queries run on the job system, and the path is followed from
+        // the start once it has been written.
+        case NavCommand::Navigate:
+        case NavCommand::NavigateRandom:
+            {
+                const vec2f target = (command == NavCommand::NavigateRandom)
+                    ? m_nav->GetRandomNavigableWorldPoint(m_game->GetRandom())
+                    : m_navTargets[guard];
+                m_nav->CancelNavigate(m_pathTickets[guard]);
+                m_pathTickets[guard] = m_nav->SubmitNavigate(m_agents[guard], target, m_paths[guard], GetPathPriority(guard));
+                m_pathPending[guard] = true;
+                m_stuckMeters[guard] = 0.0f;
+            }
+            return;
+
+        // The chase path is repaired for the moved player, and searched again when
+        // that fails, or after a few repairs so that it does not drift far from
+        // the shortest path.
+        case NavCommand::RepathChase:
+            if (m_pathRepairs[guard] < MAX_PATH_REPAIRS && !m_pathPending[guard] &&
+                m_nav->RepairPath(m_agents[guard], m_navTargets[guard], m_paths[guard]))
+            {
+                m_pathRepairs[guard]++;
+                m_pathPos[guard] = 0;
+                m_stuckMeters[guard] = 0.0f;
+                return;
+            }
+            // Fall through
+        case NavCommand::Chase:
+            // The chasing guards head to the same place, so they share a flow field.
+            m_nav->CancelNavigate(m_pathTickets[guard]);
+            m_pathPending[guard] = false;
+            m_pathPos[guard] = 0;
+            m_pathRepairs[guard] = 0;
+            m_nav->NavigateFlow(m_agents[guard], m_navTargets[guard], m_paths[guard]);
+            m_stuckMeters[guard] = 0.0f;
+            return;
+        }
+    }
+
+    // The vision of the game sees for the guards after they have been updated,
+    // so the sighting is from the previous frame.
+    bool GuardSystem::LookForPlayer(size_t guard)
+    {
+        const VisionSystem::Sighting &sighting = m_game->GetVision().GetSighting(m_viewers[guard]);
+        if (sighting.target)
+        {
+            m_debugColors[guard] = Color::Orange;
+            if (sighting.visible)
+            {
+                m_lastKnownPlayerPos[guard] = sighting.position;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void GuardSystem::StartChasingIfPlayerSighted(size_t guard)
+    {
+        if (LookForPlayer(guard))
+            ChangeToChaseState(guard);
+    }
+
+    void GuardSystem::StartSuspectingIfHeard(size_t guard)
+    {
+        if (m_soundHeard[guard])
+            ChangeToSuspectState(guard);
+    }
+
+    void GuardSystem::ChangeToSuspectState(size_t guard)
+    {
+        m_debugColors[guard] = Color::Green;
+        m_stateTimers[guard] = GetRandomReal(guard, 0.5f, 2.0f);
+        ClearPath(guard);
+        m_states[guard] = State::Suspect;
+    }
+
+    void GuardSystem::ChangeToInspectState(size_t guard)
+    {
+        m_soundHeard[guard] = false;
+        m_soundInterests[guard] = 0.0f;
+
+        m_debugColors[guard] = Color::LightBlue;
+        m_stateTimers[guard] = GetRandomReal(guard, 2.0f, 4.0f);
+        m_states[guard] = State::Inspect;
+    }
+
+    void GuardSystem::ChangeToWatchState(size_t guard)
+    {
+        m_soundHeard[guard] = false;
+        m_soundInterests[guard] = 0.0f;
+
+        m_debugColors[guard] = Color::Yellow;
+        m_stateTimers[guard] = GetRandomReal(guard, 4.0f, 8.0f);
+        ClearPath(guard);
+        m_states[guard] = State::Watch;
+    }
+
+    void GuardSystem::ChangeToPatrolState(size_t guard)
+    {
+        m_soundHeard[guard] = false;
+        m_soundInterests[guard] = 0.0f;
+
+        m_debugColors[guard] = Color::Blue;
+        m_states[guard] = State::Patrol;
+        NavigateRandom(guard);
+    }
+
+    void GuardSystem::ChangeToChaseState(size_t guard)
+    {
+        m_soundHeard[guard] = false;
+        m_soundInterests[guard] = 0.0f;
+
+        m_debugColors[guard] = Color::Red;
+        m_stateTimers[guard] = 0.5f;
+        NavigateChase(guard, m_lastKnownPlayerPos[guard]);
+        m_states[guard] = State::Chase;
+    }
+
+    void GuardSystem::Move(size_t guard, float speed, float dt)
+    {
+        // Waiting for a path, or for the one decided on this update.
+        const NavPath *path = m_paths[guard];
+        if (m_navCommands[guard] != NavCommand::None || !(m_pathPos[guard] < path->GetLength()))
+            return;
+
+        const vec2f position = m_positions[guard];
+        const vec2f target = path->GetVertex(m_pathPos[guard]);
+        const vec2f delta = (target - position);
+
+        const float dist2 = delta.Length2();
+        const float maxDist = 1.0f;
+        if (dist2 < maxDist*maxDist)
+        {
+            m_stuckMeters[guard] = 0.0f;
+            m_pathPos[guard]++;
+            return;
+        }
+
+        // Head straight to the next vertex once nothing is in the way, after
+        // being pushed off the path or when following a repaired one.
+        const NavAgent &agent = m_agents[guard];
+        const size_t next = m_pathPos[guard] + 1;
+        if (next < path->GetLength() &&
+            m_nav->GetMesh().RayCast(agent.GetFace(), agent.GetPosition(), path->GetVertex(next)))
+        {
+            m_pathPos[guard] = next;
+            return;
+        }
+
+        const vec2f destDir = delta.SafeNormalized();
+        const vec2f offset = destDir + m_velocities[guard];
+
+        const vec2f dir = offset.SafeNormalized();
+        m_linearVelocities[guard] = dir * speed;
+        m_rotations[guard] = dir;
+        m_angularVelocities[guard] = 0.0f;
+        m_outputs[guard] |= OutLinearVelocity | OutRotation | OutAngularVelocity;
+
+        m_stuckMeters[guard] += speed * dt - rob::Distance(m_prevPositions[guard], position);
+    }
+
+    // A path decided on this update is not at its end, unless it was cleared.
+    bool GuardSystem::IsEndOfPath(size_t guard) const
+    {
+        switch (m_navCommands[guard])
+        {
+        case NavCommand::None:
+            return !m_pathPending[guard] && !(m_pathPos[guard] < m_paths[guard]->GetLength());
+        case NavCommand::Clear:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Paths of the guards chasing the player are searched before the others.
+    NavPriority GuardSystem::GetPathPriority(size_t guard) const
+    {
+        switch (m_states[guard])
+        {
+        case State::Chase:
+            return NavPriority::High;
+        case State::Watch:
+        case State::Patrol:
+            return NavPriority::Low;
+        default:
+            return NavPriority::Normal;
+        }
+    }
+
+    void GuardSystem::Inspect(size_t guard, const vec2f &location)
+    {
+        ChangeToInspectState(guard);
+        const float angle = GetRandomReal(guard, 0.0f, 2.0f * rob::PI_f);
+        const vec2f dir(rob::Cos(angle), rob::Sin(angle));
+        Navigate(guard, location + dir * GetRandomReal(guard, 0.5f, 2.5f));
+    }
+
+    void GuardSystem::Navigate(size_t guard, const vec2f &pos)
+    {
+        m_navCommands[guard] = NavCommand::Navigate;
+        m_navTargets[guard] = pos;
+        m_pathPending[guard] = true;
+        m_stuckMeters[guard] = 0.0f;
+    }
+
+    // The random point is picked from the generator of the game when applied.
+    void GuardSystem::NavigateRandom(size_t guard)
+    {
+        m_navCommands[guard] = NavCommand::NavigateRandom;
+        m_pathPending[guard] = true;
+        m_stuckMeters[guard] = 0.0f;
+    }
+
+    void GuardSystem::NavigateChase(size_t guard, const vec2f &pos)
+    {
+        m_navCommands[guard] = NavCommand::Chase;
+        m_navTargets[guard] = pos;
+        m_stuckMeters[guard] = 0.0f;
+    }
+
+    void GuardSystem::RepathChase(size_t guard, const vec2f &pos)
+    {
+        m_navCommands[guard] = NavCommand::RepathChase;
+        m_navTargets[guard] = pos;
+    }
+
+    void GuardSystem::ClearPath(size_t guard)
+    {
+        m_navCommands[guard] = NavCommand::Clear;
+        m_pathPending[guard] = false;
+    }
+
+    void GuardSystem::UpdateSuspect(size_t guard)
+    {
+        m_linearVelocities[guard] = vec2f::Zero;
+
+        const vec2f delta = m_soundSources[guard] - m_positions[guard];
+        const float angle = b2Atan2(-delta.x, delta.y);
+
+        const float bodyAngle = std::fmod(m_angles[guard], 2.0f * rob::PI_f);
+
+        float angV = (angle - bodyAngle);
+        if (angV > rob::PI_f) angV -= rob::PI_f;
+        if (angV < -rob::PI_f) angV += rob::PI_f;
+
+        angV = rob::Clamp(angV, -2.0f * rob::PI_f, 2.0f * rob::PI_f);
+
+        m_angularVelocities[guard] = (angV > 0.0f) ? rob::Clamp(angV, rob::PI_f, angV)
+                                                   : -rob::Clamp(-angV, rob::PI_f, -angV);
+        m_outputs[guard] |= OutLinearVelocity | OutAngularVelocity;
+
+        if (angV * angV < 0.05f)
+        {
+            const float thresold = 2.0f;
+            if (m_soundInterests[guard] > thresold)
+                Inspect(guard, m_soundSources[guard]);
+        }
+
+        if (m_stateTimers[guard] <= 0.0f)
+            ChangeToPatrolState(guard);
+
+        m_debugColors[guard] = Color::Green;
+
+        StartChasingIfPlayerSighted(guard);
+    }
+
+    void GuardSystem::UpdateInspect(size_t guard, float dt)
+    {
+        if (IsEndOfPath(guard))
+            ChangeToWatchState(guard);
+        else
+        {
+            Move(guard, WALK_SPEED, dt);
+            if (IsStuck(guard))
+                ChangeToPatrolState(guard);
+        }
+        m_prevPositions[guard] = m_positions[guard];
+
+        m_debugColors[guard] = Color::LightBlue;
+
+        StartChasingIfPlayerSighted(guard);
+    }
+
+    void GuardSystem::UpdateWatch(size_t guard, float dt)
+    {
+        m_linearVelocities[guard] = vec2f::Zero;
+
+        const uint8_t sensors = m_sensorBits[guard];
+        float &watchTimer = m_watchTimers[guard];
+        if ((sensors & RightHitsWall) && !(sensors & LeftHitsWall))
+            watchTimer = GetRandomReal(guard, 1.0f, 2.0f);
+        else if ((sensors & LeftHitsWall) && !(sensors & RightHitsWall))
+            watchTimer = -GetRandomReal(guard, 1.0f, 2.0f);
+
+        if (watchTimer > 0.0f)
+        {
+            m_angularVelocities[guard] = 3.14f*0.5f;
+
+            watchTimer -= dt;
+            if (watchTimer <= 0.0f)
+                watchTimer = -GetRandomReal(guard, 1.0f, 2.0f);
+        }
+        else
+        {
+            m_angularVelocities[guard] = -3.14f*0.5f;
+
+            watchTimer += dt;
+            if (watchTimer >= 0.0f)
+                watchTimer = GetRandomReal(guard, 1.0f, 2.0f);
+        }
+        m_outputs[guard] |= OutLinearVelocity | OutAngularVelocity;
+
+        if (m_stateTimers[guard] <= 0.0f)
+            ChangeToPatrolState(guard);
+
+        m_debugColors[guard] = Color::Yellow;
+
+        StartSuspectingIfHeard(guard);
+        StartChasingIfPlayerSighted(guard);
+    }
+
+    void GuardSystem::UpdatePatrol(size_t guard, float dt)
+    {
+        if (IsEndOfPath(guard))
+            ChangeToWatchState(guard);
+        else
+        {
+            Move(guard, WALK_SPEED, dt);
+            if (IsStuck(guard))
+                NavigateRandom(guard);
+        }
+        m_prevPositions[guard] = m_positions[guard];
+
+        m_debugColors[guard] = Color::Blue;
+
+        StartSuspectingIfHeard(guard);
+        StartChasingIfPlayerSighted(guard);
+    }
+
+    void GuardSystem::UpdateChase(size_t guard, float dt)
+    {
+        const VisionSystem::Sighting &sighting = m_game->GetVision().GetSighting(m_viewers[guard]);
+        if (sighting.target)
+        {
+            if (rob::Distance(m_positions[guard], sighting.position) < 2.5f)
+                m_outputs[guard] |= OutPlayerCaught;
+        }
+
+        LookForPlayer(guard);
+
+        m_debugColors[guard] = Color::Red;
+
+        if (m_stateTimers[guard] <= 0.0f)
+        {
+            RepathChase(guard, m_lastKnownPlayerPos[guard]);
+            m_stateTimers[guard] = 0.5f;
+        }
+
+        Move(guard, RUN_SPEED, dt);
+        if (IsEndOfPath(guard))
+        {
+            ChangeToWatchState(guard);
+            StartSuspectingIfHeard(guard);
+        }
+        else
+        {
+            if (IsStuck(guard))
+                RepathChase(guard, m_lastKnownPlayerPos[guard]);
+        }
+    }
+
+    void GuardSystem::DebugRender(size_t guard, rob::Renderer *renderer) const
+    {
+        m_nav->RenderPath(renderer, m_paths[guard]);
+        const vec2f pos = m_objects[guard]->GetPosition();
+        renderer->SetColor(m_objects[guard]->GetDebugColor());
+        renderer->DrawCircle(pos.x, pos.y, 1.2f);
+    }
+
+} // sneaky
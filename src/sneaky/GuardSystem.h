@@ -0,0 +1,214 @@
+
+#ifndef H_SNEAKY_GUARD_SYSTEM_H
+#define H_SNEAKY_GUARD_SYSTEM_H
+
+#include "GuardSensors.h"
+#include "Navigation.h"
+
+#include "rob/renderer/Color.h"
+
+namespace rob
+{
+    class GameTime;
+    class JobSystem;
+    class Renderer;
+} // rob
+
+namespace sneaky
+{
+
+    class GameObject;
+    class SneakyState;
+
+    // Thinks for all the guards of the game, with the state of each guard in
+    // arrays indexed by the guard. An update gathers what the guards sense from
+    // the physics, lets the guards decide in parallel on the job system, and
+    // then applies the decisions to the physics and the navigation in order.
+    // The guards only write their own slots while deciding, and everything
+    // shared is left for the apply phase.
+    //
+    // The guards far from the player, or off the screen, think only on some of
+    // the updates, in buckets staggered by the slot of the guard, and just
+    // follow their paths on the updates in between.
+    class GuardSystem
+    {
+        enum class State : uint8_t
+        {
+            Watch,
+            Patrol,
+            Suspect,
+            Inspect,
+            Chase
+        };
+
+        // The changes to the physics decided for a guard.
+        enum OutputBits
+        {
+            OutLinearVelocity = 0x1,
+            OutAngularVelocity = 0x2,
+            OutRotation = 0x4,
+            OutPlayerCaught = 0x8
+        };
+
+        // The change to the path decided for a guard. The last one decided wins.
+        enum class NavCommand : uint8_t
+        {
+            None,
+            Clear,
+            Navigate,
+            NavigateRandom,
+            Chase,
+            RepathChase
+        };
+
+        enum SensorBits
+        {
+            RightHitsWall = 0x1,
+            LeftHitsWall = 0x2
+        };
+
+    public:
+        static const size_t MAX_GUARDS = 256;
+        // Guards decided by one job.
+        static const size_t GUARDS_PER_JOB = 16;
+        static const size_t MAX_LOD_TIERS = 4;
+
+        // The guards at least the distance of a tier away from the player think
+        // on every interval:th update.
+        struct LodTier
+        {
+            float distance;
+            uint32_t interval;
+        };
+
+        struct LodStats
+        {
+            uint32_t ticks[MAX_LOD_TIERS]; // Updates the guards of the tier thought on
+            uint32_t skips[MAX_LOD_TIERS]; // Updates the guards of the tier only moved on
+        };
+
+        explicit GuardSystem(SneakyState *game);
+
+        void SetNavigation(Navigation *nav);
+
+        // The tiers are ordered by distance, starting from zero.
+        void SetLodTiers(const LodTier *tiers, size_t count);
+        // The tiers are chosen by the distance from the focus, and the guards
+        // outside the view drop to the next tier. Every guard thinks on every
+        // update until the focus is set.
+        void SetLodFocus(const vec2f &position, const vec2f &viewMin, const vec2f &viewMax);
+        const LodStats& GetLodStats() const { return m_lodStats; }
+        void ResetLodStats();
+
+        // The slot of a guard is kept until the system is cleared, as the vision
+        // holds on to the nav agent of the guard.
+        size_t AddGuard(GameObject *guard, uint32_t seed);
+        void RemoveGuard(size_t guard);
+        void Clear();
+
+        void ReportSound(size_t guard, const vec2f &position, float volume);
+
+        void Update(const rob::GameTime &gameTime, rob::JobSystem &jobs);
+
+        void DebugRender(size_t guard, rob::Renderer *renderer) const;
+
+    private:
+        void Gather();
+        size_t GetLodTier(size_t guard) const;
+        static void DecideJob(void *data, size_t index, size_t thread);
+        void Decide(size_t guard, float dt);
+        void Coast(size_t guard);
+        void Apply();
+        void ApplyNavCommand(size_t guard);
+
+        float GetRandomReal(size_t guard, float a, float b);
+
+        void HearSound(size_t guard, const vec2f &position, float volume);
+
+        bool LookForPlayer(size_t guard);
+        void StartChasingIfPlayerSighted(size_t guard);
+        void StartSuspectingIfHeard(size_t guard);
+
+        void ChangeToSuspectState(size_t guard);
+        void ChangeToInspectState(size_t guard);
+        void ChangeToWatchState(size_t guard);
+        void ChangeToPatrolState(size_t guard);
+        void ChangeToChaseState(size_t guard);
+
+        void Move(size_t guard, float speed, float dt);
+        bool IsStuck(size_t guard) const { return m_stuckMeters[guard] > 5.0f; }
+        bool IsEndOfPath(size_t guard) const;
+        NavPriority GetPathPriority(size_t guard) const;
+
+        void Inspect(size_t guard, const vec2f &location);
+        void Navigate(size_t guard, const vec2f &pos);
+        void NavigateRandom(size_t guard);
+        void NavigateChase(size_t guard, const vec2f &pos);
+        void RepathChase(size_t guard, const vec2f &pos);
+        void ClearPath(size_t guard);
+
+        void UpdateSuspect(size_t guard);
+        void UpdateInspect(size_t guard, float dt);
+        void UpdateWatch(size_t guard, float dt);
+        void UpdatePatrol(size_t guard, float dt);
+        void UpdateChase(size_t guard, float dt);
+
+    private:
+        SneakyState *m_game;
+        Navigation *m_nav;
+        float m_deltaTime; // Of the update being decided
+        size_t m_guardCount;
+
+        LodTier m_lodTiers[MAX_LOD_TIERS];
+        size_t m_lodTierCount;
+        bool m_hasLodFocus;
+        vec2f m_lodFocus;
+        vec2f m_lodViewMin, m_lodViewMax;
+        uint32_t m_updateIndex; // Staggers the buckets of the tiers
+        LodStats m_lodStats;
+
+        GameObject *m_objects[MAX_GUARDS]; // Null for removed guards
+        size_t m_viewers[MAX_GUARDS]; // In the vision of the game
+        GuardLocalSensor m_rightSensors[MAX_GUARDS];
+        GuardLocalSensor m_leftSensors[MAX_GUARDS];
+        uint32_t m_randomStates[MAX_GUARDS];
+
+        // Gathered from the physics.
+        vec2f m_positions[MAX_GUARDS];
+        vec2f m_velocities[MAX_GUARDS];
+        float m_angles[MAX_GUARDS];
+        uint8_t m_sensorBits[MAX_GUARDS];
+        bool m_thinks[MAX_GUARDS]; // On this update
+        float m_thinkTimes[MAX_GUARDS]; // Passed since the guard last thought
+
+        State m_states[MAX_GUARDS];
+        float m_stateTimers[MAX_GUARDS];
+        float m_watchTimers[MAX_GUARDS];
+        float m_stuckMeters[MAX_GUARDS];
+        vec2f m_prevPositions[MAX_GUARDS];
+        vec2f m_lastKnownPlayerPos[MAX_GUARDS];
+
+        bool m_soundHeard[MAX_GUARDS];
+        vec2f m_soundSources[MAX_GUARDS];
+        float m_soundInterests[MAX_GUARDS];
+
+        NavAgent m_agents[MAX_GUARDS];
+        NavPath *m_paths[MAX_GUARDS];
+        size_t m_pathPos[MAX_GUARDS];
+        NavTicket m_pathTickets[MAX_GUARDS];
+        bool m_pathPending[MAX_GUARDS];
+        int m_pathRepairs[MAX_GUARDS];
+
+        // Decided for the apply phase.
+        uint8_t m_outputs[MAX_GUARDS];
+        vec2f m_linearVelocities[MAX_GUARDS];
+        float m_angularVelocities[MAX_GUARDS];
+        vec2f m_rotations[MAX_GUARDS];
+        rob::Color m_debugColors[MAX_GUARDS];
+        NavCommand m_navCommands[MAX_GUARDS];
+        vec2f m_navTargets[MAX_GUARDS];
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_GUARD_SYSTEM_H
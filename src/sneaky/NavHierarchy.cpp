@@ -0,0 +1,365 @@
+
+#include "NavHierarchy.h"
+
+#include "rob/time/MicroTicker.h"
+#include "rob/Assert.h"
+
+namespace sneaky
+{
+
+    static const size_t OPEN_CHUNK = 256;
+
+    NavHierarchy::NavHierarchy()
+        : m_alloc(nullptr)
+        , m_clustersX(0)
+        , m_buildTime(0)
+    { }
+
+    void NavHierarchy::SetAllocator(rob::LinearAllocator &alloc)
+    {
+        m_alloc = &alloc;
+        m_clusters.SetAllocator(alloc);
+        m_nodes.SetAllocator(alloc);
+        m_edges.SetAllocator(alloc);
+        m_faceCluster.SetAllocator(alloc);
+        m_faceNode.SetAllocator(alloc);
+    }
+
+    void NavHierarchy::Build(const NavMesh &mesh)
+    {
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t buildStart = ticker.GetTicks();
+
+        const size_t faceCount = mesh.GetFaceCount();
+        m_faceCluster.Resize(faceCount);
+        m_faceNode.Resize(faceCount);
+        for (size_t i = 0; i < faceCount; i++)
+        {
+            m_faceCluster[i] = NavMesh::InvalidIndex;
+            m_faceNode[i] = NavMesh::InvalidIndex;
+        }
+
+        const int tilesX = mesh.GetTilesX();
+        const int tilesY = mesh.GetTilesY();
+        m_clustersX = (tilesX + CLUSTER_TILES - 1) / CLUSTER_TILES;
+        const int clustersY = (tilesY + CLUSTER_TILES - 1) / CLUSTER_TILES;
+
+        for (size_t t = 0; t < mesh.GetTileCount(); t++)
+        {
+            const NavMesh::Tile &tile = mesh.GetTile(t);
+            const int tx = t % tilesX;
+            const int ty = t / tilesX;
+            const index_t cluster = (ty / CLUSTER_TILES) * m_clustersX + tx / CLUSTER_TILES;
+            for (index_t f = tile.firstFace; f < tile.firstFace + tile.faceCount; f++)
+            {
+                if (mesh.GetFace(f).vertexCount > 0)
+                    m_faceCluster[f] = cluster;
+            }
+        }
+
+        m_clusters.Clear();
+        m_nodes.Clear();
+        m_edges.Clear();
+        for (int cy = 0; cy < clustersY; cy++)
+        {
+            for (int cx = 0; cx < m_clustersX; cx++)
+                AddClusterNodes(mesh, cx, cy);
+        }
+
+        ReserveQuery(m_buildQuery);
+        for (size_t i = 0; i < m_nodes.GetSize(); i++)
+            AddNodeEdges(mesh, i);
+
+        m_buildTime = ticker.GetTicks() - buildStart;
+    }
+
+    void NavHierarchy::ReserveQuery(Query &query) const
+    {
+        query.faceStates.SetAllocator(*m_alloc);
+        query.nodeStates.SetAllocator(*m_alloc);
+        query.corridor.SetAllocator(*m_alloc);
+
+        const size_t faceCount = m_faceCluster.GetSize();
+        query.faceStates.Resize(faceCount);
+        for (size_t i = 0; i < faceCount; i++)
+            query.faceStates[i].search = 0;
+        query.search = 0;
+
+        const size_t nodeCount = m_nodes.GetSize();
+        query.nodeStates.Resize(nodeCount);
+        for (size_t i = 0; i < nodeCount; i++)
+            query.nodeStates[i].query = 0;
+
+        const size_t clusterCount = m_clusters.GetSize();
+        query.corridor.Resize(clusterCount);
+        for (size_t i = 0; i < clusterCount; i++)
+            query.corridor[i] = 0;
+        query.query = 0;
+
+        if (faceCount > query.faceOpenCapacity)
+        {
+            query.faceOpenCapacity = (faceCount + OPEN_CHUNK - 1) & ~(OPEN_CHUNK - 1);
+            query.faceOpen.Allocate(*m_alloc, query.faceOpenCapacity);
+        }
+        if (nodeCount > query.nodeOpenCapacity)
+        {
+            query.nodeOpenCapacity = (nodeCount + OPEN_CHUNK - 1) & ~(OPEN_CHUNK - 1);
+            query.nodeOpen.Allocate(*m_alloc, query.nodeOpenCapacity);
+        }
+    }
+
+    void NavHierarchy::AddClusterNodes(const NavMesh &mesh, int cx, int cy)
+    {
+        const index_t clusterIndex = m_clusters.GetSize();
+        Cluster &cluster = m_clusters.Push();
+        cluster.firstNode = m_nodes.GetSize();
+
+        const int tilesX = mesh.GetTilesX();
+        const int tilesY = mesh.GetTilesY();
+        const int tx1 = rob::Min((cx + 1) * CLUSTER_TILES, tilesX);
+        const int ty1 = rob::Min((cy + 1) * CLUSTER_TILES, tilesY);
+        for (int ty = cy * CLUSTER_TILES; ty < ty1; ty++)
+        {
+            for (int tx = cx * CLUSTER_TILES; tx < tx1; tx++)
+            {
+                const NavMesh::Tile &tile = mesh.GetTile(ty * tilesX + tx);
+                for (index_t f = tile.firstFace; f < tile.firstFace + tile.faceCount; f++)
+                {
+                    if (m_faceCluster[f] != clusterIndex)
+                        continue;
+
+                    const NavMesh::Face &face = mesh.GetFace(f);
+                    const index_t firstNode = m_nodes.GetSize();
+                    for (size_t i = 0; i < face.vertexCount; i++)
+                    {
+                        const index_t n = face.neighbours[i];
+                        if (n == NavMesh::InvalidIndex || m_faceCluster[n] == clusterIndex)
+                            continue;
+
+                        // A face can be linked to the same face by more than one edge.
+                        if (FindLinkNode(f, n) != NavMesh::InvalidIndex)
+                            continue;
+
+                        if (m_faceNode[f] == NavMesh::InvalidIndex)
+                            m_faceNode[f] = firstNode;
+                        Node &node = m_nodes.Push();
+                        node.face = f;
+                        node.neighbour = n;
+                        node.cluster = clusterIndex;
+                        node.link = NavMesh::InvalidIndex;
+                        node.firstEdge = 0;
+                        node.edgeCount = 0;
+                        node.pos = mesh.GetEdgeCenter(f, i);
+                    }
+                }
+            }
+        }
+        cluster.nodeCount = m_nodes.GetSize() - cluster.firstNode;
+    }
+
+    void NavHierarchy::AddNodeEdges(const NavMesh &mesh, index_t n)
+    {
+        Node &node = m_nodes[n];
+        node.link = FindLinkNode(node.neighbour, node.face);
+        node.firstEdge = m_edges.GetSize();
+
+        // Costs to the other nodes of the cluster.
+        Query &query = m_buildQuery;
+        SearchCluster(mesh, query, node.face, node.pos);
+        const Cluster &cluster = m_clusters[node.cluster];
+        for (index_t o = cluster.firstNode; o < cluster.firstNode + cluster.nodeCount; o++)
+        {
+            const Node &target = m_nodes[o];
+            const FaceState &state = query.faceStates[target.face];
+            if (o == n || state.search != query.search)
+                continue;
+
+            Edge &edge = m_edges.Push();
+            edge.node = o;
+            edge.cost = state.dist + rob::Distance(state.pos, target.pos);
+        }
+
+        node.edgeCount = m_edges.GetSize() - node.firstEdge;
+    }
+
+    index_t NavHierarchy::FindLinkNode(index_t face, index_t neighbour) const
+    {
+        const index_t first = m_faceNode[face];
+        if (first == NavMesh::InvalidIndex)
+            return NavMesh::InvalidIndex;
+        for (index_t n = first; n < m_nodes.GetSize() && m_nodes[n].face == face; n++)
+        {
+            if (m_nodes[n].neighbour == neighbour)
+                return n;
+        }
+        return NavMesh::InvalidIndex;
+    }
+
+    // Dijkstra over the faces of the cluster of the start face. As in the face
+    // search of Navigation, a face is entered at the center of the edge it was
+    // first reached through.
+    void NavHierarchy::SearchCluster(const NavMesh &mesh, Query &query, index_t startFace, const vec2f &startPos) const
+    {
+        query.search++;
+        query.faceOpen.Clear();
+
+        const index_t cluster = m_faceCluster[startFace];
+
+        FaceState &start = query.faceStates[startFace];
+        start.pos = startPos;
+        start.dist = 0.0f;
+        start.search = query.search;
+        query.faceOpen.Push(startFace, start.dist);
+
+        while (!query.faceOpen.IsEmpty())
+        {
+            const index_t u = query.faceOpen.Pop();
+            const NavMesh::Face &face = mesh.GetFace(u);
+            const vec2f posU = query.faceStates[u].pos;
+            const float distU = query.faceStates[u].dist;
+
+            for (size_t i = 0; i < face.vertexCount; i++)
+            {
+                const index_t v = face.neighbours[i];
+                if (v == NavMesh::InvalidIndex || m_faceCluster[v] != cluster)
+                    continue;
+
+                FaceState &state = query.faceStates[v];
+                if (state.search != query.search)
+                {
+                    state.pos = mesh.GetEdgeCenter(u, i);
+                    state.dist = distU + rob::Distance(posU, state.pos);
+                    state.search = query.search;
+                    query.faceOpen.Push(v, state.dist);
+                    continue;
+                }
+
+                // Faces already popped never get a shorter distance.
+                const float alt = distU + rob::Distance(posU, state.pos);
+                if (alt < state.dist)
+                {
+                    state.dist = alt;
+                    query.faceOpen.DecreaseKey(v, alt);
+                }
+            }
+        }
+    }
+
+    NavHierarchy::NodeState &NavHierarchy::VisitNode(Query &query, index_t node)
+    {
+        NodeState &state = query.nodeStates[node];
+        if (state.query != query.query)
+        {
+            state.dist = 1e6f;
+            state.endDist = 1e6f;
+            state.prev = NavMesh::InvalidIndex;
+            state.query = query.query;
+            state.linked = false;
+            state.closed = false;
+        }
+        return state;
+    }
+
+    void NavHierarchy::RelaxNode(Query &query, index_t node, index_t prev, float dist, bool linked, const vec2f &end) const
+    {
+        NodeState &state = VisitNode(query, node);
+        if (state.closed || dist >= state.dist)
+            return;
+
+        const bool open = (state.dist < 1e6f);
+        state.dist = dist;
+        state.prev = prev;
+        state.linked = linked;
+
+        const float total = dist + rob::Distance(m_nodes[node].pos, end);
+        if (open)
+            query.nodeOpen.DecreaseKey(node, total);
+        else
+            query.nodeOpen.Push(node, total);
+    }
+
+    bool NavHierarchy::FindCorridor(const NavMesh &mesh, Query &query, const vec2f &start, const vec2f &end, index_t startFace, index_t endFace) const
+    {
+        const index_t startCluster = m_faceCluster[startFace];
+        const index_t endCluster = m_faceCluster[endFace];
+        if (startCluster == NavMesh::InvalidIndex || endCluster == NavMesh::InvalidIndex)
+            return false;
+
+        const int dx = rob::Abs(int(startCluster % m_clustersX) - int(endCluster % m_clustersX));
+        const int dy = rob::Abs(int(startCluster / m_clustersX) - int(endCluster / m_clustersX));
+        if (rob::Max(dx, dy) < MIN_CLUSTER_DIST)
+            return false;
+
+        query.query++;
+        query.nodeOpen.Clear();
+
+        // The start and the end are connected to the nodes of their clusters
+        // by searching the clusters for the query.
+        SearchCluster(mesh, query, endFace, end);
+        const Cluster &endC = m_clusters[endCluster];
+        for (index_t n = endC.firstNode; n < endC.firstNode + endC.nodeCount; n++)
+        {
+            const FaceState &state = query.faceStates[m_nodes[n].face];
+            if (state.search == query.search)
+                VisitNode(query, n).endDist = state.dist + rob::Distance(state.pos, m_nodes[n].pos);
+        }
+
+        SearchCluster(mesh, query, startFace, start);
+        const Cluster &startC = m_clusters[startCluster];
+        for (index_t n = startC.firstNode; n < startC.firstNode + startC.nodeCount; n++)
+        {
+            const FaceState &state = query.faceStates[m_nodes[n].face];
+            if (state.search != query.search)
+                continue;
+            NodeState &nodeState = VisitNode(query, n);
+            nodeState.dist = state.dist + rob::Distance(state.pos, m_nodes[n].pos);
+            query.nodeOpen.Push(n, nodeState.dist + rob::Distance(m_nodes[n].pos, end));
+        }
+
+        float bestDist = 1e6f;
+        index_t bestNode = NavMesh::InvalidIndex;
+
+        while (!query.nodeOpen.IsEmpty())
+        {
+            const index_t u = query.nodeOpen.Pop();
+            const Node &node = m_nodes[u];
+            NodeState &stateU = query.nodeStates[u];
+            stateU.closed = true;
+
+            // Costs are lengths of paths between the nodes, never less than the
+            // straight line distance, so the heuristic is admissible.
+            if (stateU.dist + rob::Distance(node.pos, end) >= bestDist)
+                break;
+
+            if (stateU.dist + stateU.endDist < bestDist)
+            {
+                bestDist = stateU.dist + stateU.endDist;
+                bestNode = u;
+            }
+
+            // The edge costs are the shortest paths within the cluster, so the
+            // edges are only taken from the nodes entered from another cluster.
+            if (node.link != NavMesh::InvalidIndex)
+                RelaxNode(query, node.link, u, stateU.dist + rob::Distance(node.pos, m_nodes[node.link].pos), true, end);
+            if (!stateU.linked)
+                continue;
+
+            for (index_t e = node.firstEdge; e < node.firstEdge + node.edgeCount; e++)
+            {
+                const Edge &edge = m_edges[e];
+                RelaxNode(query, edge.node, u, stateU.dist + edge.cost, false, end);
+            }
+        }
+
+        if (bestNode == NavMesh::InvalidIndex)
+            return false;
+
+        query.corridor[startCluster] = query.query;
+        query.corridor[endCluster] = query.query;
+        for (index_t n = bestNode; n != NavMesh::InvalidIndex; n = query.nodeStates[n].prev)
+            query.corridor[m_nodes[n].cluster] = query.query;
+        return true;
+    }
+
+} // sneaky
@@ -0,0 +1,144 @@
+
+#ifndef H_SNEAKY_NAV_HIERARCHY_H
+#define H_SNEAKY_NAV_HIERARCHY_H
+
+#include "NavMesh.h"
+#include "NodeHeap.h"
+
+#include "rob/memory/ChunkArray.h"
+
+namespace sneaky
+{
+
+    // Abstract graph over the nav mesh for hierarchical path finding (HPA*). The
+    // tiles are grouped into square clusters, and the edges linking the faces of
+    // two clusters are the nodes of the graph. The costs between the nodes of
+    // the same cluster are precomputed, so a long path is planned over the
+    // clusters first, and the face search is restricted to the clusters it crosses.
+    class NavHierarchy
+    {
+        struct Cluster
+        {
+            index_t firstNode;
+            index_t nodeCount;
+        };
+
+        // A node is on the side of the face, at the center of the edge to the
+        // neighbour in the other cluster.
+        struct Node
+        {
+            index_t face;
+            index_t neighbour;
+            index_t cluster;
+            index_t link; // The node on the other side of the edge
+            index_t firstEdge; // Edges to the other nodes of the cluster
+            index_t edgeCount;
+            vec2f pos;
+        };
+
+        struct Edge
+        {
+            index_t node;
+            float cost;
+        };
+
+        struct FaceState
+        {
+            vec2f pos;
+            float dist;
+            uint32_t search;
+        };
+
+        struct NodeState
+        {
+            float dist;
+            float endDist;
+            index_t prev;
+            uint32_t query;
+            bool linked; // Reached from the other side of the edge
+            bool closed;
+        };
+
+    public:
+        // Scratch of the searches. Queries are reentrant with a Query each, and
+        // the graph is only read by them.
+        struct Query
+        {
+            rob::ChunkArray<FaceState, 1024> faceStates;
+            rob::ChunkArray<NodeState, 256> nodeStates;
+            rob::ChunkArray<uint32_t, 64> corridor; // Query stamp of the clusters in the corridor
+            NodeHeap faceOpen;
+            NodeHeap nodeOpen;
+            size_t faceOpenCapacity;
+            size_t nodeOpenCapacity;
+            uint32_t search;
+            uint32_t query;
+
+            Query()
+                : faceOpenCapacity(0)
+                , nodeOpenCapacity(0)
+                , search(0)
+                , query(0)
+            { }
+        };
+
+        static const int CLUSTER_TILES = 2;
+        // Closer faces are found faster by the face search alone.
+        static const int MIN_CLUSTER_DIST = 4;
+
+        NavHierarchy();
+
+        void SetAllocator(rob::LinearAllocator &alloc);
+
+        // Rebuilds the whole graph after the faces of the mesh have changed. The
+        // queries must be reserved again after that.
+        void Build(const NavMesh &mesh);
+        void ReserveQuery(Query &query) const;
+
+        size_t GetClusterCount() const
+        { return m_clusters.GetSize(); }
+        size_t GetNodeCount() const
+        { return m_nodes.GetSize(); }
+        size_t GetEdgeCount() const
+        { return m_edges.GetSize(); }
+        rob::Time_t GetBuildTime() const
+        { return m_buildTime; }
+
+        index_t GetFaceCluster(index_t face) const
+        { return m_faceCluster[face]; }
+
+        // Plans a path between the faces on the abstract graph and marks the
+        // clusters it passes as the corridor. Returns false if the clusters of the
+        // faces are too close or no path was found, when the corridor is not usable.
+        bool FindCorridor(const NavMesh &mesh, Query &query, const vec2f &start, const vec2f &end, index_t startFace, index_t endFace) const;
+
+        bool IsInCorridor(const Query &query, index_t face) const
+        { return query.corridor[m_faceCluster[face]] == query.query; }
+
+    private:
+        void AddClusterNodes(const NavMesh &mesh, int cx, int cy);
+        void AddNodeEdges(const NavMesh &mesh, index_t node);
+        index_t FindLinkNode(index_t face, index_t neighbour) const;
+        void SearchCluster(const NavMesh &mesh, Query &query, index_t startFace, const vec2f &startPos) const;
+
+        static NodeState &VisitNode(Query &query, index_t node);
+        void RelaxNode(Query &query, index_t node, index_t prev, float dist, bool linked, const vec2f &end) const;
+
+    private:
+        rob::LinearAllocator *m_alloc;
+
+        int m_clustersX;
+        rob::ChunkArray<Cluster, 64> m_clusters;
+        rob::ChunkArray<Node, 256> m_nodes;
+        rob::ChunkArray<Edge, 1024> m_edges;
+        rob::ChunkArray<index_t, 1024> m_faceCluster;
+        rob::ChunkArray<index_t, 1024> m_faceNode; // The first node of the face
+
+        Query m_buildQuery;
+
+        rob::Time_t m_buildTime;
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_NAV_HIERARCHY_H
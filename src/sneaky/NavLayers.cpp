@@ -0,0 +1,116 @@
+
+#include "NavLayers.h"
+
+#include "rob/memory/LinearAllocator.h"
+#include "rob/Assert.h"
+#include "rob/Log.h"
+
+namespace sneaky
+{
+
+    NavLayers::NavLayers()
+        : m_alloc(nullptr)
+        , m_world(nullptr)
+        , m_layerCount(0)
+    {
+        for (size_t i = 0; i < MAX_LAYERS; i++)
+        {
+            m_layers[i] = nullptr;
+            m_radii[i] = 0.0f;
+        }
+    }
+
+    NavLayers::~NavLayers()
+    {
+        // The largest layer owns the staging shared by the others.
+        for (size_t i = m_layerCount; i > 0; i--)
+            m_alloc->del_object(m_layers[i - 1]);
+    }
+
+    // The baked nav meshes are named by the radius in centimeters.
+    static inline uint32_t GetRadiusKey(float radius)
+    { return uint32_t(radius * 100.0f + 0.5f); }
+
+    bool NavLayers::Create(rob::LinearAllocator &alloc, rob::JobSystem &jobs, const b2World *world, const float worldHalfW, const float worldHalfH,
+                           const float *agentRadii, size_t radiusCount, const uint32_t seed, const bool bake)
+    {
+        ROB_ASSERT(m_layerCount == 0);
+        m_alloc = &alloc;
+        m_world = world;
+
+        for (size_t i = 0; i < radiusCount; i++)
+        {
+            const float radius = agentRadii[i];
+            size_t pos = 0;
+            while (pos < m_layerCount && m_radii[pos] > radius && GetRadiusKey(m_radii[pos]) != GetRadiusKey(radius))
+                pos++;
+            if (pos < m_layerCount && GetRadiusKey(m_radii[pos]) == GetRadiusKey(radius))
+                continue;
+
+            ROB_ASSERT(m_layerCount < MAX_LAYERS);
+            for (size_t j = m_layerCount; j > pos; j--)
+                m_radii[j] = m_radii[j - 1];
+            m_radii[pos] = radius;
+            m_layerCount++;
+        }
+
+        NavMesh::Obstacles obstacles;
+        obstacles.margin = m_radii[0];
+
+        bool baked = true;
+        for (size_t i = 0; i < m_layerCount; i++)
+        {
+            Navigation *layer = alloc.new_object<Navigation>();
+            if (i > 0) layer->GetMesh().ShareStaging(&m_layers[0]->GetMesh());
+            baked = layer->CreateNavMesh(alloc, jobs, world, worldHalfW, worldHalfH, m_radii[i], seed, bake, &obstacles) && baked;
+            m_layers[i] = layer;
+
+            rob::log::Info("NavLayers: Radius ", m_radii[i], ", faces: ", layer->GetMesh().GetFaceCount(),
+                           ", size: ", layer->GetMesh().GetByteSize(), " bytes");
+        }
+        return baked;
+    }
+
+    void NavLayers::Rebuild(const vec2f &minP, const vec2f &maxP)
+    {
+        // The tiles rebuilt for the largest radius cover those of the others, so
+        // the obstacles it merges are enough for every layer.
+        NavMesh::Obstacles obstacles;
+        obstacles.margin = m_radii[0];
+        for (size_t i = 0; i < m_layerCount; i++)
+            m_layers[i]->RebuildNavMesh(minP, maxP, &obstacles);
+    }
+
+    void NavLayers::UpdateQueries(rob::Time_t budget)
+    {
+        // The layers share the budget evenly.
+        const rob::Time_t layerBudget = budget / rob::Max(m_layerCount, size_t(1));
+        for (size_t i = 0; i < m_layerCount; i++)
+            m_layers[i]->UpdateQueries(layerBudget);
+    }
+
+    void NavLayers::UpdateVisibility(rob::Time_t budget)
+    {
+        // The layers update one at a time, from the largest radius.
+        for (size_t i = 0; i < m_layerCount; i++)
+        {
+            if (m_layers[i]->GetMesh().IsVisibilityPending())
+            {
+                m_layers[i]->UpdateVisibility(budget);
+                return;
+            }
+        }
+    }
+
+    Navigation& NavLayers::GetLayer(float agentRadius)
+    {
+        ROB_ASSERT(m_layerCount > 0);
+        for (size_t i = m_layerCount; i > 0; i--)
+        {
+            if (GetRadiusKey(m_radii[i - 1]) >= GetRadiusKey(agentRadius))
+                return *m_layers[i - 1];
+        }
+        return *m_layers[0];
+    }
+
+} // sneaky
@@ -0,0 +1,62 @@
+
+#ifndef H_SNEAKY_NAV_LAYERS_H
+#define H_SNEAKY_NAV_LAYERS_H
+
+#include "Navigation.h"
+
+namespace sneaky
+{
+
+    // Navigation for agents of different sizes, with a nav mesh layer for each
+    // agent radius. The layers are built together: the static obstacles are
+    // merged once and only grown by each radius, and the layers share the tile
+    // staging. Radii that bake to the same mesh share one layer.
+    class NavLayers
+    {
+    public:
+        static const size_t MAX_LAYERS = 4;
+
+        NavLayers();
+        ~NavLayers();
+
+        NavLayers(const NavLayers&) = delete;
+        NavLayers& operator = (const NavLayers&) = delete;
+
+        // Loads or builds the layers of the radii, and bakes the built ones if
+        // baking is asked for. Returns true, if every layer was loaded from a baked
+        // nav mesh.
+        bool Create(rob::LinearAllocator &alloc, rob::JobSystem &jobs, const b2World *world, const float worldHalfW, const float worldHalfH,
+                    const float *agentRadii, size_t radiusCount, const uint32_t seed, const bool bake);
+
+        // Rebuilds the tiles of every layer around an area after static bodies
+        // have changed there.
+        void Rebuild(const vec2f &minP, const vec2f &maxP);
+
+        void UpdateQueries(rob::Time_t budget);
+        void UpdateVisibility(rob::Time_t budget);
+
+        // Returns the layer of the smallest radius the agent fits, or the largest
+        // layer if it fits none.
+        Navigation& GetLayer(float agentRadius);
+
+        size_t GetLayerCount() const
+        { return m_layerCount; }
+        Navigation& GetLayerAt(size_t index)
+        { return *m_layers[index]; }
+        float GetLayerRadius(size_t index) const
+        { return m_radii[index]; }
+
+    private:
+        rob::LinearAllocator *m_alloc;
+        const b2World *m_world;
+
+        // From the largest radius to the smallest. The largest layer owns the
+        // staging, and merges the obstacles for the others.
+        Navigation *m_layers[MAX_LAYERS];
+        float m_radii[MAX_LAYERS];
+        size_t m_layerCount;
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_NAV_LAYERS_H
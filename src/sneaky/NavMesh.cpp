@@ -2,11 +2,18 @@
 #include "NavMesh.h"
 
 #include "rob/memory/LinearAllocator.h"
+#include "rob/filesystem/FileSystem.h"
+#include "rob/filesystem/FileStat.h"
+#include "rob/time/MicroTicker.h"
+#include "rob/thread/JobSystem.h"
+#include "rob/math/simd/Simd.h"
+#include "rob/math/Random.h"
 #include "rob/Assert.h"
 #include "rob/Log.h"
 
 #include <clipper.hpp>
-#include <polypartition.h>
+
+#include <algorithm>
 
 namespace sneaky
 {
@@ -28,34 +35,173 @@ namespace sneaky
         bool m_hit;
     };
 
+    // A tile is built on a thread into a staging mesh of the thread, and the
+    // result is merged into the nav mesh in tile order. The faces and vertices
+    // of a tile do not depend on the thread that built it.
+    struct NavMesh::TileStaging
+    {
+        explicit TileStaging(size_t memorySize)
+            : alloc(memorySize)
+            , mesh()
+        { mesh.Allocate(alloc); }
+
+        rob::LinearAllocator alloc;
+        NavMesh mesh;
+    };
+
+    struct NavMesh::TileBuild
+    {
+        std::vector<Face> faces;
+        std::vector<Vert> vertices;
+        std::vector<std::vector<vec2f> > solids;
+        std::vector<std::vector<vec2f> > holes;
+        BuildStats stats;
+        bool outOfMemory; // The tile did not fit the staging arena, and is left empty
+    };
+
+    struct NavMesh::TileJobs
+    {
+        NavMesh *mesh;
+        TileStaging **staging;
+        const size_t *tiles;
+        const ClipperLib::Paths *obstacles;
+        const ClipperLib::IntRect *obstacleBounds;
+        TileBuild *builds;
+    };
+
+    struct NavMesh::VisibilityJobs
+    {
+        const NavMesh *mesh;
+        const b2World *world;
+        const vec2f *samples;
+        const size_t *sampleCounts;
+        const index_t *rowFaces; // The faces of the rows computed
+        const size_t *faceRows; // The row of each face, if computed
+        uint32_t *rows; // Full rows of the matrix, each job fills the row faces below its own
+        size_t rowWords;
+        size_t rowJobs; // Jobs per row, each casting to a run of the faces
+        size_t firstJob;
+    };
+
+    // The visibility of the faces around the rebuilt tiles, while its rows are
+    // cast over several updates.
+    struct NavMesh::VisibilityUpdate
+    {
+        std::vector<size_t> tiles; // Rebuilt since the visibility was up to date
+        std::vector<index_t> written;
+        std::vector<index_t> rowFaces;
+        std::vector<size_t> faceRows;
+        std::vector<vec2f> samples;
+        std::vector<size_t> sampleCounts;
+        std::vector<uint32_t> rows;
+        size_t rowWords;
+        size_t rowJobs;
+        size_t jobsDone;
+        bool rebuild;
+        rob::Time_t time;
+    };
+
+    // Stops at the first static body, as only the static geometry is baked into
+    // the visibility.
+    class StaticRayTest : public b2RayCastCallback
+    {
+    public:
+        StaticRayTest() : m_hit(false) { }
+
+        float32 ReportFixture(b2Fixture *fixture, const b2Vec2 &point, const b2Vec2 &normal, float32 fraction) override
+        {
+            if (fixture->GetBody()->GetType() != b2_staticBody)
+                return -1;
+            m_hit = true;
+            return 0;
+        }
+
+        bool ShouldQueryParticleSystem(const b2ParticleSystem* particleSystem) override
+        { return false; }
+
+        bool m_hit;
+    };
+
+    static const size_t TILE_STAGING_MEMORY = 256 * 1024;
+    // The staging arena is doubled up to this for a tile that does not fit.
+    static const size_t TILE_STAGING_MAX_MEMORY = 64 * 1024 * 1024;
+    // The center and the corners of a face.
+    static const size_t MAX_VISIBILITY_SAMPLES = NavMesh::MAX_FACE_VERTICES + 1;
+    static const size_t NO_VISIBILITY_ROW = ~size_t(0);
+    // The faces a visibility job casts to, a multiple of the bits in a row word.
+    static const size_t VISIBILITY_JOB_FACES = 64;
+
 
     NavMesh::NavMesh()
-        : m_faceCount(0)
-        , m_faces(nullptr)
-        , m_vertexCount(0)
-        , m_vertices(nullptr)
+        : m_alloc(nullptr)
+        , m_faces()
+        , m_vertices()
+        , m_weld()
+        , m_triangulator()
+        , m_grid()
+        , m_faceEdges(nullptr)
+        , m_faceEdgeCapacity(0)
+        , m_visibility(nullptr)
+        , m_visibilityCapacity(0)
+        , m_visibilityFaces(0)
+        , m_visibilityUpdate(nullptr)
+        , m_visibilityPending(false)
+        , m_componentCount(0)
+        , m_componentStack(nullptr)
+        , m_componentStackCapacity(0)
+        , m_halfW(0.0f)
+        , m_halfH(0.0f)
+        , m_agentRadius(0.0f)
+        , m_tilesX(0)
+        , m_tilesY(0)
+        , m_tiles(nullptr)
+        , m_freeFaces()
+        , m_freeVertices()
+        , m_staging(nullptr)
+        , m_stagingCount(0)
+        , m_stagingOwner(nullptr)
+        , m_revision(0)
+        , m_stats()
     { }
 
     NavMesh::~NavMesh()
-    { }
+    {
+        for (size_t i = 0; i < m_stagingCount; i++)
+            m_alloc->del_object(m_staging[i]);
+        if (m_visibilityUpdate)
+            m_alloc->del_object(m_visibilityUpdate);
+    }
 
     size_t NavMesh::GetByteSize() const
     {
-        size_t size = MAX_FACES * sizeof(Face)
-            + MAX_VERTICES * sizeof(Vert);
+        size_t size = m_faces.GetByteSize()
+            + m_vertices.GetByteSize()
+            + m_grid.cellCapacity * sizeof(index_t)
+            + m_grid.faceCapacity * sizeof(index_t)
+            + m_faceEdgeCapacity * sizeof(FaceEdges)
+            + m_visibilityCapacity * sizeof(uint32_t)
+            + m_componentStackCapacity * sizeof(index_t)
+            + m_tilesX * m_tilesY * sizeof(Tile);
         return sizeof(NavMesh) + size;
     }
     size_t NavMesh::GetByteSizeUsed() const
     {
-        size_t size = m_faceCount * sizeof(Face)
-            + m_vertexCount * sizeof(Vert);
+        size_t size = m_faces.GetSize() * sizeof(Face)
+            + m_vertices.GetSize() * sizeof(Vert)
+            + m_grid.cellCapacity * sizeof(index_t)
+            + m_grid.faceCapacity * sizeof(index_t)
+            + m_faceEdgeCapacity * sizeof(FaceEdges)
+            + GetVisibilityByteSize()
+            + m_componentStackCapacity * sizeof(index_t)
+            + m_tilesX * m_tilesY * sizeof(Tile);
         return sizeof(NavMesh) + size;
     }
 
     void NavMesh::Allocate(rob::LinearAllocator &alloc)
     {
-        m_faces = alloc.AllocateArray<Face>(MAX_FACES);
-        m_vertices = alloc.AllocateArray<Vert>(MAX_VERTICES);
+        m_alloc = &alloc;
+        m_faces.SetAllocator(alloc);
+        m_vertices.SetAllocator(alloc);
     }
 
     void ClassifyPaths(const ClipperLib::Paths &paths, ClipperLib::Paths &solids, ClipperLib::Paths &holes)
@@ -65,6 +211,8 @@ namespace sneaky
         for (size_t pl = 0; pl < paths.size(); pl++)
         {
             const ClipperLib::Path &path = paths[pl];
+            if (path.size() < 3)
+                continue;
 
             int orientation = 0;
             for (size_t p = 1; p < path.size(); p++)
@@ -124,41 +272,60 @@ namespace sneaky
         return offt.Length2();
     }
 
-    void AddPolyPath(TPPLPoly &poly, const ClipperLib::Path &path, const float clipperScale, const float steinerStep = 12.0f)
+    static const float CLIPPER_SCALE = 8.0f;
+    static const float SOLID_STEINER_STEP = 12.0f;
+    static const float HOLE_STEINER_STEP = 16.0f;
+
+    static inline ClipperLib::cInt ToClipper(float x)
+    { return ClipperLib::cInt(std::floor(x * CLIPPER_SCALE + 0.5f)); }
+
+    static inline bool IsOnTileBorder(const ClipperLib::IntRect &rect, const ClipperLib::IntPoint &p)
     {
-        size_t pathSize = 0;
-        {
-            for (size_t p = 1; p < path.size(); p++)
-            {
-                const ClipperLib::IntPoint &ip0 = path[p - 1];
-                const ClipperLib::IntPoint &ip1 = path[p];
-                const vec2f p0 = vec2f(ip0.X, ip0.Y) / clipperScale;
-                const vec2f p1 = vec2f(ip1.X, ip1.Y) / clipperScale;
+        return p.X == rect.left || p.X == rect.right || p.Y == rect.top || p.Y == rect.bottom;
+    }
 
-                vec2f v = p1 - p0;
-                const int cnt = int(v.Length() / steinerStep) + 1;
-                pathSize += cnt;
-            }
-            const ClipperLib::IntPoint &ip0 = path[path.size() - 1];
-            const ClipperLib::IntPoint &ip1 = path[0];
-            const vec2f p0 = vec2f(ip0.X, ip0.Y) / clipperScale;
-            const vec2f p1 = vec2f(ip1.X, ip1.Y) / clipperScale;
+    static inline bool IsTileBorderEdge(const ClipperLib::IntRect &rect, const ClipperLib::IntPoint &p0, const ClipperLib::IntPoint &p1)
+    {
+        return (p0.X == p1.X && (p0.X == rect.left || p0.X == rect.right))
+            || (p0.Y == p1.Y && (p0.Y == rect.top || p0.Y == rect.bottom));
+    }
 
-            vec2f v = p1 - p0;
-            const int cnt = int(v.Length() / steinerStep) + 1;
-            pathSize += cnt;
+    // Splits a tile border edge at multiples of the step along the border, so that
+    // the tiles on both sides of the border get the same vertices.
+    void AddBorderSteinerPoints(std::vector<vec2f> &points, const vec2f &p0, const vec2f &p1, const float steinerStep)
+    {
+        const int axis = (p0.x == p1.x) ? 1 : 0;
+        const float t0 = (axis == 0) ? p0.x : p0.y;
+        const float t1 = (axis == 0) ? p1.x : p1.y;
+        const float minGap = steinerStep / 4.0f;
+
+        const float dir = (t1 > t0) ? 1.0f : -1.0f;
+        float k = (dir > 0.0f) ? std::floor(t0 / steinerStep) + 1.0f : std::ceil(t0 / steinerStep) - 1.0f;
+        for (;; k += dir)
+        {
+            const float t = k * steinerStep;
+            if ((t - t0) * dir < minGap) continue;
+            if ((t1 - t) * dir < minGap) break;
+            points.push_back(axis == 0 ? vec2f(t, p0.y) : vec2f(p0.x, t));
         }
+    }
 
-        rob::log::Debug("AddPath: pathsize ", pathSize);
-        poly.Init(pathSize);
-
-        size_t n = 0;
-        for (size_t p = 1; p < path.size(); p++)
+    void AddPolyPath(std::vector<vec2f> &points, const ClipperLib::Path &path, const ClipperLib::IntRect &tileRect, const float steinerStep)
+    {
+        points.reserve(path.size() * 2);
+        for (size_t p = 0; p < path.size(); p++)
         {
-            const ClipperLib::IntPoint &ip0 = path[p - 1];
-            const ClipperLib::IntPoint &ip1 = path[p];
-            const vec2f p0 = vec2f(ip0.X, ip0.Y) / clipperScale;
-            const vec2f p1 = vec2f(ip1.X, ip1.Y) / clipperScale;
+            const ClipperLib::IntPoint &ip0 = path[p];
+            const ClipperLib::IntPoint &ip1 = path[(p + 1) % path.size()];
+            const vec2f p0 = vec2f(ip0.X, ip0.Y) / CLIPPER_SCALE;
+            const vec2f p1 = vec2f(ip1.X, ip1.Y) / CLIPPER_SCALE;
+
+            if (IsTileBorderEdge(tileRect, ip0, ip1))
+            {
+                points.push_back(p0);
+                AddBorderSteinerPoints(points, p0, p1, steinerStep);
+                continue;
+            }
 
             vec2f v = p1 - p0;
             const int cnt = int(v.Length() / steinerStep) + 1;
@@ -166,116 +333,134 @@ namespace sneaky
             const vec2f no = vec2f(-v.y, v.x).Normalized();
             for (int i = 0; i < cnt; i++)
             {
-                const vec2f sp = p0 + v * i - no * 0.1f;
-                poly[n].x = sp.x;
-                poly[n].y = sp.y;
-                n++;
+                // Points on the tile border are not nudged, as they must match the neighbouring tile.
+                if (i == 0 && IsOnTileBorder(tileRect, ip0))
+                    points.push_back(p0);
+                else
+                    points.push_back(p0 + v * i - no * 0.1f);
             }
         }
-        const ClipperLib::IntPoint &ip0 = path[path.size() - 1];
-        const ClipperLib::IntPoint &ip1 = path[0];
-        const vec2f p0 = vec2f(ip0.X, ip0.Y) / clipperScale;
-        const vec2f p1 = vec2f(ip1.X, ip1.Y) / clipperScale;
-
-        vec2f v = p1 - p0;
-        const int cnt = int(v.Length() / steinerStep) + 1;
-        v /= cnt;
-        const vec2f no = vec2f(-v.y, v.x).Normalized();
-        for (int i = 0; i < cnt; i++)
-        {
-            const vec2f sp = p0 + v * i - no * 0.1f;
-            poly[n].x = sp.x;
-            poly[n].y = sp.y;
-            n++;
-        }
+        rob::log::Debug("AddPath: pathsize ", points.size());
     }
 
-    void NavMesh::TriangulatePath(const ClipperLib::Path &path, const ClipperLib::Paths &holes, const float clipperScale)
+    bool NavMesh::TriangulatePath(const ClipperLib::Path &path, const ClipperLib::Paths &holes, const ClipperLib::IntRect &tileRect)
     {
-        TPPLPartition partition;
-        std::list<TPPLPoly> polys;
-        polys.resize(holes.size() + 1 - 0);
-
-        std::list<TPPLPoly>::iterator polyIt = polys.begin();
-        TPPLPoly &poly = *polyIt;
-        AddPolyPath(poly, path, clipperScale);
-//        poly.Init(path.size());
-//        for (size_t i = 0; i < path.size(); i++)
-//        {
-//            const ClipperLib::IntPoint &ip = path[i];
-//            poly[i].x = ip.X / clipperScale;
-//            poly[i].y = ip.Y / clipperScale;
-//        }
-        poly.SetHole(false);
-        ROB_ASSERT(poly.GetOrientation() == TPPL_CCW);
-
-        ++polyIt;
-        for (size_t h = 0; h + 0 < holes.size(); h++, ++polyIt)
+        std::vector<std::vector<vec2f> > loops(holes.size() + 1);
+        AddPolyPath(loops[0], path, tileRect, SOLID_STEINER_STEP);
+        size_t maxVertices = loops[0].size();
+        for (size_t h = 0; h < holes.size(); h++)
         {
-            const ClipperLib::Path &holePath = holes[h];
-            TPPLPoly &hole = *polyIt;
-            AddPolyPath(hole, holePath, clipperScale, 16.0f);
-//            hole.Init(holePath.size());
-//            for (size_t i = 0; i < holePath.size(); i++)
-//            {
-//                const ClipperLib::IntPoint &ip = holePath[i];
-//                hole[i].x = ip.X / clipperScale;
-//                hole[i].y = ip.Y / clipperScale;
-//            }
-            hole.SetHole(true);
-            ROB_ASSERT(hole.GetOrientation() == TPPL_CW);
+            AddPolyPath(loops[h + 1], holes[h], tileRect, HOLE_STEINER_STEP);
+            maxVertices += loops[h + 1].size();
         }
 
-        std::list<TPPLPoly> tris;
-        int result = partition.Triangulate_EC(&polys, &tris);
-        rob::log::Debug("Triangulate_EC: ", result);
+        // Triangulation does not add vertices, and the polygons with their holes
+        // have fewer than two triangles per vertex. The room is made before any of
+        // them is added, so that a staging arena that runs out fails the tile.
+        if (!m_vertices.TryReserve(m_vertices.GetSize() + maxVertices) ||
+            !m_faces.TryReserve(m_faces.GetSize() + 2 * maxVertices))
+        {
+            return false;
+        }
 
-        std::list<TPPLPoly>::iterator it;
-        for (it = tris.begin(); it != tris.end(); ++it)
+        // The welding hash is sized by the polygons.
+        const size_t weldBuckets = 1024;
+        rob::LinearAllocator weldAlloc(rob::GetArraySize<index_t>(weldBuckets + maxVertices) + 2 * alignof(index_t));
+        m_weld.buckets = weldAlloc.AllocateArray<index_t>(weldBuckets);
+        m_weld.next = weldAlloc.AllocateArray<index_t>(maxVertices);
+        m_weld.bucketMask = weldBuckets - 1;
+        m_weld.firstVertex = m_vertices.GetSize();
+        m_weld.maxVertices = m_vertices.GetSize() + maxVertices;
+        for (size_t i = 0; i < weldBuckets; i++)
+            m_weld.buckets[i] = InvalidIndex;
+
+        // The welded vertices of the path are numbered in order from the first
+        // vertex, which gives the point indices of the triangulator. The outline
+        // and the holes are added as loops of constraint edges.
+        const index_t firstVertex = m_weld.firstVertex;
+        m_triangulator.Clear();
+        for (size_t l = 0; l < loops.size(); l++)
         {
-            TPPLPoly &tri = *it;
+            const std::vector<vec2f> &points = loops[l];
+            index_t first = InvalidIndex, prev = InvalidIndex;
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                index_t vi;
+                const Vert *v = GetVertex(points[i].x, points[i].y, &vi);
+                const index_t pi = vi - firstVertex;
+                if (pi == m_triangulator.GetPointCount())
+                    m_triangulator.AddPoint(v->x, v->y);
+
+                if (prev == InvalidIndex)
+                    first = pi;
+                else
+                    m_triangulator.AddConstraint(prev, pi);
+                prev = pi;
+            }
+            if (first != InvalidIndex)
+                m_triangulator.AddConstraint(prev, first);
+        }
+        m_weld = VertexWeld();
 
-            const vec2f p0(tri[0].x, tri[0].y);
-            const vec2f p1(tri[1].x, tri[1].y);
-            const vec2f p2(tri[2].x, tri[2].y);
+        if (!m_triangulator.Triangulate())
+        {
+            rob::log::Error("NavMesh::TriangulatePath: Triangulation failed, ", m_triangulator.GetPointCount(), " points");
+            return true;
+        }
 
-            index_t i0, i1, i2;
-            GetVertex(p0.x, p0.y, &i0);
-            GetVertex(p1.x, p1.y, &i1);
-            GetVertex(p2.x, p2.y, &i2);
+        for (size_t t = 0; t < m_triangulator.GetTriangleCount(); t++)
+        {
+            const Triangulator::Triangle &tri = m_triangulator.GetTriangle(t);
+            const index_t i0 = firstVertex + tri.v[0];
+            const index_t i1 = firstVertex + tri.v[1];
+            const index_t i2 = firstVertex + tri.v[2];
+
+            const Vert &v0 = m_vertices[i0];
+            const Vert &v1 = m_vertices[i1];
+            const Vert &v2 = m_vertices[i2];
+            if (rob::Abs(TriArea(vec2f(v0.x, v0.y), vec2f(v1.x, v1.y), vec2f(v2.x, v2.y))) < 1e-4f)
+                continue;
+
+            AddFace(i0, i2, i1);
+        }
+        return true;
+    }
 
-            if (TriArea(p0, p1, p2) > 0.0f)
-            {
-                rob::log::Warning("NavMesh::Triangulate: CW triangle orientation form TPPL");
-                AddFace(i2, i1, i0);
-            }
-            else
-            {
-                AddFace(i0, i1, i2);
-            }
+    static ClipperLib::IntRect GetPathBounds(const ClipperLib::Path &path)
+    {
+        ClipperLib::IntRect bounds;
+        bounds.left = bounds.right = path[0].X;
+        bounds.top = bounds.bottom = path[0].Y;
+        for (size_t i = 1; i < path.size(); i++)
+        {
+            bounds.left = rob::Min(bounds.left, path[i].X);
+            bounds.right = rob::Max(bounds.right, path[i].X);
+            bounds.top = rob::Min(bounds.top, path[i].Y);
+            bounds.bottom = rob::Max(bounds.bottom, path[i].Y);
         }
+        return bounds;
     }
 
-    void NavMesh::CreateClipperPaths(ClipperLib::Clipper &clipper, const b2World *world, const float halfW, const float halfH, const float clipperScale)
+    static inline bool Overlaps(const ClipperLib::IntRect &a, const ClipperLib::IntRect &b)
     {
-        using namespace ClipperLib;
+        return a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+    }
 
-        const float wW = halfW * clipperScale;
-        const float wH = halfH * clipperScale;
+    void NavMesh::MergeObstacles(Obstacles &obstacles, const b2World *world, const vec2f &minP, const vec2f &maxP)
+    {
+        using namespace ClipperLib;
 
-        Path worldRegion;
-        worldRegion.push_back(IntPoint(-wW, -wH));
-        worldRegion.push_back(IntPoint(wW, -wH));
-        worldRegion.push_back(IntPoint(wW, wH));
-        worldRegion.push_back(IntPoint(-wW, wH));
-        clipper.AddPath(worldRegion, ptSubject, true);
+        b2AABB area;
+        area.lowerBound.Set(minP.x - obstacles.margin, minP.y - obstacles.margin);
+        area.upperBound.Set(maxP.x + obstacles.margin, maxP.y + obstacles.margin);
 
+        Paths paths;
+        Path path;
         const b2Body *body = world->GetBodyList();
         while (body)
         {
             if (body->GetType() == b2_staticBody)
             {
-                Path &path = worldRegion; // Re-use worldRegion path
                 path.clear();
 
                 // NOTE: Assumes that there is only one fixture per static body.
@@ -285,14 +470,17 @@ namespace sneaky
                 {
                 case b2Shape::e_polygon:
                     {
+                        if (!b2TestOverlap(fixture->GetAABB(0), area))
+                            break;
+
                         const b2PolygonShape *polyShape = (const b2PolygonShape*)shape;
                         for (int i = 0; i < polyShape->m_count; i++)
                         {
                             const b2Vec2 &v = polyShape->m_vertices[i];
                             const b2Vec2 wp = body->GetWorldPoint(v);
-                            path.push_back(IntPoint(wp.x * clipperScale, wp.y * clipperScale));
+                            path.push_back(IntPoint(wp.x * CLIPPER_SCALE, wp.y * CLIPPER_SCALE));
                         }
-                        clipper.AddPath(path, ptClip, true);
+                        paths.push_back(path);
                     } break;
                 default:
                     rob::log::Debug("NavMesh: Unsupported shape type");
@@ -301,476 +489,2107 @@ namespace sneaky
             }
             body = body->GetNext();
         }
+
+        Clipper clipper;
+        clipper.AddPaths(paths, ptSubject, true);
+        clipper.Execute(ctUnion, obstacles.paths, pftNonZero, pftNonZero);
+        obstacles.merged = true;
+    }
+
+    void NavMesh::CreateObstaclePaths(ClipperLib::Paths &obstacles, const b2World *world, const vec2f &minP, const vec2f &maxP, Obstacles *merged) const
+    {
+        using namespace ClipperLib;
+
+        Obstacles local;
+        if (!merged)
+        {
+            local.margin = m_agentRadius;
+            merged = &local;
+        }
+        if (!merged->merged)
+            MergeObstacles(*merged, world, minP, maxP);
+        ROB_ASSERT(merged->margin >= m_agentRadius);
+
+        // Growing the obstacles by the agent radius also merges the ones that
+        // come closer than the agent fits.
+        ClipperOffset clipperOfft(2.0, m_agentRadius);
+        clipperOfft.AddPaths(merged->paths, jtRound, etClosedPolygon);
+        clipperOfft.Execute(obstacles, m_agentRadius * CLIPPER_SCALE);
     }
 
-    void SetPath(std::vector<std::vector<vec2f> > &paths, ClipperLib::Paths &cpaths, const float clipperScale)
+    void SetPath(std::vector<std::vector<vec2f> > &paths, ClipperLib::Paths &cpaths)
     {
-        paths.resize(cpaths.size());
+        const size_t start = paths.size();
+        paths.resize(start + cpaths.size());
         for (size_t i = 0; i < cpaths.size(); i++)
         {
             ClipperLib::Path &cpath = cpaths[i];
-            std::vector<vec2f> &path = paths[i];
+            std::vector<vec2f> &path = paths[start + i];
             path.resize(cpath.size());
             for (size_t p = 0; p < cpath.size(); p++)
             {
                 vec2f &pathPt = path[p];
-                pathPt.x = cpath[p].X / clipperScale;
-                pathPt.y = cpath[p].Y / clipperScale;
+                pathPt.x = cpath[p].X / CLIPPER_SCALE;
+                pathPt.y = cpath[p].Y / CLIPPER_SCALE;
             }
         }
     }
 
-    void NavMesh::Create(const b2World *world, const float halfW, const float halfH, const float agentRadius)
+    void NavMesh::Create(const b2World *world, const float halfW, const float halfH, const float agentRadius, rob::JobSystem &jobs,
+                         Obstacles *merged)
     {
         m_halfW = halfW;
         m_halfH = halfH;
+        m_agentRadius = agentRadius;
+
+        m_stats = BuildStats();
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t startTime = ticker.GetTicks();
+
+        m_tilesX = int(std::ceil(2.0f * halfW / TILE_SIZE));
+        m_tilesY = int(std::ceil(2.0f * halfH / TILE_SIZE));
+        const size_t tileCount = m_tilesX * m_tilesY;
+        m_tiles = m_alloc->AllocateArray<Tile>(tileCount);
+        for (size_t t = 0; t < tileCount; t++)
+            m_tiles[t] = Tile();
+        m_freeFaces.clear();
+        m_freeVertices.clear();
+
+        m_solids.clear();
+        m_holes.clear();
+
+        ClipperLib::Paths obstacles;
+        CreateObstaclePaths(obstacles, world, vec2f(-halfW, -halfH), vec2f(halfW, halfH), merged);
+        m_stats.clipTime = ticker.GetTicks() - startTime;
+
+        std::vector<size_t> tiles(tileCount);
+        for (size_t t = 0; t < tileCount; t++)
+            tiles[t] = t;
+        BuildTiles(tiles.data(), tiles.size(), obstacles, jobs);
+
+        const rob::Time_t stitchStart = ticker.GetTicks();
+        for (int y = 0; y < m_tilesY; y++)
+        {
+            for (int x = 0; x < m_tilesX; x++)
+            {
+                const size_t t = y * m_tilesX + x;
+                if (x + 1 < m_tilesX) StitchTiles(t, t + 1, 0);
+                if (y + 1 < m_tilesY) StitchTiles(t, t + m_tilesX, 1);
+            }
+        }
+        m_stats.neighbourTime += ticker.GetTicks() - stitchStart;
+
+        BuildFaceGrid();
+        BuildFaceEdges();
+        BuildComponents();
+        BuildVisibility(world, jobs);
+        m_revision++;
+        m_stats.totalTime = ticker.GetTicks() - startTime;
+    }
+
+    size_t NavMesh::RebuildTiles(const b2World *world, const vec2f &minP, const vec2f &maxP, rob::JobSystem &jobs,
+                                 Obstacles *merged)
+    {
+        m_stats = BuildStats();
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t startTime = ticker.GetTicks();
+
+        // Bodies affect the mesh within the agent radius.
+        const int x0 = rob::Clamp(int(std::floor((minP.x - m_agentRadius + m_halfW) / TILE_SIZE)), 0, m_tilesX - 1);
+        const int y0 = rob::Clamp(int(std::floor((minP.y - m_agentRadius + m_halfH) / TILE_SIZE)), 0, m_tilesY - 1);
+        const int x1 = rob::Clamp(int(std::floor((maxP.x + m_agentRadius + m_halfW) / TILE_SIZE)), 0, m_tilesX - 1);
+        const int y1 = rob::Clamp(int(std::floor((maxP.y + m_agentRadius + m_halfH) / TILE_SIZE)), 0, m_tilesY - 1);
+
+        const vec2f tileMin(-m_halfW + x0 * TILE_SIZE, -m_halfH + y0 * TILE_SIZE);
+        const vec2f tileMax(-m_halfW + (x1 + 1) * TILE_SIZE, -m_halfH + (y1 + 1) * TILE_SIZE);
+        // The debug paths show only the rebuilt tiles.
+        m_solids.clear();
+        m_holes.clear();
+
+        ClipperLib::Paths obstacles;
+        CreateObstaclePaths(obstacles, world, tileMin, tileMax, merged);
+        m_stats.clipTime = ticker.GetTicks() - startTime;
+
+        std::vector<size_t> tiles;
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                const size_t t = y * m_tilesX + x;
+                UnlinkTile(t);
+                tiles.push_back(t);
+            }
+        }
+        BuildTiles(tiles.data(), tiles.size(), obstacles, jobs);
+
+        const rob::Time_t stitchStart = ticker.GetTicks();
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                const size_t t = y * m_tilesX + x;
+                if (x > 0) StitchTiles(t - 1, t, 0);
+                if (y > 0) StitchTiles(t - m_tilesX, t, 1);
+                if (x == x1 && x + 1 < m_tilesX) StitchTiles(t, t + 1, 0);
+                if (y == y1 && y + 1 < m_tilesY) StitchTiles(t, t + m_tilesX, 1);
+            }
+        }
+        m_stats.neighbourTime += ticker.GetTicks() - stitchStart;
+
+        BuildFaceGrid();
+        BuildFaceEdges();
+        BuildComponents();
+        BeginVisibility(tiles.data(), tiles.size());
+        m_revision++;
+        m_stats.totalTime = ticker.GetTicks() - startTime;
+        return tiles.size();
+    }
+
+    ClipperLib::IntRect NavMesh::GetTileRect(size_t tile) const
+    {
+        const int x = tile % m_tilesX;
+        const int y = tile / m_tilesX;
+        ClipperLib::IntRect rect;
+        rect.left = ToClipper(-m_halfW + x * TILE_SIZE);
+        rect.right = ToClipper(-m_halfW + (x + 1) * TILE_SIZE);
+        rect.top = ToClipper(-m_halfH + y * TILE_SIZE);
+        rect.bottom = ToClipper(-m_halfH + (y + 1) * TILE_SIZE);
+        return rect;
+    }
+
+    NavMesh::TileStaging **NavMesh::ReserveStaging(size_t threadCount)
+    {
+        if (m_stagingOwner)
+            return m_stagingOwner->ReserveStaging(threadCount);
+
+        if (m_stagingCount < threadCount)
+        {
+            TileStaging **staging = m_alloc->AllocateArray<TileStaging*>(threadCount);
+            for (size_t i = 0; i < m_stagingCount; i++)
+                staging[i] = m_staging[i];
+            for (size_t i = m_stagingCount; i < threadCount; i++)
+                staging[i] = m_alloc->new_object<TileStaging>(TILE_STAGING_MEMORY);
+            m_staging = staging;
+            m_stagingCount = threadCount;
+        }
+        return m_staging;
+    }
+
+    bool NavMesh::GrowStaging(size_t thread)
+    {
+        if (m_stagingOwner)
+            return m_stagingOwner->GrowStaging(thread);
+
+        TileStaging *staging = m_staging[thread];
+        const size_t memorySize = staging->alloc.GetTotalSize() * 2;
+        if (memorySize > TILE_STAGING_MAX_MEMORY)
+            return false;
+        // The staging is remade in place, as its slot in the arena cannot be freed.
+        staging->~TileStaging();
+        new (staging) TileStaging(memorySize);
+        return true;
+    }
+
+    void NavMesh::BuildTiles(const size_t *tiles, size_t count, const ClipperLib::Paths &obstacles, rob::JobSystem &jobs)
+    {
+
+        std::vector<ClipperLib::IntRect> obstacleBounds(obstacles.size());
+        for (size_t i = 0; i < obstacles.size(); i++)
+            obstacleBounds[i] = GetPathBounds(obstacles[i]);
+
+        std::vector<TileBuild> builds(count);
+        TileJobs tileJobs;
+        tileJobs.mesh = this;
+        tileJobs.staging = ReserveStaging(jobs.GetThreadCount());
+        tileJobs.tiles = tiles;
+        tileJobs.obstacles = &obstacles;
+        tileJobs.obstacleBounds = obstacleBounds.data();
+        tileJobs.builds = builds.data();
+        jobs.ParallelFor(&NavMesh::BuildTileJob, &tileJobs, count);
+
+        // A tile that did not fit the staging arena of its thread is built again
+        // here in the arena of the first thread, which is grown until the tile
+        // fits. The grown arena is kept for the later builds.
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!builds[i].outOfMemory)
+                continue;
+            BuildTileJob(&tileJobs, i, 0);
+            while (builds[i].outOfMemory && GrowStaging(0))
+                BuildTileJob(&tileJobs, i, 0);
+            if (builds[i].outOfMemory)
+            {
+                rob::log::Error("NavMesh::BuildTiles: Tile ", tiles[i], " does not fit ",
+                                TILE_STAGING_MAX_MEMORY / 1024, " KB of staging memory, left empty");
+            }
+        }
 
-        for (size_t i = 0; i < MAX_VERTICES; i++)
-            m_vertCache.m_v[i] = nullptr;
+        // The build times are summed over the threads.
+        for (size_t i = 0; i < count; i++)
+        {
+            const TileBuild &build = builds[i];
+            PlaceTile(tiles[i], build);
+            m_solids.insert(m_solids.end(), build.solids.begin(), build.solids.end());
+            m_holes.insert(m_holes.end(), build.holes.begin(), build.holes.end());
+            m_stats.clipTime += build.stats.clipTime;
+            m_stats.triangulateTime += build.stats.triangulateTime;
+            m_stats.neighbourTime += build.stats.neighbourTime;
+            m_stats.mergeTime += build.stats.mergeTime;
+            m_stats.triangleCount += build.stats.triangleCount;
+            m_stats.sharedEdges += build.stats.sharedEdges;
+        }
+    }
 
-        const float clipperScale = 8.0f;
+    void NavMesh::BuildTileJob(void *data, size_t index, size_t thread)
+    {
+        const TileJobs &tileJobs = *static_cast<const TileJobs*>(data);
+        const NavMesh &mesh = *tileJobs.mesh;
+        NavMesh &staging = tileJobs.staging[thread]->mesh;
+
+        staging.m_faces.Clear();
+        staging.m_vertices.Clear();
+        staging.m_solids.clear();
+        staging.m_holes.clear();
+        staging.m_stats = BuildStats();
+        staging.m_halfW = mesh.m_halfW;
+        staging.m_halfH = mesh.m_halfH;
+        staging.m_agentRadius = mesh.m_agentRadius;
+        staging.m_tilesX = mesh.m_tilesX;
+        staging.m_tilesY = mesh.m_tilesY;
+        TileBuild &build = tileJobs.builds[index];
+        build.outOfMemory = !staging.TriangulateTile(tileJobs.tiles[index], *tileJobs.obstacles, tileJobs.obstacleBounds);
+        if (build.outOfMemory)
+            return;
+
+        build.faces.resize(staging.m_faces.GetSize());
+        for (size_t i = 0; i < build.faces.size(); i++)
+            build.faces[i] = staging.m_faces[i];
+        build.vertices.resize(staging.m_vertices.GetSize());
+        for (size_t i = 0; i < build.vertices.size(); i++)
+            build.vertices[i] = staging.m_vertices[i];
+        build.solids.swap(staging.m_solids);
+        build.holes.swap(staging.m_holes);
+        build.stats = staging.m_stats;
+    }
 
+    bool NavMesh::TriangulateTile(size_t tile, const ClipperLib::Paths &obstacles, const ClipperLib::IntRect *obstacleBounds)
+    {
         using namespace ClipperLib;
-        Clipper clipper;
 
-        CreateClipperPaths(clipper, world, m_halfW, m_halfH, clipperScale);
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const IntRect rect = GetTileRect(tile);
 
-        ClipperLib::Paths paths;
-        clipper.Execute(ctDifference, paths, pftNonZero, pftNonZero);
+        // The walkable region is the part of the tile inside the world, shrunk by
+        // the agent radius, without the grown obstacles.
+        const cInt worldW = ToClipper(m_halfW - m_agentRadius);
+        const cInt worldH = ToClipper(m_halfH - m_agentRadius);
+        IntRect region;
+        region.left = rob::Max(rect.left, -worldW);
+        region.right = rob::Min(rect.right, worldW);
+        region.top = rob::Max(rect.top, -worldH);
+        region.bottom = rob::Min(rect.bottom, worldH);
 
-        ClipperOffset clipperOfft(2.0, agentRadius);
-        clipperOfft.AddPaths(paths, jtRound, etClosedPolygon);
-        paths.clear();
-        clipperOfft.Execute(paths, -agentRadius * clipperScale);
+        if (region.left >= region.right || region.top >= region.bottom)
+            return true;
+
+        Clipper clipper;
+        Path regionPath;
+        regionPath.push_back(IntPoint(region.left, region.top));
+        regionPath.push_back(IntPoint(region.right, region.top));
+        regionPath.push_back(IntPoint(region.right, region.bottom));
+        regionPath.push_back(IntPoint(region.left, region.bottom));
+        clipper.AddPath(regionPath, ptSubject, true);
+
+        for (size_t i = 0; i < obstacles.size(); i++)
+        {
+            if (Overlaps(obstacleBounds[i], region))
+                clipper.AddPath(obstacles[i], ptClip, true);
+        }
+
+        Paths paths;
+        clipper.Execute(ctDifference, paths, pftNonZero, pftNonZero);
+        // Obstacles grazing the tile border leave slivers that would triangulate badly.
+        CleanPolygons(paths);
 
         Paths solids, holes;
         ClassifyPaths(paths, solids, holes);
 
-        rob::log::Debug("Solids: ", solids.size(), ", holes: ", holes.size());
-
         // Copy paths for easier debug rendering
-        SetPath(m_solids, solids, clipperScale);
-        SetPath(m_holes, holes, clipperScale);
+        SetPath(m_solids, solids);
+        SetPath(m_holes, holes);
+
+        rob::Time_t time = ticker.GetTicks();
+        m_stats.clipTime += time;
 
         Paths holeSet;
         for (size_t s = 0; s < solids.size(); s++)
         {
             const Path &solid = solids[s];
-            const size_t startFace = m_faceCount;
+            const size_t startFace = m_faces.GetSize();
 
             holeSet.clear();
             SelectHoles(solid, holes, holeSet);
 
-            TriangulatePath(solid, holeSet, clipperScale);
+            if (!TriangulatePath(solid, holeSet, rect))
+                return false;
+            const rob::Time_t t1 = ticker.GetTicks();
+            m_stats.triangulateTime += t1 - time;
 
             ResolveNeighbours(startFace);
+            time = ticker.GetTicks();
+            m_stats.neighbourTime += time - t1;
         }
-        while (Refine() > 0) ;
-        Refine2();
+
+        MergeFaces(0);
+        m_stats.mergeTime += ticker.GetTicks() - time;
+        return true;
     }
 
-    void NavMesh::ResolveNeighbours(size_t startFace)
+    static inline bool IsUnusedFace(const NavMesh::Face &face)
+    { return face.vertexCount == 0; }
+
+    // The unused vertex slots are cleared, so that baked files do not depend on
+    // stale memory.
+    static inline void ClearFace(NavMesh::Face &face)
     {
-        for (size_t i = startFace; i < m_faceCount; i++)
+        for (int i = 0; i < NavMesh::MAX_FACE_VERTICES; i++)
         {
-            Face &face = m_faces[i];
-            const index_t i0 = face.vertices[0];
-            const index_t i1 = face.vertices[1];
-            const index_t i2 = face.vertices[2];
-            for (size_t j = i + 1; j < m_faceCount; j++)
-            {
-                Face &other = m_faces[j];
-                if (FaceHasEdge(other, i0, i1))
-                {
-                    SetNeighbour(i, 0, j, i0, i1);
-                }
-                else if (FaceHasEdge(other, i1, i2))
-                {
-                    SetNeighbour(i, 1, j, i1, i2);
-                }
-                else if (FaceHasEdge(other, i2, i0))
-                {
-                    SetNeighbour(i, 2, j, i2, i0);
-                }
-            }
+            face.vertices[i] = 0;
+            face.neighbours[i] = NavMesh::InvalidIndex;
         }
+        face.vertexCount = 0;
+        face.flags = 0;
+        face.component = NavMesh::InvalidIndex;
+    }
+
+    static inline void SetUnusedFace(NavMesh::Face &face)
+    { ClearFace(face); }
+
+    static inline int NextVertex(const NavMesh::Face &face, int i)
+    { return (i + 1 < int(face.vertexCount)) ? i + 1 : 0; }
+
+    static inline int PrevVertex(const NavMesh::Face &face, int i)
+    { return (i > 0) ? i - 1 : int(face.vertexCount) - 1; }
+
+    struct MergeEdge
+    {
+        float length2;
+        index_t face0, face1;
+        index_t v0, v1; // As in face0
+    };
+
+    static inline bool operator < (const MergeEdge &a, const MergeEdge &b)
+    {
+        if (a.length2 != b.length2) return a.length2 > b.length2;
+        return (a.face0 != b.face0) ? a.face0 < b.face0 : a.face1 < b.face1;
     }
 
-    void NavMesh::FloodFace(Face &face, const uint32_t flag)
+    static index_t FindMergedFace(std::vector<index_t> &merged, index_t first, index_t f)
     {
-        face.flags = flag;
-        for (int i = 0; i < 3; i++)
+        index_t root = f;
+        while (merged[root - first] != root)
+            root = merged[root - first];
+        while (merged[f - first] != root)
         {
-            if (face.neighbours[i] == InvalidIndex) continue;
-            Face &neighbour = m_faces[face.neighbours[i]];
-            if (neighbour.flags == uint32_t(-1)) FloodFace(neighbour, flag);
+            const index_t next = merged[f - first];
+            merged[f - first] = root;
+            f = next;
         }
+        return root;
     }
 
-    uint32_t NavMesh::Flood()
+    // Merges the face b to the face a over their shared edge from v0 to v1, if the
+    // result is convex and small enough.
+    static bool MergeFacePair(std::vector<NavMesh::Face> &faces, index_t first, index_t a, index_t b,
+                              index_t v0, index_t v1, const NavMesh &mesh)
     {
-        uint32_t flag = 0;
-        for (index_t f = 0; f < m_faceCount; f++)
+        NavMesh::Face &fa = faces[a - first];
+        NavMesh::Face &fb = faces[b - first];
+        const int na = fa.vertexCount;
+        const int nb = fb.vertexCount;
+        if (na + nb - 2 > NavMesh::MAX_FACE_VERTICES)
+            return false;
+
+        int i = 0, j = 0;
+        while (i < na && !(fa.vertices[i] == v0 && fa.vertices[NextVertex(fa, i)] == v1)) i++;
+        while (j < nb && !(fb.vertices[j] == v1 && fb.vertices[NextVertex(fb, j)] == v0)) j++;
+        if (i == na || j == nb)
+            return false;
+
+        const NavMesh::Vert &p0 = mesh.GetVertex(fa.vertices[PrevVertex(fa, i)]);
+        const NavMesh::Vert &c0 = mesh.GetVertex(v0);
+        const NavMesh::Vert &n0 = mesh.GetVertex(fb.vertices[NextVertex(fb, NextVertex(fb, j))]);
+        const NavMesh::Vert &p1 = mesh.GetVertex(fb.vertices[PrevVertex(fb, j)]);
+        const NavMesh::Vert &c1 = mesh.GetVertex(v1);
+        const NavMesh::Vert &n1 = mesh.GetVertex(fa.vertices[NextVertex(fa, NextVertex(fa, i))]);
+        if (TriArea(vec2f(p0.x, p0.y), vec2f(c0.x, c0.y), vec2f(n0.x, n0.y)) < 0.0f ||
+            TriArea(vec2f(p1.x, p1.y), vec2f(c1.x, c1.y), vec2f(n1.x, n1.y)) < 0.0f)
+            return false;
+
+        // The vertices of a from v1 to v0, followed by the vertices of b after v0 up to v1.
+        NavMesh::Face merged;
+        ClearFace(merged);
+        merged.vertexCount = na + nb - 2;
+        merged.flags = fa.flags;
+        int n = 0;
+        for (int k = 1; k <= na; k++, n++)
         {
-            Face &face = m_faces[f];
-            face.flags = uint32_t(-1);
+            const int idx = (i + k) % na;
+            merged.vertices[n] = fa.vertices[idx];
+            merged.neighbours[n] = (idx == i) ? fb.neighbours[NextVertex(fb, j)] : fa.neighbours[idx];
         }
-        for (index_t f = 0; f < m_faceCount; f++)
+        for (int k = 2; k < nb; k++, n++)
         {
-            Face &face = m_faces[f];
-            if (face.flags == uint32_t(-1))
-            {
-                FloodFace(face, flag);
-                flag++;
-            }
+            const int idx = (j + k) % nb;
+            merged.vertices[n] = fb.vertices[idx];
+            merged.neighbours[n] = fb.neighbours[idx];
         }
-        return flag;
-    }
 
-    int NavMesh::Refine()
-    {
-        int refinedFaces = 0;
-        static const int prevV[] = { 2, 0, 1 };
-        static const int nextV[] = { 1, 2, 0 };
-        for (index_t f = 0; f < m_faceCount; f++)
+        // Faces sharing more than one edge are left apart.
+        for (int k = 0; k < n; k++)
         {
-            Face &face = m_faces[f];
-            for (int ni = 0; ni < 3; ni++)
+            if (merged.neighbours[k] == b)
+                return false;
+        }
+
+        for (int k = na - 1; k < n; k++)
+        {
+            const index_t neighbour = merged.neighbours[k];
+            if (neighbour == NavMesh::InvalidIndex)
+                continue;
+            NavMesh::Face &nf = faces[neighbour - first];
+            for (int e = 0; e < int(nf.vertexCount); e++)
             {
-                if (face.neighbours[ni] != InvalidIndex)
-                {
-                    //      v2i
-                    //      /\          |
-                    //     /  \         |
-                    //v0i /    \ v1i
-                    //    ------
-                    //nv1i\    / nv0i
-                    //     \  /         |
-                    //      \/          |
-                    //     nv2i
-
-                    const index_t n = face.neighbours[ni];
-                    Face &neighbour = m_faces[n];
-
-                    const int nni = (neighbour.neighbours[0] == f ? 0 : (neighbour.neighbours[1] == f ? 1 : 2));
-
-                    const int v0i = ni;
-                    const int v1i = nextV[v0i];
-                    const int v2i = nextV[v1i];
-
-                    const int nv0i = nni;
-                    const int nv1i = nextV[nv0i];
-                    const int nv2i = nextV[nv1i];
-
-                    const index_t v0 = face.vertices[v0i];
-                    const index_t v1 = face.vertices[v1i];
-                    const vec2f vec0(m_vertices[v0].x, m_vertices[v0].y);
-                    const vec2f vec1(m_vertices[v1].x, m_vertices[v1].y);
-                    const float edgeLen = rob::Distance(vec0, vec1);
-
-                    const index_t v2 = face.vertices[v2i];
-                    const index_t nv2 = neighbour.vertices[nv2i];
-                    const vec2f vec2(m_vertices[v2].x, m_vertices[v2].y);
-                    const vec2f nvec2(m_vertices[nv2].x, m_vertices[nv2].y);
-                    const float altLen = rob::Distance(vec2, nvec2);
-
-                    const float area0 = TriArea(vec0, nvec2, vec2);
-                    const float area1 = TriArea(vec1, vec2, nvec2);
-
-                    if (area0 > 0.0f && area1 > 0.0f && edgeLen > altLen)
-                    {
-                        refinedFaces++;
-                        face.flags = 1;
-                        neighbour.flags = 1;
-
-                        const index_t fn_p = face.neighbours[prevV[ni]];
-                        const index_t fn_n = face.neighbours[nextV[ni]];
-                        const index_t nn_p = neighbour.neighbours[prevV[nni]];
-                        const index_t nn_n = neighbour.neighbours[nextV[nni]];
-
-                        face.vertices[0] = v0;
-                        face.vertices[1] = nv2;
-                        face.vertices[2] = v2;
-
-                        neighbour.vertices[0] = v1;
-                        neighbour.vertices[1] = v2;
-                        neighbour.vertices[2] = nv2;
-
-                        SetNeighbour(f, 0, nn_n, v0, nv2);
-                        SetNeighbour(f, 1, n, nv2, v2);
-                        SetNeighbour(f, 2, fn_p, v2, v0);
-
-                        SetNeighbour(n, 0, fn_n, v1, v2);
-                        SetNeighbour(n, 1, f, v2, nv2);
-                        SetNeighbour(n, 2, nn_p, nv2, v1);
-                        continue;
-                    }
-                }
+                if (nf.neighbours[e] == b)
+                    nf.neighbours[e] = a;
             }
         }
-        rob::log::Debug("Refined faces: ", refinedFaces);
-        return refinedFaces;
+        fa = merged;
+        SetUnusedFace(fb);
+        return true;
     }
 
-    int NavMesh::Refine2()
+    void NavMesh::MergeFaces(index_t first)
     {
-        int refinedFaces = 0;
-        static const int prevV[] = { 2, 0, 1 };
-        static const int nextV[] = { 1, 2, 0 };
-        for (index_t f = 0; f < m_faceCount; f++)
-        {
-            Face &face = m_faces[f];
-            for (int ni = 0; ni < 3; ni++)
-            {
-                if (face.neighbours[ni] != InvalidIndex)
-                {
-                    const index_t n = face.neighbours[ni];
-                    Face &neighbour = m_faces[n];
+        const index_t last = m_faces.GetSize();
+        m_stats.triangleCount += last - first;
 
-                    const int nni = (neighbour.neighbours[0] == f ? 0 : (neighbour.neighbours[1] == f ? 1 : 2));
+        // The faces are merged in a local copy, and copied back compacted.
+        std::vector<Face> faces(last - first);
+        for (index_t f = first; f < last; f++)
+            faces[f - first] = m_faces[f];
 
-                    const int v0i = ni;
-                    const int v1i = nextV[v0i];
-                    const int v2i = nextV[v1i];
+        std::vector<MergeEdge> edges;
+        edges.reserve(faces.size() * 3 / 2);
+        for (index_t f = first; f < last; f++)
+        {
+            const Face &face = faces[f - first];
+            for (int e = 0; e < int(face.vertexCount); e++)
+            {
+                const index_t n = face.neighbours[e];
+                if (n == InvalidIndex || n < f)
+                    continue;
+
+                MergeEdge edge;
+                edge.face0 = f;
+                edge.face1 = n;
+                edge.v0 = face.vertices[e];
+                edge.v1 = face.vertices[NextVertex(face, e)];
+                const Vert &v0 = m_vertices[edge.v0];
+                const Vert &v1 = m_vertices[edge.v1];
+                edge.length2 = rob::Distance2(vec2f(v0.x, v0.y), vec2f(v1.x, v1.y));
+                edges.push_back(edge);
+            }
+        }
 
-                    const int nv0i = nni;
-                    const int nv1i = nextV[nv0i];
-                    const int nv2i = nextV[nv1i];
+        // Removing the longest edges first tends to leave the faces well shaped.
+        std::sort(edges.begin(), edges.end());
 
-                    const index_t v0 = face.vertices[v0i];
-                    const index_t v1 = face.vertices[v1i];
-                    const vec2f vec0(m_vertices[v0].x, m_vertices[v0].y);
-                    const vec2f vec1(m_vertices[v1].x, m_vertices[v1].y);
+        std::vector<index_t> merged(faces.size());
+        for (index_t f = first; f < last; f++)
+            merged[f - first] = f;
 
-                    const index_t v2 = face.vertices[v2i];
-                    const index_t nv2 = neighbour.vertices[nv2i];
-                    const vec2f vec2(m_vertices[v2].x, m_vertices[v2].y);
-                    const vec2f nvec2(m_vertices[nv2].x, m_vertices[nv2].y);
+        for (size_t i = 0; i < edges.size(); i++)
+        {
+            const MergeEdge &edge = edges[i];
+            const index_t a = FindMergedFace(merged, first, edge.face0);
+            const index_t b = FindMergedFace(merged, first, edge.face1);
+            if (a == b)
+                continue;
+            if (MergeFacePair(faces, first, a, b, edge.v0, edge.v1, *this))
+                merged[b - first] = a;
+        }
 
-                    const float origArea0 = TriArea(vec0, vec1, vec2);
-                    const float origArea1 = TriArea(vec1, vec0, nvec2);
-                    const float areaRatio = 8.0f;
+        // Compact, reusing the merge table for the new face indices.
+        index_t count = first;
+        for (index_t f = first; f < last; f++)
+            merged[f - first] = IsUnusedFace(faces[f - first]) ? InvalidIndex : count++;
 
-                    const float area0 = TriArea(vec0, nvec2, vec2);
-                    const float area1 = TriArea(vec1, vec2, nvec2);
+        m_faces.Resize(count);
+        for (index_t f = first; f < last; f++)
+        {
+            const index_t to = merged[f - first];
+            if (to == InvalidIndex)
+                continue;
 
-                    if (area0 > 0.0f && area1 > 0.0f &&
-                        (origArea0 > areaRatio * origArea1)) // || origArea1 > areaRatio * origArea0))
-                    {
-                        refinedFaces++;
-                        face.flags = 2;
-                        neighbour.flags = 2;
-
-                        const index_t fn_p = face.neighbours[prevV[ni]];
-                        const index_t fn_n = face.neighbours[nextV[ni]];
-                        const index_t nn_p = neighbour.neighbours[prevV[nni]];
-                        const index_t nn_n = neighbour.neighbours[nextV[nni]];
-
-                        face.vertices[0] = v0;
-                        face.vertices[1] = nv2;
-                        face.vertices[2] = v2;
-
-                        neighbour.vertices[0] = v1;
-                        neighbour.vertices[1] = v2;
-                        neighbour.vertices[2] = nv2;
-
-                        SetNeighbour(f, 0, nn_n, v0, nv2);
-                        SetNeighbour(f, 1, n, nv2, v2);
-                        SetNeighbour(f, 2, fn_p, v2, v0);
-
-                        SetNeighbour(n, 0, fn_n, v1, v2);
-                        SetNeighbour(n, 1, f, v2, nv2);
-                        SetNeighbour(n, 2, nn_p, nv2, v1);
-                        continue;
-                    }
-                }
+            Face &face = m_faces[to];
+            face = faces[f - first];
+            for (size_t e = 0; e < face.vertexCount; e++)
+            {
+                const index_t n = face.neighbours[e];
+                if (n != InvalidIndex && n >= first)
+                    face.neighbours[e] = merged[n - first];
             }
         }
-        rob::log::Debug("Refined thin faces: ", refinedFaces);
-        return refinedFaces;
     }
 
-    void NavMesh::SetNeighbour(index_t fi, int ni, index_t fj, index_t v0, index_t v1)
+    void NavMesh::PlaceTile(size_t tile, const TileBuild &build)
     {
-        m_faces[fi].neighbours[ni] = fj;
-
-        int nj = 0;
-        Face &f = m_faces[fj];
-        if (v0 == f.vertices[0])
+        Tile &t = m_tiles[tile];
+        const index_t faceCount = build.faces.size();
+        const index_t vertexCount = build.vertices.size();
+
+        // The faces and vertices are placed to the old ranges of the tile, if they fit.
+        // Otherwise the old ranges are freed, and the tile takes the first free range
+        // that fits, or is added to the end. A tile that has been rebuilt is likely
+        // to be rebuilt again, so it gets some room to grow.
+        const bool rebuilt = (t.faceCapacity > 0);
+        if (vertexCount > t.vertexCapacity || !rebuilt)
         {
-            if (v1 == f.vertices[1])
-                nj = 0;
-            else if (v1 == f.vertices[2])
-                nj = 2;
-        }
-        else if (v0 == f.vertices[1])
-        {
-            if (v1 == f.vertices[2])
-                nj = 1;
-            else if (v1 == f.vertices[0])
-                nj = 0;
+            AddFreeRange(m_freeVertices, t.firstVertex, t.vertexCapacity);
+            const index_t capacity = rebuilt ? vertexCount + vertexCount / 4 : vertexCount;
+            t.firstVertex = TakeFreeRange(m_freeVertices, capacity);
+            if (t.firstVertex == InvalidIndex)
+            {
+                t.firstVertex = m_vertices.GetSize();
+                m_vertices.Resize(t.firstVertex + capacity);
+            }
+            t.vertexCapacity = capacity;
         }
-        else if (v0 == f.vertices[2])
+        if (faceCount > t.faceCapacity || !rebuilt)
         {
-            if (v1 == f.vertices[0])
-                nj = 2;
-            else if (v1 == f.vertices[1])
-                nj = 1;
+            for (index_t i = 0; i < t.faceCapacity; i++)
+                SetUnusedFace(m_faces[t.firstFace + i]);
+            AddFreeRange(m_freeFaces, t.firstFace, t.faceCapacity);
+
+            const index_t capacity = rebuilt ? faceCount + faceCount / 4 : faceCount;
+            t.firstFace = TakeFreeRange(m_freeFaces, capacity);
+            if (t.firstFace == InvalidIndex)
+            {
+                t.firstFace = m_faces.GetSize();
+                m_faces.Resize(t.firstFace + capacity);
+            }
+            t.faceCapacity = capacity;
         }
-        f.neighbours[nj] = fi;
-    }
 
-    bool NavMesh::FaceHasEdge(const Face &face, index_t v0, index_t v1)
-    {
-        return (face.vertices[0] == v0 || face.vertices[1] == v0 || face.vertices[2] == v0)
-            && (face.vertices[0] == v1 || face.vertices[1] == v1 || face.vertices[2] == v1);
-    }
+        for (index_t i = 0; i < vertexCount; i++)
+            m_vertices[t.firstVertex + i] = build.vertices[i];
 
-    size_t NavMesh::GetFaceCount() const
-    { return m_faceCount; }
+        for (index_t i = 0; i < faceCount; i++)
+        {
+            Face &face = m_faces[t.firstFace + i];
+            face = build.faces[i];
+            for (size_t v = 0; v < face.vertexCount; v++)
+            {
+                face.vertices[v] += t.firstVertex;
+                if (face.neighbours[v] != InvalidIndex)
+                    face.neighbours[v] += t.firstFace;
+            }
+        }
+        for (index_t i = faceCount; i < t.faceCapacity; i++)
+            SetUnusedFace(m_faces[t.firstFace + i]);
 
-    const NavMesh::Face& NavMesh::GetFace(size_t index) const
-    {
-        ROB_ASSERT(index < m_faceCount);
-        return m_faces[index];
+        t.faceCount = faceCount;
+        t.vertexCount = vertexCount;
     }
 
-    size_t NavMesh::GetVertexCount() const
-    { return m_vertexCount; }
-
-    const NavMesh::Vert& NavMesh::GetVertex(size_t index) const
+    void NavMesh::AddFreeRange(std::vector<FreeRange> &ranges, index_t first, index_t count)
     {
-        ROB_ASSERT(index < m_vertexCount);
-        return m_vertices[index];
-    }
+        if (count == 0)
+            return;
 
-    int Side(const vec2f &v0, const vec2f &v1, const vec2f &v)
-    {
-        const vec2f e = v1 - v0;
-        const vec2f n(-e.y, e.x);
-        return e.Dot(v - v0);
+        size_t i = 0;
+        while (i < ranges.size() && ranges[i].first < first)
+            i++;
+        if (i < ranges.size() && first + count == ranges[i].first)
+        {
+            count += ranges[i].count;
+            ranges.erase(ranges.begin() + i);
+        }
+        if (i > 0 && ranges[i - 1].first + ranges[i - 1].count == first)
+        {
+            ranges[i - 1].count += count;
+            return;
+        }
+        FreeRange range;
+        range.first = first;
+        range.count = count;
+        ranges.insert(ranges.begin() + i, range);
     }
 
-    bool NavMesh::FaceContainsPoint(const Face &face, const vec2f &v) const
+    index_t NavMesh::TakeFreeRange(std::vector<FreeRange> &ranges, index_t count)
     {
-        const Vert &vert0 = m_vertices[face.vertices[0]];
-        const Vert &vert1 = m_vertices[face.vertices[1]];
-        const Vert &vert2 = m_vertices[face.vertices[2]];
-        const vec2f v0(vert0.x, vert0.y);
-        const vec2f v1(vert1.x, vert1.y);
-        const vec2f v2(vert2.x, vert2.y);
-        return Side(v0, v1, v) >= 0 && Side(v1, v2, v) >= 0 && Side(v2, v0, v) >= 0;
-    }
+        if (count == 0)
+            return InvalidIndex;
 
-    index_t NavMesh::GetFaceIndex(const vec2f &v) const
-    {
-        for (size_t i = 0; i < m_faceCount; i++)
+        for (size_t i = 0; i < ranges.size(); i++)
         {
-            Face &face = m_faces[i];
-            if (FaceContainsPoint(face, v))
-                return i;
+            FreeRange &range = ranges[i];
+            if (range.count < count)
+                continue;
+            const index_t first = range.first;
+            range.first += count;
+            range.count -= count;
+            if (range.count == 0)
+                ranges.erase(ranges.begin() + i);
+            return first;
         }
         return InvalidIndex;
     }
 
-    vec2f GetClosestPoint(const vec2f &v0, const vec2f &v1, const vec2f &v2, const vec2f &p)
+    // The free ranges are not saved, but are the gaps between the ranges of the tiles.
+    void NavMesh::FindFreeRanges()
     {
-        const vec2f e0 = v1 - v0;
-        const vec2f e1 = v2 - v0;
-        const vec2f p0 = p - v0;
-        const float d0 = e0.Dot(p0);
-        const float d1 = e1.Dot(p0);
-        if (d0 <= 0.0f && d1 <= 0.0f)
-            return v0;
+        m_freeFaces.clear();
+        m_freeVertices.clear();
 
-        const vec2f p1 = p - v1;
-        const float d2 = e0.Dot(p1);
-        const float d3 = e1.Dot(p1);
-        if (d2 >= 0.0f && d3 <= d2)
-            return v1;
-
-        const float vc = d0 * d3 - d2 * d1;
-        if (vc <= 0.0f && d0 >= 0.0f && d2 <= 0.0f)
+        std::vector<bool> usedFaces(m_faces.GetSize(), false);
+        std::vector<bool> usedVertices(m_vertices.GetSize(), false);
+        const size_t tileCount = m_tilesX * m_tilesY;
+        for (size_t i = 0; i < tileCount; i++)
         {
-            const float t = d0 / (d0 - d2);
-            return v0 + t * e0;
+            const Tile &t = m_tiles[i];
+            for (index_t f = t.firstFace; f < t.firstFace + t.faceCapacity; f++)
+                usedFaces[f] = true;
+            for (index_t v = t.firstVertex; v < t.firstVertex + t.vertexCapacity; v++)
+                usedVertices[v] = true;
         }
 
-        const vec2f p2 = p - v2;
-        const float d4 = e0.Dot(p2);
-        const float d5 = e1.Dot(p2);
-        if (d5 >= 0.0f && d4 <= d5)
-            return v2;
-
-        const float vb = d4 * d1 - d0 * d5;
-        if (vb <= 0.0f && d1 >= 0.0f && d5 <= 0.0f)
+        for (index_t f = 0; f < usedFaces.size(); )
         {
-            const float t = d1 / (d1 - d5);
-            return v0 + t * e1;
+            const index_t first = f;
+            while (f < usedFaces.size() && !usedFaces[f]) f++;
+            AddFreeRange(m_freeFaces, first, f - first);
+            while (f < usedFaces.size() && usedFaces[f]) f++;
         }
-
-        const float va = d2 * d5 - d4 * d3;
-        if (va <= 0.0f && (d3 - d2) >= 0.0f && (d4 - d5) >= 0.0f)
+        for (index_t v = 0; v < usedVertices.size(); )
         {
-            const float t = (d3 - d2) / ((d3 - d2) + (d4 - d5));
-            return v1 + t * (v2 - v1);
+            const index_t first = v;
+            while (v < usedVertices.size() && !usedVertices[v]) v++;
+            AddFreeRange(m_freeVertices, first, v - first);
+            while (v < usedVertices.size() && usedVertices[v]) v++;
         }
-
-        const float denom = 1.0f / (va + vb + vc);
-        const float t = vb * denom;
-        const float u = vc * denom;
-        return v0 + e0 * t + e1 * u;
     }
 
-    vec2f NavMesh::GetClosestPointOnFace(const Face &face, const vec2f &p) const
+    void NavMesh::UnlinkTile(size_t tile)
     {
-        const Vert &v0 = m_vertices[face.vertices[0]];
-        const Vert &v1 = m_vertices[face.vertices[1]];
-        const Vert &v2 = m_vertices[face.vertices[2]];
-        return GetClosestPoint(vec2f(v0.x, v0.y), vec2f(v1.x, v1.y), vec2f(v2.x, v2.y), p);
+        const Tile &t = m_tiles[tile];
+        const index_t last = t.firstFace + t.faceCount;
+        for (index_t f = t.firstFace; f < last; f++)
+        {
+            const Face &face = m_faces[f];
+            for (int i = 0; i < int(face.vertexCount); i++)
+            {
+                const index_t n = face.neighbours[i];
+                if (n == InvalidIndex || (n >= t.firstFace && n < last))
+                    continue;
+
+                Face &neighbour = m_faces[n];
+                for (int j = 0; j < int(neighbour.vertexCount); j++)
+                {
+                    if (neighbour.neighbours[j] == f)
+                        neighbour.neighbours[j] = InvalidIndex;
+                }
+            }
+        }
     }
 
-    index_t NavMesh::GetClampedFaceIndex(vec2f *v) const
+    struct BorderEdge
     {
-//        index_t index = GetFaceIndex(*v);
-//        if (index != InvalidIndex) return index;
-//        index = 0;
+        index_t face;
+        int edge;
+        vec2f v0, v1;
+    };
 
-        index_t index = 0;
-        vec2f clampedPos = GetClosestPointOnFace(m_faces[0], *v);
-        float minDist = rob::Distance2(clampedPos, *v);
+    static void GetBorderEdges(const NavMesh &mesh, const NavMesh::Tile &tile, int axis, float border, std::vector<BorderEdge> &edges)
+    {
+        const float epsilon = 0.001f;
+        edges.clear();
 
-        for (size_t i = 1; i < m_faceCount; i++)
+        const index_t last = tile.firstFace + tile.faceCount;
+        for (index_t f = tile.firstFace; f < last; f++)
         {
-            const vec2f pos = GetClosestPointOnFace(m_faces[i], *v);
-            float dist = rob::Distance2(pos, *v);
-            if (dist < minDist)
+            const NavMesh::Face &face = mesh.GetFace(f);
+            for (int e = 0; e < int(face.vertexCount); e++)
             {
-                index = i;
-                clampedPos = pos;
-                minDist = dist;
+                if (face.neighbours[e] != NavMesh::InvalidIndex)
+                    continue;
+
+                const NavMesh::Vert &v0 = mesh.GetVertex(face.vertices[e]);
+                const NavMesh::Vert &v1 = mesh.GetVertex(face.vertices[NextVertex(face, e)]);
+                const float c0 = (axis == 0) ? v0.x : v0.y;
+                const float c1 = (axis == 0) ? v1.x : v1.y;
+                if (rob::Abs(c0 - border) < epsilon && rob::Abs(c1 - border) < epsilon)
+                {
+                    BorderEdge edge;
+                    edge.face = f;
+                    edge.edge = e;
+                    edge.v0 = vec2f(v0.x, v0.y);
+                    edge.v1 = vec2f(v1.x, v1.y);
+                    edges.push_back(edge);
+                }
             }
         }
-
-        *v = clampedPos;
-        return index;
     }
 
-    vec2f NavMesh::GetFaceCenter(const Face &f) const
+    void NavMesh::StitchTiles(size_t tile0, size_t tile1, int axis)
     {
-        const Vert &v0 = GetVertex(f.vertices[0]);
-        const Vert &v1 = GetVertex(f.vertices[1]);
-        const Vert &v2 = GetVertex(f.vertices[2]);
+        // tile1 is right of (axis 0) or above (axis 1) tile0.
+        const float border = (axis == 0)
+            ? -m_halfW + (tile0 % m_tilesX + 1) * TILE_SIZE
+            : -m_halfH + (tile0 / m_tilesX + 1) * TILE_SIZE;
+
+        std::vector<BorderEdge> edges0, edges1;
+        GetBorderEdges(*this, m_tiles[tile0], axis, border, edges0);
+        GetBorderEdges(*this, m_tiles[tile1], axis, border, edges1);
+
+        // The tiles split their border edges at the same points, so the edges usually
+        // match exactly. Where an obstacle touches the border they may not, and the
+        // edge is linked to the unlinked edge it overlaps the most.
+        const float minOverlap = 0.05f;
+        for (size_t i = 0; i < edges0.size(); i++)
+        {
+            const BorderEdge &e0 = edges0[i];
+            const float a0 = (axis == 0) ? e0.v0.y : e0.v0.x;
+            const float a1 = (axis == 0) ? e0.v1.y : e0.v1.x;
 
-        return vec2f(v0.x + v1.x + v2.x, v0.y + v1.y + v2.y) / 3.0f;
-    }
+            size_t best = edges1.size();
+            float bestOverlap = minOverlap;
+            for (size_t j = 0; j < edges1.size(); j++)
+            {
+                const BorderEdge &e1 = edges1[j];
+                if (m_faces[e1.face].neighbours[e1.edge] != InvalidIndex)
+                    continue;
+
+                const float b0 = (axis == 0) ? e1.v0.y : e1.v0.x;
+                const float b1 = (axis == 0) ? e1.v1.y : e1.v1.x;
+                const float overlap = rob::Min(rob::Max(a0, a1), rob::Max(b0, b1))
+                    - rob::Max(rob::Min(a0, a1), rob::Min(b0, b1));
+                if (overlap > bestOverlap)
+                {
+                    best = j;
+                    bestOverlap = overlap;
+                }
+            }
 
-    vec2f NavMesh::GetEdgeCenter(index_t f, int edge) const
+            if (best < edges1.size())
+            {
+                const BorderEdge &e1 = edges1[best];
+                m_faces[e0.face].neighbours[e0.edge] = e1.face;
+                m_faces[e1.face].neighbours[e1.edge] = e0.face;
+                m_stats.sharedEdges++;
+            }
+        }
+    }
+
+    struct EdgeSlot
+    {
+        uint64_t key;
+        index_t face;
+        int edge;
+    };
+
+    static inline uint64_t GetEdgeKey(index_t v0, index_t v1)
+    {
+        return (v0 < v1) ? (uint64_t(v0) << 32) | v1 : (uint64_t(v1) << 32) | v0;
+    }
+
+    static const char NAV_MESH_MAGIC[4] = { 'S', 'N', 'A', 'V' };
+    static const uint32_t NAV_MESH_VERSION = 5;
+
+    // The header is followed by the vertices, faces, grid cell offsets, grid faces,
+    // tiles and the visibility matrix.
+    struct NavMeshFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t seed;
+        float agentRadius;
+        float halfW, halfH;
+        uint32_t faceCount;
+        uint32_t vertexCount;
+        float gridX0, gridY0;
+        float gridCellSize;
+        int32_t gridWidth, gridHeight;
+        uint32_t gridFaceCount;
+        float tileSize;
+        int32_t tilesX, tilesY;
+        uint32_t visibilityWords;
+        uint32_t dataSize;
+    };
+
+    static size_t GetDataSize(const NavMeshFileHeader &header)
+    {
+        const size_t cellCount = size_t(header.gridWidth) * size_t(header.gridHeight);
+        return header.vertexCount * sizeof(NavMesh::Vert)
+            + header.faceCount * sizeof(NavMesh::Face)
+            + (cellCount + 1) * sizeof(index_t)
+            + header.gridFaceCount * sizeof(index_t)
+            + size_t(header.tilesX) * size_t(header.tilesY) * sizeof(NavMesh::Tile)
+            + header.visibilityWords * sizeof(uint32_t);
+    }
+
+    bool NavMesh::Save(const char * const filename, const uint32_t seed, const float agentRadius) const
+    {
+        // Only a whole visibility is baked.
+        if (m_visibilityPending)
+        {
+            rob::log::Error("NavMesh: The visibility is not up to date, not saving ", filename);
+            return false;
+        }
+
+        rob::fs::File file = rob::fs::OpenToWrite(filename);
+        if (!file)
+        {
+            rob::log::Error("NavMesh: Could not open file for writing ", filename);
+            return false;
+        }
+
+        NavMeshFileHeader header;
+        for (size_t i = 0; i < 4; i++) header.magic[i] = NAV_MESH_MAGIC[i];
+        header.version = NAV_MESH_VERSION;
+        header.seed = seed;
+        header.agentRadius = agentRadius;
+        header.halfW = m_halfW;
+        header.halfH = m_halfH;
+        header.faceCount = m_faces.GetSize();
+        header.vertexCount = m_vertices.GetSize();
+        header.gridX0 = m_grid.x0;
+        header.gridY0 = m_grid.y0;
+        header.gridCellSize = m_grid.cellSize;
+        header.gridWidth = m_grid.width;
+        header.gridHeight = m_grid.height;
+
+        const size_t cellCount = m_grid.width * m_grid.height;
+        header.gridFaceCount = m_grid.cellStart[cellCount];
+        header.tileSize = TILE_SIZE;
+        header.tilesX = m_tilesX;
+        header.tilesY = m_tilesY;
+        header.visibilityWords = GetVisibilityWords(m_visibilityFaces);
+        header.dataSize = GetDataSize(header);
+
+        rob::fs::Write(file, header);
+        for (size_t i = 0; i < m_vertices.GetSize(); i++)
+            rob::fs::Write(file, m_vertices[i]);
+        for (size_t i = 0; i < m_faces.GetSize(); i++)
+            rob::fs::Write(file, m_faces[i]);
+        rob::fs::Write(file, reinterpret_cast<const char*>(m_grid.cellStart), (cellCount + 1) * sizeof(index_t));
+        rob::fs::Write(file, reinterpret_cast<const char*>(m_grid.faces), header.gridFaceCount * sizeof(index_t));
+        rob::fs::Write(file, reinterpret_cast<const char*>(m_tiles), m_tilesX * m_tilesY * sizeof(Tile));
+        rob::fs::Write(file, reinterpret_cast<const char*>(m_visibility), header.visibilityWords * sizeof(uint32_t));
+        rob::fs::Close(file);
+        return true;
+    }
+
+    // The indices of a damaged or stale file would crash the queries later, so
+    // every one of them is checked against the counts of the header.
+    static bool IsValidData(const NavMeshFileHeader &header, const NavMesh::Face *faces, const index_t *cellStart,
+                            const index_t *gridFaces, const NavMesh::Tile *tiles)
+    {
+        for (size_t i = 0; i < header.faceCount; i++)
+        {
+            const NavMesh::Face &face = faces[i];
+            if (face.vertexCount > uint32_t(NavMesh::MAX_FACE_VERTICES) || (face.vertexCount > 0 && face.vertexCount < 3))
+                return false;
+            for (size_t v = 0; v < face.vertexCount; v++)
+            {
+                if (face.vertices[v] >= header.vertexCount)
+                    return false;
+                if (face.neighbours[v] != NavMesh::InvalidIndex && face.neighbours[v] >= header.faceCount)
+                    return false;
+            }
+        }
+
+        const size_t cellCount = size_t(header.gridWidth) * size_t(header.gridHeight);
+        if (cellStart[0] != 0 || cellStart[cellCount] != header.gridFaceCount)
+            return false;
+        for (size_t i = 0; i < cellCount; i++)
+        {
+            if (cellStart[i] > cellStart[i + 1])
+                return false;
+        }
+        for (size_t i = 0; i < header.gridFaceCount; i++)
+        {
+            if (gridFaces[i] >= header.faceCount)
+                return false;
+        }
+
+        const size_t tileCount = size_t(header.tilesX) * size_t(header.tilesY);
+        for (size_t i = 0; i < tileCount; i++)
+        {
+            const NavMesh::Tile &tile = tiles[i];
+            if (tile.faceCount > tile.faceCapacity || size_t(tile.firstFace) + tile.faceCapacity > header.faceCount)
+                return false;
+            if (tile.vertexCount > tile.vertexCapacity || size_t(tile.firstVertex) + tile.vertexCapacity > header.vertexCount)
+                return false;
+        }
+        return true;
+    }
+
+    bool NavMesh::Load(const char * const filename, const uint32_t seed, const float agentRadius)
+    {
+        ROB_ASSERT(m_faces.GetSize() == 0 && m_vertices.GetSize() == 0);
+
+        const size_t fileSize = rob::GetFileSize(filename);
+        if (fileSize < sizeof(NavMeshFileHeader))
+            return false;
+
+        rob::fs::File file = rob::fs::OpenToRead(filename);
+        if (!file)
+            return false;
+
+        // The whole file is read at once and validated before anything is copied.
+        rob::LinearAllocator fileAlloc(fileSize + alignof(NavMeshFileHeader));
+        char *data = static_cast<char*>(fileAlloc.Allocate(fileSize, alignof(NavMeshFileHeader)));
+        rob::fs::Read(file, data, fileSize);
+        rob::fs::Close(file);
+
+        const NavMeshFileHeader &header = *reinterpret_cast<const NavMeshFileHeader*>(data);
+        for (size_t i = 0; i < 4; i++)
+        {
+            if (header.magic[i] != NAV_MESH_MAGIC[i])
+            {
+                rob::log::Error("NavMesh: Invalid nav mesh file ", filename);
+                return false;
+            }
+        }
+        if (header.version != NAV_MESH_VERSION)
+        {
+            rob::log::Info("NavMesh: Nav mesh file ", filename, " has version ", header.version, ", expected ", NAV_MESH_VERSION);
+            return false;
+        }
+        if (header.seed != seed || header.agentRadius != agentRadius)
+            return false;
+        if (header.gridWidth <= 0 || header.gridHeight <= 0 || !(header.gridCellSize > 0.0f) ||
+            header.tileSize != TILE_SIZE || header.tilesX <= 0 || header.tilesY <= 0 ||
+            header.visibilityWords != GetVisibilityWords(header.faceCount) ||
+            header.dataSize != GetDataSize(header) || sizeof(NavMeshFileHeader) + header.dataSize != fileSize)
+        {
+            rob::log::Error("NavMesh: Corrupt nav mesh file ", filename);
+            return false;
+        }
+
+        const size_t cellCount = size_t(header.gridWidth) * size_t(header.gridHeight);
+        const size_t tileCount = size_t(header.tilesX) * size_t(header.tilesY);
+
+        const char *it = data + sizeof(NavMeshFileHeader);
+        const Vert *verts = reinterpret_cast<const Vert*>(it);
+        it += header.vertexCount * sizeof(Vert);
+        const Face *faces = reinterpret_cast<const Face*>(it);
+        it += header.faceCount * sizeof(Face);
+        const index_t *cellStart = reinterpret_cast<const index_t*>(it);
+        it += (cellCount + 1) * sizeof(index_t);
+        const index_t *gridFaces = reinterpret_cast<const index_t*>(it);
+        it += header.gridFaceCount * sizeof(index_t);
+        const Tile *tiles = reinterpret_cast<const Tile*>(it);
+        it += tileCount * sizeof(Tile);
+        const uint32_t *visibility = reinterpret_cast<const uint32_t*>(it);
+
+        if (!IsValidData(header, faces, cellStart, gridFaces, tiles))
+        {
+            rob::log::Error("NavMesh: Corrupt nav mesh file ", filename);
+            return false;
+        }
+
+        m_halfW = header.halfW;
+        m_halfH = header.halfH;
+        m_agentRadius = header.agentRadius;
+
+        m_vertices.Resize(header.vertexCount);
+        for (size_t i = 0; i < header.vertexCount; i++)
+            m_vertices[i] = verts[i];
+        m_faces.Resize(header.faceCount);
+        for (size_t i = 0; i < header.faceCount; i++)
+            m_faces[i] = faces[i];
+
+        FaceGrid &grid = m_grid;
+        grid.x0 = header.gridX0;
+        grid.y0 = header.gridY0;
+        grid.cellSize = header.gridCellSize;
+        grid.width = header.gridWidth;
+        grid.height = header.gridHeight;
+
+        grid.cellStart = m_alloc->AllocateArray<index_t>(cellCount + 1);
+        grid.cellCapacity = cellCount + 1;
+        grid.faces = m_alloc->AllocateArray<index_t>(header.gridFaceCount);
+        grid.faceCapacity = header.gridFaceCount;
+
+        for (size_t i = 0; i <= cellCount; i++)
+            grid.cellStart[i] = cellStart[i];
+        for (size_t i = 0; i < header.gridFaceCount; i++)
+            grid.faces[i] = gridFaces[i];
+
+        m_tilesX = header.tilesX;
+        m_tilesY = header.tilesY;
+        m_tiles = m_alloc->AllocateArray<Tile>(tileCount);
+        for (size_t i = 0; i < tileCount; i++)
+            m_tiles[i] = tiles[i];
+        FindFreeRanges();
+
+        m_visibility = m_alloc->AllocateArray<uint32_t>(header.visibilityWords);
+        m_visibilityCapacity = header.visibilityWords;
+        m_visibilityFaces = header.faceCount;
+        m_visibilityPending = false;
+        for (size_t i = 0; i < header.visibilityWords; i++)
+            m_visibility[i] = visibility[i];
+
+        BuildFaceEdges();
+        BuildComponents();
+        m_revision++;
+        m_stats = BuildStats();
+        return true;
+    }
+
+    void NavMesh::ResolveNeighbours(size_t startFace)
+    {
+        size_t edgeCount = 0;
+        for (size_t f = startFace; f < m_faces.GetSize(); f++)
+            edgeCount += m_faces[f].vertexCount;
+        size_t capacity = 16;
+        while (capacity < edgeCount * 2) capacity *= 2;
+        const size_t mask = capacity - 1;
+
+        rob::LinearAllocator scratch(rob::GetArraySize<EdgeSlot>(capacity) + alignof(EdgeSlot));
+        EdgeSlot *slots = scratch.AllocateArray<EdgeSlot>(capacity);
+        for (size_t i = 0; i < capacity; i++)
+            slots[i].face = InvalidIndex;
+
+        // Each edge is looked up from a map keyed by its sorted vertex indices.
+        // The first face to add an edge claims the slot, and the second one
+        // is linked to it as a neighbour.
+        for (size_t f = startFace; f < m_faces.GetSize(); f++)
+        {
+            Face &face = m_faces[f];
+            for (int e = 0; e < int(face.vertexCount); e++)
+            {
+                const uint64_t key = GetEdgeKey(face.vertices[e], face.vertices[NextVertex(face, e)]);
+                size_t slot = size_t((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+                while (slots[slot].face != InvalidIndex && slots[slot].key != key)
+                    slot = (slot + 1) & mask;
+
+                EdgeSlot &edge = slots[slot];
+                if (edge.face == InvalidIndex)
+                {
+                    edge.key = key;
+                    edge.face = f;
+                    edge.edge = e;
+                }
+                else if (m_faces[edge.face].neighbours[edge.edge] == InvalidIndex)
+                {
+                    face.neighbours[e] = edge.face;
+                    m_faces[edge.face].neighbours[edge.edge] = f;
+                    m_stats.sharedEdges++;
+                }
+            }
+        }
+    }
+
+    // Floods the faces through their neighbours with an explicit stack. Each face
+    // is pushed at most once, as it is tagged when pushed.
+    void NavMesh::BuildComponents()
+    {
+        const size_t faceCount = m_faces.GetSize();
+        if (faceCount > m_componentStackCapacity)
+        {
+            m_componentStack = m_alloc->AllocateArray<index_t>(faceCount);
+            m_componentStackCapacity = faceCount;
+        }
+
+        for (size_t f = 0; f < faceCount; f++)
+            m_faces[f].component = InvalidIndex;
+
+        index_t component = 0;
+        for (size_t f = 0; f < faceCount; f++)
+        {
+            Face &face = m_faces[f];
+            if (face.component != InvalidIndex || IsUnusedFace(face))
+                continue;
+
+            size_t top = 0;
+            face.component = component;
+            m_componentStack[top++] = f;
+            while (top > 0)
+            {
+                const Face &current = m_faces[m_componentStack[--top]];
+                for (int i = 0; i < int(current.vertexCount); i++)
+                {
+                    if (current.neighbours[i] == InvalidIndex) continue;
+                    Face &neighbour = m_faces[current.neighbours[i]];
+                    if (neighbour.component != InvalidIndex) continue;
+                    neighbour.component = component;
+                    m_componentStack[top++] = current.neighbours[i];
+                }
+            }
+            component++;
+        }
+        m_componentCount = component;
+    }
+
+    size_t NavMesh::GetVisibilitySamples(index_t face, vec2f *samples) const
+    {
+        const Face &f = m_faces[face];
+        if (IsUnusedFace(f))
+            return 0;
+
+        // The corners are pulled in a little to keep them inside the face.
+        const vec2f center = GetFaceCenter(f);
+        samples[0] = center;
+        for (int i = 0; i < int(f.vertexCount); i++)
+        {
+            const Vert &v = m_vertices[f.vertices[i]];
+            samples[i + 1] = center + (vec2f(v.x, v.y) - center) * 0.95f;
+        }
+        return f.vertexCount + 1;
+    }
+
+    void NavMesh::BuildVisibilityJob(void *data, size_t index, size_t thread)
+    {
+        const VisibilityJobs &visJobs = *static_cast<const VisibilityJobs*>(data);
+        const NavMesh &mesh = *visJobs.mesh;
+        const size_t job = visJobs.firstJob + index;
+        const size_t rowIndex = job / visJobs.rowJobs;
+        const index_t face0 = visJobs.rowFaces[rowIndex];
+        const size_t count0 = visJobs.sampleCounts[face0];
+        if (count0 == 0)
+            return;
+
+        // The jobs of a row write to different words of it.
+        const size_t firstFace = (job % visJobs.rowJobs) * VISIBILITY_JOB_FACES;
+        const size_t lastFace = rob::Min(firstFace + VISIBILITY_JOB_FACES, mesh.m_faces.GetSize());
+
+        const vec2f *samples0 = visJobs.samples + face0 * MAX_VISIBILITY_SAMPLES;
+        uint32_t *row = visJobs.rows + rowIndex * visJobs.rowWords;
+        if (face0 >= firstFace && face0 < lastFace)
+            row[face0 >> 5] |= 1u << (face0 & 31);
+
+        for (size_t f = firstFace; f < lastFace; f++)
+        {
+            // The pairs of two rows are computed once, and mirrored afterwards.
+            const size_t count1 = visJobs.sampleCounts[f];
+            if (count1 == 0 || (visJobs.faceRows[f] != NO_VISIBILITY_ROW && f >= face0))
+                continue;
+
+            const vec2f *samples1 = visJobs.samples + f * MAX_VISIBILITY_SAMPLES;
+            bool visible = false;
+            for (size_t a = 0; a < count0 && !visible; a++)
+            {
+                for (size_t b = 0; b < count1 && !visible; b++)
+                {
+                    // A sight line on the mesh is clear, and walking the mesh is
+                    // cheaper than casting against the physics.
+                    if (mesh.RayCast(face0, samples0[a], samples1[b]))
+                    {
+                        visible = true;
+                        continue;
+                    }
+                    StaticRayTest rayTest;
+                    visJobs.world->RayCast(&rayTest, ToB2(samples0[a]), ToB2(samples1[b]));
+                    visible = !rayTest.m_hit;
+                }
+            }
+            if (visible)
+                row[f >> 5] |= 1u << (f & 31);
+        }
+    }
+
+    // The bits of the faces are at the same place for any face count, so the
+    // matrix grows by copying it.
+    void NavMesh::ReserveVisibility(size_t faceCount)
+    {
+        const size_t oldWords = GetVisibilityWords(m_visibilityFaces);
+        const size_t words = GetVisibilityWords(faceCount);
+        if (words > m_visibilityCapacity)
+        {
+            uint32_t *visibility = m_alloc->AllocateArray<uint32_t>(words);
+            for (size_t w = 0; w < oldWords; w++)
+                visibility[w] = m_visibility[w];
+            m_visibility = visibility;
+            m_visibilityCapacity = words;
+        }
+        for (size_t w = oldWords; w < words; w++)
+            m_visibility[w] = 0;
+        m_visibilityFaces = faceCount;
+    }
+
+    // The faces are sampled from their centers and corners. As the samples can
+    // miss narrow sight lines, a face is made to see everything its neighbours
+    // see. The visibility of a face then depends on the sight lines of its
+    // neighbours, so after the tiles have been rebuilt the sight lines are cast
+    // from two rings of faces around them, and the bits of the inner ring are
+    // written. Without tiles the whole matrix is built.
+    void NavMesh::BeginVisibility(const size_t *tiles, size_t tileCount)
+    {
+        if (!m_visibilityUpdate)
+            m_visibilityUpdate = m_alloc->new_object<VisibilityUpdate>();
+        VisibilityUpdate &update = *m_visibilityUpdate;
+
+        // The rows of an unfinished update were cast on the old faces, so it
+        // starts over with its tiles and the new ones.
+        const bool rebuild = (tiles != nullptr);
+        if (!rebuild || !m_visibilityPending)
+        {
+            update.tiles.clear();
+            update.time = 0;
+        }
+        for (size_t i = 0; i < tileCount; i++)
+        {
+            if (std::find(update.tiles.begin(), update.tiles.end(), tiles[i]) == update.tiles.end())
+                update.tiles.push_back(tiles[i]);
+        }
+        if (!rebuild)
+            m_visibilityFaces = 0;
+
+        const size_t faceCount = m_faces.GetSize();
+        update.rebuild = rebuild;
+        update.rowWords = (faceCount + 31) / 32;
+        update.rowJobs = (faceCount + VISIBILITY_JOB_FACES - 1) / VISIBILITY_JOB_FACES;
+        update.jobsDone = 0;
+
+        // The faces written, and the faces cast from, which are the written
+        // faces and their neighbours.
+        std::vector<index_t> &written = update.written;
+        std::vector<size_t> &faceRows = update.faceRows;
+        written.clear();
+        faceRows.assign(faceCount, NO_VISIBILITY_ROW);
+        if (rebuild)
+        {
+            for (size_t i = 0; i < update.tiles.size(); i++)
+            {
+                const Tile &t = m_tiles[update.tiles[i]];
+                for (index_t f = t.firstFace; f < t.firstFace + t.faceCount; f++)
+                {
+                    if (faceRows[f] == NO_VISIBILITY_ROW)
+                    {
+                        faceRows[f] = 0;
+                        written.push_back(f);
+                    }
+                }
+            }
+            const size_t changedCount = written.size();
+            for (size_t i = 0; i < changedCount; i++)
+            {
+                const Face &face = m_faces[written[i]];
+                for (int v = 0; v < int(face.vertexCount); v++)
+                {
+                    const index_t n = face.neighbours[v];
+                    if (n != InvalidIndex && faceRows[n] == NO_VISIBILITY_ROW)
+                    {
+                        faceRows[n] = 0;
+                        written.push_back(n);
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (size_t f = 0; f < faceCount; f++)
+            {
+                if (IsUnusedFace(m_faces[f])) continue;
+                faceRows[f] = 0;
+                written.push_back(f);
+            }
+        }
+
+        std::vector<index_t> &rowFaces = update.rowFaces;
+        rowFaces = written;
+        for (size_t i = 0; i < written.size(); i++)
+        {
+            const Face &face = m_faces[written[i]];
+            for (int v = 0; v < int(face.vertexCount); v++)
+            {
+                const index_t n = face.neighbours[v];
+                if (n != InvalidIndex && faceRows[n] == NO_VISIBILITY_ROW)
+                {
+                    faceRows[n] = 0;
+                    rowFaces.push_back(n);
+                }
+            }
+        }
+        const size_t rowCount = rowFaces.size();
+        for (size_t r = 0; r < rowCount; r++)
+            faceRows[rowFaces[r]] = r;
+
+        update.samples.resize(faceCount * MAX_VISIBILITY_SAMPLES);
+        update.sampleCounts.resize(faceCount);
+        for (size_t f = 0; f < faceCount; f++)
+            update.sampleCounts[f] = GetVisibilitySamples(f, &update.samples[f * MAX_VISIBILITY_SAMPLES]);
+
+        update.rows.assign(rowCount * update.rowWords, 0);
+        m_visibilityPending = true;
+    }
+
+    void NavMesh::CastVisibility(const b2World *world, rob::JobSystem &jobs, size_t count)
+    {
+        VisibilityUpdate &update = *m_visibilityUpdate;
+        VisibilityJobs visJobs;
+        visJobs.mesh = this;
+        visJobs.world = world;
+        visJobs.samples = update.samples.data();
+        visJobs.sampleCounts = update.sampleCounts.data();
+        visJobs.rowFaces = update.rowFaces.data();
+        visJobs.faceRows = update.faceRows.data();
+        visJobs.rows = update.rows.data();
+        visJobs.rowWords = update.rowWords;
+        visJobs.rowJobs = update.rowJobs;
+        visJobs.firstJob = update.jobsDone;
+        jobs.ParallelFor(&NavMesh::BuildVisibilityJob, &visJobs, count);
+        update.jobsDone += count;
+    }
+
+    void NavMesh::EndVisibility()
+    {
+        VisibilityUpdate &update = *m_visibilityUpdate;
+        const std::vector<index_t> &written = update.written;
+        const std::vector<index_t> &rowFaces = update.rowFaces;
+        const std::vector<size_t> &faceRows = update.faceRows;
+        std::vector<uint32_t> &rows = update.rows;
+        const size_t faceCount = faceRows.size();
+        const size_t rowWords = update.rowWords;
+        const size_t rowCount = rowFaces.size();
+        const bool rebuild = update.rebuild;
+
+        for (size_t r0 = 0; r0 < rowCount; r0++)
+        {
+            const index_t f0 = rowFaces[r0];
+            for (size_t r1 = 0; r1 < rowCount; r1++)
+            {
+                const index_t f1 = rowFaces[r1];
+                if (f1 < f0 && ((rows[r0 * rowWords + (f1 >> 5)] >> (f1 & 31)) & 1))
+                    rows[r1 * rowWords + (f0 >> 5)] |= 1u << (f0 & 31);
+            }
+        }
+
+        ReserveVisibility(faceCount);
+
+        // The faces left unused by the rebuilt tiles see nothing.
+        for (size_t f0 = 0; f0 < faceCount; f0++)
+        {
+            if (!rebuild || !IsUnusedFace(m_faces[f0])) continue;
+            for (size_t f1 = 0; f1 < faceCount; f1++)
+            {
+                const size_t bit = GetVisibilityBit(f0, f1);
+                m_visibility[bit >> 5] &= ~(1u << (bit & 31));
+            }
+        }
+
+        // A written face sees what it or its neighbours see, and what is seen
+        // from the other face or its neighbours.
+        std::vector<uint32_t> grown(rowWords);
+        for (size_t i = 0; i < written.size(); i++)
+        {
+            const index_t f0 = written[i];
+            const uint32_t *row0 = &rows[faceRows[f0] * rowWords];
+            for (size_t w = 0; w < rowWords; w++)
+                grown[w] = row0[w];
+
+            const Face &face = m_faces[f0];
+            for (int v = 0; v < int(face.vertexCount); v++)
+            {
+                const index_t n = face.neighbours[v];
+                if (n == InvalidIndex) continue;
+                const uint32_t *rowN = &rows[faceRows[n] * rowWords];
+                for (size_t w = 0; w < rowWords; w++)
+                    grown[w] |= rowN[w];
+            }
+
+            for (size_t f1 = 0; f1 < faceCount; f1++)
+            {
+                const Face &face1 = m_faces[f1];
+                if (IsUnusedFace(face1)) continue;
+
+                bool visible = (grown[f1 >> 5] >> (f1 & 31)) & 1;
+                for (int v = 0; v < int(face1.vertexCount) && !visible; v++)
+                {
+                    const index_t n = face1.neighbours[v];
+                    visible = (n != InvalidIndex) && ((row0[n >> 5] >> (n & 31)) & 1);
+                }
+
+                const size_t bit = GetVisibilityBit(f0, f1);
+                if (visible)
+                    m_visibility[bit >> 5] |= 1u << (bit & 31);
+                else
+                    m_visibility[bit >> 5] &= ~(1u << (bit & 31));
+            }
+        }
+        m_visibilityPending = false;
+
+        size_t visiblePairs = 0;
+        for (size_t f0 = 0; f0 < faceCount; f0++)
+        {
+            for (size_t f1 = 0; f1 < f0; f1++)
+            {
+                if (IsPotentiallyVisible(f0, f1))
+                    visiblePairs++;
+            }
+        }
+
+        m_stats.visiblePairs = visiblePairs;
+        m_stats.visibilityFaces = written.size();
+
+        // The rows of a whole matrix are large, and not kept between updates.
+        update.tiles.clear();
+        std::vector<uint32_t>().swap(rows);
+        std::vector<vec2f>().swap(update.samples);
+    }
+
+    void NavMesh::BuildVisibility(const b2World *world, rob::JobSystem &jobs)
+    {
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t startTime = ticker.GetTicks();
+
+        BeginVisibility(nullptr, 0);
+        const VisibilityUpdate &update = *m_visibilityUpdate;
+        CastVisibility(world, jobs, update.rowFaces.size() * update.rowJobs);
+        EndVisibility();
+        m_stats.visibilityTime = ticker.GetTicks() - startTime;
+    }
+
+    bool NavMesh::UpdateVisibility(const b2World *world, rob::JobSystem &jobs, rob::Time_t budget)
+    {
+        if (!m_visibilityPending)
+            return true;
+
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t startTime = ticker.GetTicks();
+
+        // The jobs run a few at a time to stay close to the budget.
+        VisibilityUpdate &update = *m_visibilityUpdate;
+        const size_t jobCount = update.rowFaces.size() * update.rowJobs;
+        const size_t batch = jobs.GetThreadCount();
+        while (update.jobsDone < jobCount)
+        {
+            CastVisibility(world, jobs, rob::Min(batch, jobCount - update.jobsDone));
+            if (ticker.GetTicks() - startTime >= budget)
+                break;
+        }
+
+        if (update.jobsDone == jobCount)
+            EndVisibility();
+
+        update.time += ticker.GetTicks() - startTime;
+        m_stats.visibilityTime = update.time;
+        return !m_visibilityPending;
+    }
+
+    size_t NavMesh::GetFaceCount() const
+    { return m_faces.GetSize(); }
+
+    const NavMesh::Face& NavMesh::GetFace(size_t index) const
+    {
+        ROB_ASSERT(index < m_faces.GetSize());
+        return m_faces[index];
+    }
+
+    size_t NavMesh::GetTileCount() const
+    { return m_tilesX * m_tilesY; }
+
+    const NavMesh::Tile& NavMesh::GetTile(size_t index) const
+    {
+        ROB_ASSERT(index < GetTileCount());
+        return m_tiles[index];
+    }
+
+    size_t NavMesh::GetVertexCount() const
+    { return m_vertices.GetSize(); }
+
+    const NavMesh::Vert& NavMesh::GetVertex(size_t index) const
+    {
+        ROB_ASSERT(index < m_vertices.GetSize());
+        return m_vertices[index];
+    }
+
+    bool NavMesh::FaceContainsPoint(const Face &face, const vec2f &v) const
+    {
+        // Faces are convex and wound so that TriArea(v0, v1, v2) >= 0, the point
+        // must be on the same side of every edge.
+        const Vert *prev = &m_vertices[face.vertices[face.vertexCount - 1]];
+        for (size_t i = 0; i < face.vertexCount; i++)
+        {
+            const Vert *vert = &m_vertices[face.vertices[i]];
+            if (TriArea(vec2f(prev->x, prev->y), vec2f(vert->x, vert->y), v) < 0.0f)
+                return false;
+            prev = vert;
+        }
+        return true;
+    }
+
+    static void GetFaceBounds(const NavMesh &mesh, const NavMesh::Face &face, vec2f &minP, vec2f &maxP)
+    {
+        const NavMesh::Vert &v0 = mesh.GetVertex(face.vertices[0]);
+        minP = maxP = vec2f(v0.x, v0.y);
+        for (size_t i = 1; i < face.vertexCount; i++)
+        {
+            const NavMesh::Vert &v = mesh.GetVertex(face.vertices[i]);
+            minP.x = rob::Min(minP.x, v.x);
+            minP.y = rob::Min(minP.y, v.y);
+            maxP.x = rob::Max(maxP.x, v.x);
+            maxP.y = rob::Max(maxP.y, v.y);
+        }
+    }
+
+    void NavMesh::GetGridCell(const vec2f &p, int *cx, int *cy) const
+    {
+        const float invCellSize = 1.0f / m_grid.cellSize;
+        const int x = int(std::floor((p.x - m_grid.x0) * invCellSize));
+        const int y = int(std::floor((p.y - m_grid.y0) * invCellSize));
+        *cx = rob::Clamp(x, 0, m_grid.width - 1);
+        *cy = rob::Clamp(y, 0, m_grid.height - 1);
+    }
+
+    void NavMesh::BuildFaceGrid()
+    {
+        FaceGrid &grid = m_grid;
+
+        // Aim for a couple of faces per cell on average.
+        const float faceArea = (4.0f * m_halfW * m_halfH) / rob::Max(m_faces.GetSize(), size_t(1));
+        grid.cellSize = rob::Max(rob::Sqrt(faceArea * 2.0f), 1.0f);
+        grid.x0 = -m_halfW;
+        grid.y0 = -m_halfH;
+        grid.width = int(2.0f * m_halfW / grid.cellSize) + 1;
+        grid.height = int(2.0f * m_halfH / grid.cellSize) + 1;
+
+        const size_t cellCount = grid.width * grid.height;
+        if (cellCount + 1 > grid.cellCapacity)
+        {
+            grid.cellStart = m_alloc->AllocateArray<index_t>(cellCount + 1);
+            grid.cellCapacity = cellCount + 1;
+        }
+
+        // Count the faces of each cell and turn the counts into cell end offsets.
+        for (size_t c = 0; c <= cellCount; c++)
+            grid.cellStart[c] = 0;
+
+        for (size_t f = 0; f < m_faces.GetSize(); f++)
+        {
+            const Face &face = m_faces[f];
+            if (IsUnusedFace(face)) continue;
+            vec2f minP, maxP;
+            GetFaceBounds(*this, face, minP, maxP);
+
+            int x0, y0, x1, y1;
+            GetGridCell(minP, &x0, &y0);
+            GetGridCell(maxP, &x1, &y1);
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++)
+                    grid.cellStart[y * grid.width + x]++;
+        }
+
+        for (size_t c = 1; c <= cellCount; c++)
+            grid.cellStart[c] += grid.cellStart[c - 1];
+
+        const size_t total = grid.cellStart[cellCount];
+        if (total > grid.faceCapacity)
+        {
+            grid.faces = m_alloc->AllocateArray<index_t>(total);
+            grid.faceCapacity = total;
+        }
+
+        // Fill the cells backwards, after which the offsets point to the cell starts
+        // and the faces of each cell are in ascending order.
+        for (size_t f = m_faces.GetSize(); f > 0; f--)
+        {
+            const Face &face = m_faces[f - 1];
+            if (IsUnusedFace(face)) continue;
+            vec2f minP, maxP;
+            GetFaceBounds(*this, face, minP, maxP);
+
+            int x0, y0, x1, y1;
+            GetGridCell(minP, &x0, &y0);
+            GetGridCell(maxP, &x1, &y1);
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++)
+                    grid.faces[--grid.cellStart[y * grid.width + x]] = f - 1;
+        }
+
+        rob::log::Debug("NavMesh grid: ", grid.width, "x", grid.height, ", cell size: ", grid.cellSize, ", face refs: ", total);
+    }
+
+    index_t NavMesh::GetFaceIndex(const vec2f &v) const
+    {
+        int cx, cy;
+        GetGridCell(v, &cx, &cy);
+        const size_t c = cy * m_grid.width + cx;
+        for (index_t i = m_grid.cellStart[c]; i < m_grid.cellStart[c + 1]; i++)
+        {
+            const index_t f = m_grid.faces[i];
+            if (FaceContainsPoint(m_faces[f], v))
+                return f;
+        }
+        return InvalidIndex;
+    }
+
+    void NavMesh::GetFaceIndices(const vec2f *points, index_t *faces, size_t count) const
+    {
+        index_t prev = InvalidIndex;
+        for (size_t i = 0; i < count; i++)
+        {
+            // Consecutive points tend to be close to each other, so try the previous face first.
+            if (prev != InvalidIndex && FaceContainsPoint(m_faces[prev], points[i]))
+            {
+                faces[i] = prev;
+                continue;
+            }
+            faces[i] = prev = GetFaceIndex(points[i]);
+        }
+    }
+
+    static inline vec2f ClosestPointOnEdge(const vec2f &a, const vec2f &b, const vec2f &p)
+    {
+        const vec2f e = b - a;
+        const vec2f v = p - a;
+        const float d = e.Dot(e);
+        float t = e.Dot(v);
+        if (d > 0) t /= d;
+        if (t < 0) t = 0;
+        else if (t > 1) t = 1;
+        return a + t * e;
+    }
+
+    vec2f NavMesh::GetClosestPointOnFace(const Face &face, const vec2f &p) const
+    {
+        if (FaceContainsPoint(face, p))
+            return p;
+
+        // Outside of a convex face, the closest point is on one of the edges.
+        vec2f closest = p;
+        float minDist = 0.0f;
+        const Vert *prev = &m_vertices[face.vertices[face.vertexCount - 1]];
+        for (size_t i = 0; i < face.vertexCount; i++)
+        {
+            const Vert *vert = &m_vertices[face.vertices[i]];
+            const vec2f pos = ClosestPointOnEdge(vec2f(prev->x, prev->y), vec2f(vert->x, vert->y), p);
+            const float dist = rob::Distance2(pos, p);
+            if (i == 0 || dist < minDist)
+            {
+                closest = pos;
+                minDist = dist;
+            }
+            prev = vert;
+        }
+        return closest;
+    }
+
+    void NavMesh::BuildFaceEdges()
+    {
+        static_assert(MAX_FACE_VERTICES <= FACE_EDGE_LANES, "The edges of a face do not fit in the packets");
+
+        const size_t faceCount = m_faces.GetSize();
+        if (faceCount > m_faceEdgeCapacity)
+        {
+            m_faceEdges = m_alloc->AllocateArray<FaceEdges>(faceCount);
+            m_faceEdgeCapacity = faceCount;
+        }
+
+        for (size_t f = 0; f < faceCount; f++)
+        {
+            const Face &face = m_faces[f];
+            FaceEdges &edges = m_faceEdges[f];
+            if (IsUnusedFace(face)) continue;
+
+            for (int i = 0; i < FACE_EDGE_LANES; i++)
+            {
+                const int e = rob::Min(i, int(face.vertexCount) - 1);
+                const Vert &a = m_vertices[face.vertices[e]];
+                const Vert &b = m_vertices[face.vertices[NextVertex(face, e)]];
+                const float dx = b.x - a.x;
+                const float dy = b.y - a.y;
+                const float length2 = dx * dx + dy * dy;
+                edges.x[i] = a.x;
+                edges.y[i] = a.y;
+                edges.dx[i] = dx;
+                edges.dy[i] = dy;
+                edges.invLength2[i] = (length2 > 0.0f) ? 1.0f / length2 : 0.0f;
+            }
+        }
+    }
+
+    template <size_t S>
+    static inline float HorizontalMin(typename rob::simd::Simd<float, S>::v4_arg a)
+    {
+        typedef rob::simd::Simd<float, S> simd;
+        const typename simd::v4 b = simd::Min(a, simd::template Shuffle<2, 3, 0, 1>(a, a));
+        const typename simd::v4 c = simd::Min(b, simd::template Shuffle<1, 0, 3, 2>(b, b));
+        return simd::GetX(c);
+    }
+
+    // Returns the squared distance to the closest point on the edges of the face,
+    // or zero when the point is inside. Instantiated with a non-zero S, the packets
+    // are computed without SIMD.
+    template <size_t S>
+    float NavMesh::GetClosestPointOnEdges(const FaceEdges &edges, const vec2f &p, vec2f *closest)
+    {
+        typedef rob::simd::Simd<float, S> simd;
+        typedef typename simd::v4 v4;
+        static const int PACKETS = FACE_EDGE_LANES / 4;
+
+        const v4 px = simd::Set(p.x);
+        const v4 py = simd::Set(p.y);
+        const v4 zero = simd::Set(0.0f);
+        const v4 one = simd::Set(1.0f);
+
+        v4 cx[PACKETS], cy[PACKETS], dist2[PACKETS];
+        v4 minArea, minDist2;
+        for (int i = 0; i < PACKETS; i++)
+        {
+            const int lane = i * 4;
+            const v4 x = simd::Load(edges.x + lane);
+            const v4 y = simd::Load(edges.y + lane);
+            const v4 dx = simd::Load(edges.dx + lane);
+            const v4 dy = simd::Load(edges.dy + lane);
+            const v4 vx = simd::Sub(px, x);
+            const v4 vy = simd::Sub(py, y);
+
+            // The point is inside, if it is on the left of every edge as in TriArea.
+            const v4 area = simd::Sub(simd::Mul(vx, dy), simd::Mul(dx, vy));
+
+            v4 t = simd::Mul(simd::Add(simd::Mul(dx, vx), simd::Mul(dy, vy)), simd::Load(edges.invLength2 + lane));
+            t = simd::Min(simd::Max(t, zero), one);
+            cx[i] = simd::Add(x, simd::Mul(dx, t));
+            cy[i] = simd::Add(y, simd::Mul(dy, t));
+            const v4 ex = simd::Sub(px, cx[i]);
+            const v4 ey = simd::Sub(py, cy[i]);
+            dist2[i] = simd::Add(simd::Mul(ex, ex), simd::Mul(ey, ey));
+
+            minArea = (i == 0) ? area : simd::Min(minArea, area);
+            minDist2 = (i == 0) ? dist2[i] : simd::Min(minDist2, dist2[i]);
+        }
+
+        if (HorizontalMin<S>(minArea) >= 0.0f)
+        {
+            if (closest) *closest = p;
+            return 0.0f;
+        }
+
+        const float minDist = HorizontalMin<S>(minDist2);
+        if (closest)
+        {
+            alignas(16) float xs[FACE_EDGE_LANES];
+            alignas(16) float ys[FACE_EDGE_LANES];
+            alignas(16) float ds[FACE_EDGE_LANES];
+            for (int i = 0; i < PACKETS; i++)
+            {
+                simd::Store(xs + i * 4, cx[i]);
+                simd::Store(ys + i * 4, cy[i]);
+                simd::Store(ds + i * 4, dist2[i]);
+            }
+            int lane = 0;
+            while (lane + 1 < FACE_EDGE_LANES && ds[lane] != minDist) lane++;
+            *closest = vec2f(xs[lane], ys[lane]);
+        }
+        return minDist;
+    }
+
+    // The closest point may be written over the point.
+    float NavMesh::GetClosestPointOnFace(index_t face, const vec2f &p, vec2f *closest) const
+    { return GetClosestPointOnEdges<0>(m_faceEdges[face], p, closest); }
+
+    size_t NavMesh::TestClosestPoints(uint32_t seed, size_t count) const
+    {
+        const size_t faceCount = m_faces.GetSize();
+        if (faceCount == 0)
+            return 0;
+
+        rob::Random rand;
+        rand.Seed(seed);
+
+        // The points are taken from around the bounds of the face, so that some
+        // are inside, and the rest are closest to its edges or its corners.
+        const float margin = 2.0f;
+        size_t failed = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const index_t f = rand.GetInt(0, int(faceCount) - 1);
+            const Face &face = m_faces[f];
+            if (IsUnusedFace(face))
+                continue;
+
+            vec2f minP = vec2f(m_vertices[face.vertices[0]].x, m_vertices[face.vertices[0]].y);
+            vec2f maxP = minP;
+            for (int v = 1; v < int(face.vertexCount); v++)
+            {
+                const Vert &vert = m_vertices[face.vertices[v]];
+                minP.x = rob::Min(minP.x, vert.x);
+                minP.y = rob::Min(minP.y, vert.y);
+                maxP.x = rob::Max(maxP.x, vert.x);
+                maxP.y = rob::Max(maxP.y, vert.y);
+            }
+            const vec2f p(rand.GetReal(minP.x - margin, maxP.x + margin),
+                          rand.GetReal(minP.y - margin, maxP.y + margin));
+
+            const float scalarDist2 = rob::Distance2(GetClosestPointOnFace(face, p), p);
+            vec2f closest[2];
+            const float dist2[2] = {
+                GetClosestPointOnEdges<0>(m_faceEdges[f], p, &closest[0]),
+                GetClosestPointOnEdges<1>(m_faceEdges[f], p, &closest[1])
+            };
+            // The distances are compared, as a point equally far from two edges
+            // may get a different closest point from each version.
+            const float tolerance = 1e-4f * rob::Max(1.0f, scalarDist2);
+            for (int k = 0; k < 2; k++)
+            {
+                if (rob::Abs(dist2[k] - scalarDist2) > tolerance ||
+                    rob::Abs(rob::Distance2(closest[k], p) - scalarDist2) > tolerance)
+                {
+                    if (failed < 10)
+                    {
+                        rob::log::Error("NavMesh::TestClosestPoints: Face ", f, ", point (", p.x, ", ", p.y, "), ",
+                                        (k == 0) ? "SIMD" : "packed", " distance ", dist2[k], ", scalar ", scalarDist2);
+                    }
+                    failed++;
+                    break;
+                }
+            }
+        }
+        return failed;
+    }
+
+    index_t NavMesh::GetClampedFaceIndex(vec2f *v) const
+    { return FindClampedFaceIndex(InvalidIndex, v); }
+
+    index_t NavMesh::GetClampedComponentFaceIndex(index_t component, vec2f *v) const
+    {
+        ROB_ASSERT(component < m_componentCount);
+        return FindClampedFaceIndex(component, v);
+    }
+
+    // Any face is considered, if the component is invalid.
+    index_t NavMesh::FindClampedFaceIndex(index_t component, vec2f *v) const
+    {
+        ROB_ASSERT(m_faces.GetSize() > 0);
+
+        int cx, cy;
+        GetGridCell(*v, &cx, &cy);
+
+        index_t index = InvalidIndex;
+        float minDist = 0.0f;
+
+        // Search the grid in rings of cells around the point. A face that has not been
+        // seen after ring r cannot be closer than r cells, as the face is in every cell
+        // that its bounding box overlaps.
+        const int maxRing = rob::Max(m_grid.width, m_grid.height);
+        for (int ring = 0; ring <= maxRing; ring++)
+        {
+            const int x0 = cx - ring, x1 = cx + ring;
+            const int y0 = cy - ring, y1 = cy + ring;
+            for (int y = rob::Max(y0, 0); y <= y1 && y < m_grid.height; y++)
+            {
+                const int step = (y == y0 || y == y1) ? 1 : x1 - x0;
+                for (int x = x0; x <= x1; x += step)
+                {
+                    if (x < 0 || x >= m_grid.width) continue;
+
+                    const size_t c = y * m_grid.width + x;
+                    for (index_t i = m_grid.cellStart[c]; i < m_grid.cellStart[c + 1]; i++)
+                    {
+                        const index_t f = m_grid.faces[i];
+                        if (component != InvalidIndex && m_faces[f].component != component)
+                            continue;
+                        // Only the distances are compared, and the closest point is
+                        // found for the closest face in the end.
+                        const float dist = GetClosestPointOnFace(f, *v, nullptr);
+                        if (dist <= 0.0f)
+                            return f;
+                        if (index == InvalidIndex || dist < minDist)
+                        {
+                            index = f;
+                            minDist = dist;
+                        }
+                    }
+                }
+            }
+
+            const float bound = ring * m_grid.cellSize;
+            if (index != InvalidIndex && minDist <= bound * bound)
+                break;
+        }
+
+        if (index != InvalidIndex)
+            GetClosestPointOnFace(index, *v, v);
+        return index;
+    }
+
+    void NavMesh::GetClampedFaceIndices(vec2f *points, index_t *faces, size_t count) const
+    {
+        index_t prev = InvalidIndex;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (prev != InvalidIndex && FaceContainsPoint(m_faces[prev], points[i]))
+            {
+                faces[i] = prev;
+                continue;
+            }
+            faces[i] = prev = GetClampedFaceIndex(&points[i]);
+        }
+    }
+
+    index_t NavMesh::GetClampedFaceIndex(index_t face, vec2f *v) const
+    {
+        if (face == InvalidIndex || face >= m_faces.GetSize() || m_faces[face].vertexCount == 0)
+            return GetClampedFaceIndex(v);
+
+        for (int step = 0; step < MAX_WALK_STEPS; step++)
+        {
+            // The walk crosses the edge the point is farthest outside of. A point
+            // only outside of edges without a neighbour is off the mesh, unless
+            // it is on a face not linked to this one, and it is clamped to the
+            // face when close to it.
+            const Face &f = m_faces[face];
+            bool inside = true;
+            int exitEdge = -1;
+            float exitDist = 0.0f;
+            for (int i = 0; i < int(f.vertexCount); i++)
+            {
+                const Vert &v0 = m_vertices[f.vertices[i]];
+                const Vert &v1 = m_vertices[f.vertices[NextVertex(f, i)]];
+                const vec2f a(v0.x, v0.y), b(v1.x, v1.y);
+                const float area = TriArea(a, b, *v);
+                if (area >= 0.0f)
+                    continue;
+
+                inside = false;
+                const float dist = -area / rob::Distance(a, b);
+                if (f.neighbours[i] != InvalidIndex && dist > exitDist)
+                {
+                    exitEdge = i;
+                    exitDist = dist;
+                }
+            }
+
+            if (inside)
+                return face;
+            if (exitEdge < 0)
+            {
+                const index_t containing = GetFaceIndex(*v);
+                if (containing != InvalidIndex)
+                    return containing;
+
+                vec2f clamped;
+                if (GetClosestPointOnFace(face, *v, &clamped) > MAX_WALK_CLAMP_DIST * MAX_WALK_CLAMP_DIST)
+                    break;
+                *v = clamped;
+                return face;
+            }
+            face = f.neighbours[exitEdge];
+        }
+        return GetClampedFaceIndex(v);
+    }
+
+    bool NavMesh::RayCast(index_t startFace, const vec2f &start, const vec2f &end, float *hitFraction) const
+    {
+        if (hitFraction) *hitFraction = 0.0f;
+
+        index_t face = (startFace != InvalidIndex) ? startFace : GetFaceIndex(start);
+        if (face == InvalidIndex)
+            return false;
+
+        // The segment is clipped to each face in turn, and leaves it over the
+        // edge that limits it the most. Faces of different tiles may link edges
+        // that only partially overlap, so the segment must enter the next face
+        // where it left the previous one.
+        const float epsilon = 1e-4f;
+        float enter = 0.0f;
+        for (size_t step = 0; step < m_faces.GetSize(); step++)
+        {
+            const Face &f = m_faces[face];
+            float tmin = 0.0f;
+            float tmax = 1.0f;
+            int exitEdge = -1;
+            for (int i = 0; i < int(f.vertexCount); i++)
+            {
+                const Vert &v0 = m_vertices[f.vertices[i]];
+                const Vert &v1 = m_vertices[f.vertices[NextVertex(f, i)]];
+                const vec2f a(v0.x, v0.y), b(v1.x, v1.y);
+                const float s0 = TriArea(a, b, start);
+                const float ds = TriArea(a, b, end) - s0;
+                if (ds < 0.0f)
+                {
+                    const float t = s0 / -ds;
+                    if (t < tmax)
+                    {
+                        tmax = t;
+                        exitEdge = i;
+                    }
+                }
+                else if (ds > 0.0f)
+                {
+                    tmin = rob::Max(tmin, -s0 / ds);
+                }
+                else if (s0 < 0.0f)
+                {
+                    tmin = 1.0f; // Parallel to the edge and outside of it
+                }
+            }
+
+            if (tmin > enter + epsilon || tmin > tmax + epsilon)
+            {
+                if (hitFraction) *hitFraction = enter;
+                return false;
+            }
+            if (exitEdge < 0)
+                return true;
+
+            const index_t next = f.neighbours[exitEdge];
+            if (next == InvalidIndex)
+            {
+                if (hitFraction) *hitFraction = tmax;
+                return false;
+            }
+            face = next;
+            enter = tmax;
+        }
+        return false;
+    }
+
+    void NavMesh::RayCast(const Segment *segments, bool *clear, size_t count) const
+    {
+        index_t prev = InvalidIndex;
+        for (size_t i = 0; i < count; i++)
+        {
+            // Segments from the same agent tend to start on the same face.
+            const Segment &segment = segments[i];
+            index_t face = segment.startFace;
+            if (face == InvalidIndex)
+            {
+                if (prev != InvalidIndex && FaceContainsPoint(m_faces[prev], segment.start))
+                    face = prev;
+                else
+                    face = prev = GetFaceIndex(segment.start);
+            }
+            clear[i] = (face != InvalidIndex) && RayCast(face, segment.start, segment.end);
+        }
+    }
+
+    vec2f NavMesh::GetFaceCenter(const Face &f) const
+    {
+        vec2f center(0.0f, 0.0f);
+        for (size_t i = 0; i < f.vertexCount; i++)
+        {
+            const Vert &v = GetVertex(f.vertices[i]);
+            center += vec2f(v.x, v.y);
+        }
+        return center / float(f.vertexCount);
+    }
+
+    vec2f NavMesh::GetEdgeCenter(index_t f, int edge) const
     {
-        static const int nextEdgeV[] = { 1, 2, 0 };
         const Face &face = GetFace(f);
         const Vert &v0 = GetVertex(face.vertices[edge]);
-        const Vert &v1 = GetVertex(face.vertices[nextEdgeV[edge]]);
+        const Vert &v1 = GetVertex(face.vertices[NextVertex(face, edge)]);
         return vec2f(v0.x + v1.x, v0.y + v1.y) / 2.0f;
     }
 
@@ -783,15 +2602,16 @@ namespace sneaky
 
     bool FaceHasVertex(const NavMesh::Face &face, const index_t v)
     {
-        return face.vertices[0] == v || face.vertices[1] == v || face.vertices[2] == v;
+        for (size_t i = 0; i < face.vertexCount; i++)
+            if (face.vertices[i] == v) return true;
+        return false;
     }
 
     float NavMesh::GetDist(index_t fi0, index_t fi1, int edge) const
     {
-        static const int nextEdge[] = { 1, 2, 0 };
         const Face &f0 = m_faces[fi0];
         const Face &f1 = m_faces[fi1];
-        if (FaceHasVertex(f1, f0.vertices[edge]) || FaceHasVertex(f1, f0.vertices[nextEdge[edge]]))
+        if (FaceHasVertex(f1, f0.vertices[edge]) || FaceHasVertex(f1, f0.vertices[NextVertex(f0, edge)]))
         {
             return 0.0f;
         }
@@ -811,8 +2631,7 @@ namespace sneaky
 
     NavMesh::Vert* NavMesh::AddVertex(float x, float y) //, bool active)
     {
-        ROB_ASSERT(m_vertexCount < MAX_VERTICES);
-        Vert &v = m_vertices[m_vertexCount++];
+        Vert &v = m_vertices.Push();
         v.x = x;
         v.y = y;
 //        v.flags = 0;
@@ -820,106 +2639,53 @@ namespace sneaky
         return &v;
     }
 
+    static inline size_t GetWeldHash(int cx, int cy)
+    {
+        return (uint32_t(cx) * 73856093u) ^ (uint32_t(cy) * 19349663u);
+    }
+
     NavMesh::Vert* NavMesh::GetVertex(const float x, const float y, index_t *index)
     {
-        const size_t HASH_MASK = MAX_VERTICES - 1;
-        const float scale = 1000.0f;
-        const int hx = roundf(x * scale);
-        const int hy = roundf(y * scale);
-        const vec2f v(x, y);
         const float epsilonDist = 0.01f;
+        const vec2f v(x, y);
 
-        size_t hash = (hy * 32786 + hx) & HASH_MASK;
-
-
-        Vert *vert = m_vertCache.m_v[hash];
-        if (vert)
+        // The hash cells are epsilon sized, so any vertex within epsilon distance
+        // is in one of the neighbouring cells.
+        const int cx = int(std::floor(x / epsilonDist));
+        const int cy = int(std::floor(y / epsilonDist));
+        for (int dy = -1; dy <= 1; dy++)
         {
-            if (!vec2f::Equals(vec2f(vert->x, vert->y), v, epsilonDist))
+            for (int dx = -1; dx <= 1; dx++)
             {
-                bool found = false;
-                for (index_t i = 0; i < m_vertexCount; i++)
+                index_t i = m_weld.buckets[GetWeldHash(cx + dx, cy + dy) & m_weld.bucketMask];
+                for (; i != InvalidIndex; i = m_weld.next[i - m_weld.firstVertex])
                 {
-                    vert = m_vertices + i;
+                    Vert *vert = &m_vertices[i];
                     if (vec2f::Equals(vec2f(vert->x, vert->y), v, epsilonDist))
                     {
-                        found = true;
-                        break;
+                        *index = i;
+                        return vert;
                     }
                 }
-                if (!found) vert = nullptr;
-
-////                hash -= 32786 + 1;
-//                const size_t hstart = hash;
-//                do {
-//                    vert = m_vertCache.m_v[hash];
-//                    hash = (hash + 1) & HASH_MASK;
-//                    if (!vert || vec2f::Equals(vec2f(vert->x, vert->y), v, epsilonDist))
-//                        break;
-//                } while (hash != hstart);
-//
-//                if (hash == hstart)
-//                {
-//                    ROB_ASSERT(hash != hstart);
-//                }
-            }
-        }
-//        if (vert)
-//        {
-//            const index_t hstart = hash;
-//            while (!found && hash < MAX_VERTICES)
-//            {
-//                vert = m_vertCache.m_v[hash];
-//                if (vert && !vec2f::Equals(vec2f(vert->x, vert->y), v, 0.01f))
-//                {
-//                    hash++;
-//                }
-//                else
-//                {
-//                    found = true;
-//                }
-//            }
-//            hash = 0;
-//            while (!found && hash < hstart)
-//            {
-//                vert = m_vertCache.m_v[hash];
-//                if (vert && !vec2f::Equals(vec2f(vert->x, vert->y), v, 0.01f))
-//                {
-//                    hash++;
-//                }
-//                else
-//                {
-//                    found = true;
-//                }
-//            }
-//            if (!found && hash == hstart)
-//            {
-//                ROB_ASSERT(hash != hstart);
-//            }
-//        }*/
-
-        if (!vert)
-        {
-            vert = AddVertex(v.x, v.y);
-            m_vertCache.m_v[hash] = vert;
-        }
-
-        const float dist = rob::Distance(vec2f(vert->x, vert->y), v);
-        if (dist >= epsilonDist)
-        {
-            rob::log::Error("Distance ", dist, " >= ", epsilonDist);
-            ROB_ASSERT(dist < epsilonDist);
-        }
-
-        *index = index_t(vert - m_vertices);
+            }
+        }
+
+        const index_t vi = m_vertices.GetSize();
+        ROB_ASSERT(vi < m_weld.maxVertices);
+        Vert *vert = AddVertex(v.x, v.y);
+        const size_t bucket = GetWeldHash(cx, cy) & m_weld.bucketMask;
+        m_weld.next[vi - m_weld.firstVertex] = m_weld.buckets[bucket];
+        m_weld.buckets[bucket] = vi;
+
+        *index = vi;
         return vert;
     }
 
     index_t NavMesh::AddFace(index_t i0, index_t i1, index_t i2)
     {
-        ROB_ASSERT(m_faceCount < MAX_FACES);
-        const index_t faceI = m_faceCount++;
-        Face &f = m_faces[faceI];
+        const index_t faceI = m_faces.GetSize();
+        Face &f = m_faces.Push();
+        ClearFace(f);
         f.vertices[0] = i0;
         f.vertices[1] = i1;
         f.vertices[2] = i2;
@@ -934,29 +2700,65 @@ namespace sneaky
             f.vertices[2] = i1;
         }
 
-        for (size_t i = 0; i < 3; i++) f.neighbours[i] = InvalidIndex;
-        f.flags = 0;
+        f.vertexCount = 3;
         return faceI;
     }
 
+    // Faces of different tiles can be linked over several collinear edges along
+    // the tile border. Gets the vertices at the ends of the run of edges linked
+    // to the neighbour.
+    static void GetLinkedEdges(const NavMesh::Face &face, index_t neighbour, int *v0, int *v1)
+    {
+        const int count = face.vertexCount;
+        int first = 0;
+        while (first + 1 < count && face.neighbours[first] != neighbour) first++;
+
+        for (int k = 1; k < count && face.neighbours[PrevVertex(face, first)] == neighbour; k++)
+            first = PrevVertex(face, first);
+        int last = first;
+        for (int k = 1; k < count && face.neighbours[NextVertex(face, last)] == neighbour; k++)
+            last = NextVertex(face, last);
+
+        *v0 = first;
+        *v1 = NextVertex(face, last);
+    }
+
     void NavMesh::GetPortalPoints(const index_t from, const index_t to, vec2f &left, vec2f &right) const
     {
-        static const int next[] = { 1, 2, 0 };
         const Face &fromFace = m_faces[from];
 
-        int edge = 0;
-        for (; edge < 3; edge++)
-        {
-            if (fromFace.neighbours[edge] == to)
-                break;
-        }
-
-        const index_t v0 = fromFace.vertices[edge];
-        const index_t v1 = fromFace.vertices[next[edge]];
+        int i0, i1;
+        GetLinkedEdges(fromFace, to, &i0, &i1);
+        const index_t v0 = fromFace.vertices[i0];
+        const index_t v1 = fromFace.vertices[i1];
         const Vert &vert0 = m_vertices[v0];
         const Vert &vert1 = m_vertices[v1];
         left = vec2f(vert0.x, vert0.y);
         right = vec2f(vert1.x, vert1.y);
+
+        // Faces of different tiles do not share vertices, and their edges may
+        // only partially overlap. The portal is the overlapping part.
+        const Face &toFace = m_faces[to];
+        if (FaceHasVertex(toFace, v0) && FaceHasVertex(toFace, v1))
+            return;
+
+        int j0, j1;
+        GetLinkedEdges(toFace, from, &j0, &j1);
+        const Vert &w0 = m_vertices[toFace.vertices[j0]];
+        const Vert &w1 = m_vertices[toFace.vertices[j1]];
+
+        const vec2f e = right - left;
+        const float len2 = e.Dot(e);
+        if (len2 <= 0.0f)
+            return;
+        const float t0 = rob::Max(e.Dot(vec2f(w1.x, w1.y) - left) / len2, 0.0f);
+        const float t1 = rob::Min(e.Dot(vec2f(w0.x, w0.y) - left) / len2, 1.0f);
+        const vec2f start = left;
+        if (t0 < t1)
+        {
+            left = start + e * t0;
+            right = start + e * t1;
+        }
     }
 
 } // sneaky
@@ -3,11 +3,14 @@
 #define H_SNEAKY_NAV_MESH_H
 
 #include "Physics.h"
+#include "Triangulator.h"
+#include "rob/memory/ChunkArray.h"
+#include "rob/Types.h"
 #include <clipper.hpp>
 
 namespace rob
 {
-    class LinearAllocator;
+    class JobSystem;
 } // rob
 
 namespace sneaky
@@ -25,11 +28,16 @@ namespace sneaky
             FaceActive = 0x1,
         };
 
+        // Faces are convex polygons, merged from the triangles of the tiles.
+        static const int MAX_FACE_VERTICES = 6;
+
         struct Face
         {
-            index_t vertices[3];
-            index_t neighbours[3];
+            index_t vertices[MAX_FACE_VERTICES];
+            index_t neighbours[MAX_FACE_VERTICES]; // Across the edge from vertices[i] to vertices[i + 1]
+            uint32_t vertexCount; // Zero for unused faces
             uint32_t flags;
+            index_t component; // Faces linked through their neighbours share the component
         };
 
         enum VertBits
@@ -43,8 +51,62 @@ namespace sneaky
 //            uint32_t flags;
         };
 
-        static const index_t MAX_FACES = 1024*32;
-        static const index_t MAX_VERTICES = 1024*32;
+        // The mesh is built in square tiles, each owning a range of faces and
+        // vertices. The faces of neighbouring tiles are linked across the tile
+        // borders, and a tile can be rebuilt without touching the others.
+        struct Tile
+        {
+            index_t firstFace;
+            index_t faceCount;
+            index_t faceCapacity;
+            index_t firstVertex;
+            index_t vertexCount;
+            index_t vertexCapacity;
+        };
+
+        struct Segment
+        {
+            vec2f start;
+            vec2f end;
+            index_t startFace; // Located on the grid if not known
+        };
+
+        static constexpr float TILE_SIZE = 24.0f;
+        static const int MAX_WALK_STEPS = 16;
+        static constexpr float MAX_WALK_CLAMP_DIST = 1.0f;
+
+        // Timings are in microseconds. The times of building the tiles are summed
+        // over the threads that built them.
+        struct BuildStats
+        {
+            rob::Time_t clipTime;
+            rob::Time_t triangulateTime;
+            rob::Time_t neighbourTime;
+            rob::Time_t mergeTime;
+            rob::Time_t visibilityTime; // Of the faces whose visibility was computed, over all its updates
+            rob::Time_t totalTime;
+            size_t sharedEdges;
+            size_t triangleCount;
+            size_t visiblePairs;
+            size_t visibilityFaces; // Faces whose visibility was computed
+        };
+
+        // The static obstacles merged into one set of polygons, before they are
+        // grown by the agent radius. Meshes of different radii built together share
+        // them. Bodies up to the margin outside of the area are merged, which must
+        // cover the largest radius.
+        struct Obstacles
+        {
+            ClipperLib::Paths paths;
+            float margin;
+            bool merged;
+
+            Obstacles()
+                : paths()
+                , margin(0.0f)
+                , merged(false)
+            { }
+        };
 
     public:
         NavMesh();
@@ -54,22 +116,104 @@ namespace sneaky
         size_t GetByteSizeUsed() const;
 
         void Allocate(rob::LinearAllocator &alloc);
-        void Create(const b2World *world, const float halfW, const float halfH, const float agentRadius);
+        // The obstacles are merged on the first use, if not merged already.
+        void Create(const b2World *world, const float halfW, const float halfH, const float agentRadius, rob::JobSystem &jobs,
+                    Obstacles *obstacles = nullptr);
+
+        // Rebuilds the tiles affected by static bodies within the area, after
+        // bodies have been added or removed there. Returns the number of tiles rebuilt.
+        // The visibility is computed again only for the faces near the rebuilt
+        // tiles, and is kept between the other faces. It is computed over the
+        // following calls to UpdateVisibility, and every face is potentially
+        // visible until it is done.
+        size_t RebuildTiles(const b2World *world, const vec2f &minP, const vec2f &maxP, rob::JobSystem &jobs,
+                            Obstacles *obstacles = nullptr);
+
+        static void MergeObstacles(Obstacles &obstacles, const b2World *world, const vec2f &minP, const vec2f &maxP);
+
+        // Casts the sight lines of the rebuilt tiles for about the budget in
+        // microseconds, and writes the visibility when all have been cast. Returns
+        // true when the visibility is up to date. A rebuild before then starts
+        // the update over, with the tiles of both rebuilds.
+        bool UpdateVisibility(const b2World *world, rob::JobSystem &jobs, rob::Time_t budget);
+        bool IsVisibilityPending() const
+        { return m_visibilityPending; }
+
+        // Builds the tiles with the staging of the owner, which must outlive this mesh.
+        void ShareStaging(NavMesh *owner)
+        { m_stagingOwner = owner; }
+
+        // Changes every time the faces of the mesh change.
+        uint32_t GetRevision() const
+        { return m_revision; }
+
+        // Baked meshes are keyed by the world seed and the agent radius.
+        bool Save(const char * const filename, const uint32_t seed, const float agentRadius) const;
+        bool Load(const char * const filename, const uint32_t seed, const float agentRadius);
         void SetGrid(const b2World *world, const float halfW, const float halfH, const float agentRadius);
 
         vec2f GetHalfSize() const
         { return vec2f(m_halfW, m_halfH); }
 
+        const BuildStats& GetBuildStats() const
+        { return m_stats; }
+
         size_t GetFaceCount() const;
         const Face& GetFace(size_t index) const;
 
+        // The connected components are found after every change of the faces. A
+        // path exists only between the faces of the same component.
+        index_t GetComponentCount() const
+        { return m_componentCount; }
+        index_t GetFaceComponent(index_t face) const
+        { return m_faces[face].component; }
+
+        // The potentially visible set of the faces is baked with the mesh. It is
+        // sampled, and can miss a few sight lines between faces that are not
+        // potentially visible to each other, so it must not stand in for a ray
+        // cast. Faces not on the mesh, such as the invalid index, are potentially
+        // visible to all.
+        bool IsPotentiallyVisible(index_t f0, index_t f1) const
+        {
+            if (m_visibilityPending || f0 >= m_visibilityFaces || f1 >= m_visibilityFaces) return true;
+            const size_t bit = GetVisibilityBit(f0, f1);
+            return (m_visibility[bit >> 5] >> (bit & 31)) & 1;
+        }
+        size_t GetVisibilityByteSize() const
+        { return GetVisibilityWords(m_visibilityFaces) * sizeof(uint32_t); }
+
         size_t GetVertexCount() const;
         const Vert& GetVertex(size_t index) const;
 
+        size_t GetTileCount() const;
+        const Tile& GetTile(size_t index) const;
+        int GetTilesX() const
+        { return m_tilesX; }
+        int GetTilesY() const
+        { return m_tilesY; }
+
         index_t GetFaceIndex(const vec2f &v) const;
+        void GetFaceIndices(const vec2f *points, index_t *faces, size_t count) const;
 
         vec2f GetClosestPointOnFace(const Face &face, const vec2f &p) const;
+        // Compares the closest points on the packed edges of random faces, with
+        // and without SIMD, to the scalar version for random points around the
+        // faces. Returns the number of points on which they disagree.
+        size_t TestClosestPoints(uint32_t seed, size_t count) const;
         index_t GetClampedFaceIndex(vec2f *v) const;
+        void GetClampedFaceIndices(vec2f *points, index_t *faces, size_t count) const;
+        // Walks from a face near the point to the neighbours toward it, and
+        // searches the grid only if the walk does not reach the point.
+        index_t GetClampedFaceIndex(index_t face, vec2f *v) const;
+        // Like the above, but only considers the faces of the component.
+        index_t GetClampedComponentFaceIndex(index_t component, vec2f *v) const;
+
+        // Walks the faces along the segment from the face of the start. Returns
+        // true, if the segment stays on the mesh, and otherwise the fraction of
+        // the segment at which it leaves the mesh. The walkable space is clear
+        // of static obstacles, so a segment on the mesh is not blocked by them.
+        bool RayCast(index_t startFace, const vec2f &start, const vec2f &end, float *hitFraction = nullptr) const;
+        void RayCast(const Segment *segments, bool *clear, size_t count) const;
 
         vec2f GetFaceCenter(const Face &f) const;
         vec2f GetEdgeCenter(index_t f, int edge) const;
@@ -81,41 +225,150 @@ namespace sneaky
         std::vector<std::vector<vec2f> > m_solids;
         std::vector<std::vector<vec2f> > m_holes;
 
-        int Refine2();
-        int Refine();
-
-        uint32_t Flood();
-        void FloodFace(Face &face, const uint32_t flag);
-
     private:
-        void CreateClipperPaths(ClipperLib::Clipper &clipper, const b2World *world, const float halfW, const float halfH, const float clipperScale);
-        void TriangulatePath(const ClipperLib::Path &path, const ClipperLib::Paths &holes, const float clipperScale);
-
+        struct TileStaging;
+        struct TileBuild;
+        struct TileJobs;
+        struct FaceEdges;
+        struct VisibilityJobs;
+        struct VisibilityUpdate;
+
+        void CreateObstaclePaths(ClipperLib::Paths &obstacles, const b2World *world, const vec2f &minP, const vec2f &maxP, Obstacles *merged) const;
+        TileStaging **ReserveStaging(size_t threadCount);
+        bool GrowStaging(size_t thread);
+        ClipperLib::IntRect GetTileRect(size_t tile) const;
+        void BuildTiles(const size_t *tiles, size_t count, const ClipperLib::Paths &obstacles, rob::JobSystem &jobs);
+        static void BuildTileJob(void *data, size_t index, size_t thread);
+        // Returns false if the tile does not fit the memory of the mesh.
+        bool TriangulateTile(size_t tile, const ClipperLib::Paths &obstacles, const ClipperLib::IntRect *obstacleBounds);
+        void PlaceTile(size_t tile, const TileBuild &build);
+        void FindFreeRanges();
+        void UnlinkTile(size_t tile);
+        void StitchTiles(size_t tile0, size_t tile1, int axis);
+        bool TriangulatePath(const ClipperLib::Path &path, const ClipperLib::Paths &holes, const ClipperLib::IntRect &tileRect);
+
+        void MergeFaces(index_t first);
 
         static bool TestPoint(const b2World *world, float x, float y);
         Vert* AddVertex(float x, float y);
         Vert* GetVertex(float x, float y, index_t *index);
         index_t AddFace(index_t i0, index_t i1, index_t i2);
         bool FaceContainsPoint(const Face &face, const vec2f &v) const;
-        bool FaceHasEdge(const Face &face, index_t v0, index_t v1);
-        void SetNeighbour(index_t fi, int ni, index_t fj, index_t v0, index_t v1);
         void ResolveNeighbours(size_t startFace);
 
+        void BuildFaceGrid();
+        void GetGridCell(const vec2f &p, int *cx, int *cy) const;
+        index_t FindClampedFaceIndex(index_t component, vec2f *v) const;
+
+        void BuildComponents();
+
+        void BuildVisibility(const b2World *world, rob::JobSystem &jobs);
+        void BeginVisibility(const size_t *tiles, size_t tileCount);
+        void CastVisibility(const b2World *world, rob::JobSystem &jobs, size_t count);
+        void EndVisibility();
+        void ReserveVisibility(size_t faceCount);
+        static void BuildVisibilityJob(void *data, size_t index, size_t thread);
+        size_t GetVisibilitySamples(index_t face, vec2f *samples) const;
+
+        // The matrix is symmetric, and only the lower triangle is stored.
+        static size_t GetVisibilityBit(index_t f0, index_t f1)
+        { return (f0 < f1) ? size_t(f1) * (f1 + 1) / 2 + f0 : size_t(f0) * (f0 + 1) / 2 + f1; }
+        static size_t GetVisibilityWords(size_t faceCount)
+        { return (faceCount * (faceCount + 1) / 2 + 31) / 32; }
+
+        void BuildFaceEdges();
+        float GetClosestPointOnFace(index_t face, const vec2f &p, vec2f *closest) const;
+        template <size_t S>
+        static float GetClosestPointOnEdges(const FaceEdges &edges, const vec2f &p, vec2f *closest);
+
     private:
-        size_t m_faceCount;
-        Face *m_faces;
+        rob::LinearAllocator *m_alloc;
 
-        size_t m_vertexCount;
-        Vert *m_vertices;
+        rob::ChunkArray<Face, 256> m_faces;
+        rob::ChunkArray<Vert, 512> m_vertices;
+
+        // Spatial hash of the vertices for welding, with chained buckets. Only
+        // valid while triangulating a path.
+        struct VertexWeld
+        {
+            index_t *buckets;
+            index_t *next; // Indexed from the first vertex of the path
+            size_t bucketMask;
+            size_t firstVertex;
+            size_t maxVertices;
+        };
+        VertexWeld m_weld;
+        Triangulator m_triangulator;
+
+        // Uniform grid of face buckets for point location. A face is added to
+        // every cell its bounding box overlaps.
+        struct FaceGrid
+        {
+            float x0, y0;
+            float cellSize;
+            int width, height;
+            index_t *cellStart; // width * height + 1 offsets to faces
+            index_t *faces;
+            size_t cellCapacity;
+            size_t faceCapacity;
+        };
+        FaceGrid m_grid;
 
-        struct VertexCache
+        // The edges of each face in eight lanes, computed as two packets of four
+        // for the distances to all of them at once. The last edge is repeated to
+        // fill the lanes.
+        static const int FACE_EDGE_LANES = 8;
+        struct alignas(16) FaceEdges
         {
-            Vert *m_v[MAX_VERTICES];
+            float x[FACE_EDGE_LANES];
+            float y[FACE_EDGE_LANES];
+            float dx[FACE_EDGE_LANES];
+            float dy[FACE_EDGE_LANES];
+            float invLength2[FACE_EDGE_LANES];
         };
-        VertexCache m_vertCache;
+        FaceEdges *m_faceEdges;
+        size_t m_faceEdgeCapacity;
+
+        // Face-to-face visibility as a bit matrix, row by row, where the row of a
+        // face holds the faces up to it.
+        uint32_t *m_visibility;
+        size_t m_visibilityCapacity; // In words
+        index_t m_visibilityFaces;
+        VisibilityUpdate *m_visibilityUpdate;
+        bool m_visibilityPending;
+
+        index_t m_componentCount;
+        index_t *m_componentStack; // Faces left to visit while finding the components
+        size_t m_componentStackCapacity;
 
         float m_halfW;
         float m_halfH;
+        float m_agentRadius;
+
+        int m_tilesX;
+        int m_tilesY;
+        Tile *m_tiles;
+
+        // The faces or vertices left by the tiles that outgrew their ranges, in
+        // order and joined, for the rebuilt tiles to reuse.
+        struct FreeRange
+        {
+            index_t first;
+            index_t count;
+        };
+        std::vector<FreeRange> m_freeFaces;
+        std::vector<FreeRange> m_freeVertices;
+
+        static void AddFreeRange(std::vector<FreeRange> &ranges, index_t first, index_t count);
+        static index_t TakeFreeRange(std::vector<FreeRange> &ranges, index_t count);
+
+        // Per-thread staging for building tiles.
+        TileStaging **m_staging;
+        size_t m_stagingCount;
+        NavMesh *m_stagingOwner;
+
+        uint32_t m_revision;
+        BuildStats m_stats;
     };
 
 } // sneaky
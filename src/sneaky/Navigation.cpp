@@ -4,25 +4,121 @@
 
 #include "rob/memory/LinearAllocator.h"
 #include "rob/renderer/Renderer.h"
+#include "rob/time/MicroTicker.h"
 #include "rob/Assert.h"
 #include "rob/Log.h"
+#include "rob/String.h"
 
 namespace sneaky
 {
 
+    NavPathBuffers::NavPathBuffers()
+        : m_alloc(nullptr)
+    { }
+
+    void NavPathBuffers::SetAllocator(rob::LinearAllocator &alloc)
+    { m_alloc = &alloc; }
+
+    size_t NavPathBuffers::GetSizeClass(size_t size)
+    {
+        size_t sizeClass = 0;
+        for (size_t s = MIN_BUFFER_SIZE; s < size; s *= 2)
+            sizeClass++;
+        ROB_ASSERT(sizeClass < SIZE_CLASSES);
+        return sizeClass;
+    }
+
+    void *NavPathBuffers::Obtain(size_t minSize, size_t *size)
+    {
+        const size_t sizeClass = GetSizeClass(minSize);
+        const size_t bufferSize = MIN_BUFFER_SIZE << sizeClass;
+
+        void *buffer = m_free[sizeClass].Obtain();
+        if (!buffer)
+        {
+            // Small buffers are allocated a few at a time. Free buffers hold the
+            // free list link, so they are aligned for a pointer.
+            const size_t chunkSize = rob::Max(bufferSize, size_t(2048));
+            const size_t bufferAlign = rob::Max(alignof(vec2f), alignof(void*));
+            void *chunk = m_alloc->Allocate(chunkSize, bufferAlign);
+            ROB_ASSERT(chunk != nullptr);
+            m_free[sizeClass].AddElements(chunk, chunkSize, bufferSize, bufferAlign);
+            buffer = m_free[sizeClass].Obtain();
+        }
+
+        *size = bufferSize;
+        return buffer;
+    }
+
+    void NavPathBuffers::Return(void *buffer, size_t size)
+    { m_free[GetSizeClass(size)].Return(buffer); }
+
+
+
     NavPath::NavPath()
-        : m_len(0)
+        : m_buffers(nullptr)
+        , m_len(0)
+        , m_capacity(0)
+        , m_path(nullptr)
+        , m_corridorLen(0)
+        , m_corridorCapacity(0)
+        , m_corridor(nullptr)
+        , m_revision(0)
     { }
 
+    NavPath::~NavPath()
+    {
+        if (m_path)
+            m_buffers->Return(m_path, m_capacity * sizeof(vec2f));
+        if (m_corridor)
+            m_buffers->Return(m_corridor, m_corridorCapacity * sizeof(index_t));
+    }
+
+    void NavPath::Reserve(size_t len)
+    {
+        if (len <= m_capacity)
+            return;
+
+        size_t size;
+        vec2f *path = static_cast<vec2f*>(m_buffers->Obtain(len * sizeof(vec2f), &size));
+        for (size_t i = 0; i < m_len; i++)
+            path[i] = m_path[i];
+
+        if (m_path)
+            m_buffers->Return(m_path, m_capacity * sizeof(vec2f));
+        m_path = path;
+        m_capacity = size / sizeof(vec2f);
+    }
+
+    void NavPath::SetCorridor(const index_t *faces, size_t count, uint32_t revision)
+    {
+        if (count > m_corridorCapacity)
+        {
+            if (m_corridor)
+                m_buffers->Return(m_corridor, m_corridorCapacity * sizeof(index_t));
+            size_t size;
+            m_corridor = static_cast<index_t*>(m_buffers->Obtain(count * sizeof(index_t), &size));
+            m_corridorCapacity = size / sizeof(index_t);
+        }
+
+        for (size_t i = 0; i < count; i++)
+            m_corridor[i] = faces[i];
+        m_corridorLen = count;
+        m_revision = revision;
+    }
+
     void NavPath::Clear()
-    { m_len = 0; }
+    {
+        m_len = 0;
+        m_corridorLen = 0;
+    }
 
     void NavPath::AppendVertex(float x, float y)
     { AppendVertex(vec2f(x, y)); }
 
     void NavPath::AppendVertex(const vec2f &v)
     {
-        ROB_ASSERT(m_len < MAX_PATH_LEN);
+        Reserve(m_len + 1);
         m_path[m_len++] = v;
     }
 
@@ -34,8 +130,8 @@ namespace sneaky
 
     void NavPath::InsertVertex(size_t index, float x, float y)
     {
-        ROB_ASSERT(m_len < MAX_PATH_LEN);
         ROB_ASSERT(index < m_len);
+        Reserve(m_len + 1);
         for (size_t i = m_len; i > index; i--)
             m_path[i] = m_path[i - 1];
         m_path[index] = vec2f(x, y);
@@ -51,10 +147,7 @@ namespace sneaky
         }
         else
         {
-            if (index <= m_len && m_len < MAX_PATH_LEN)
-                InsertVertex(index, v.x, v.y);
-            else
-                return false;
+            InsertVertex(index, v.x, v.y);
         }
         return true;
     }
@@ -79,26 +172,224 @@ namespace sneaky
 
 
 
+    NavAgent::NavAgent()
+        : m_face(NavMesh::InvalidIndex)
+        , m_pos(0.0f, 0.0f)
+        , m_revision(0)
+    { }
+
+    void NavAgent::Update(const NavMesh &mesh, const vec2f &pos)
+    {
+        if (m_revision != mesh.GetRevision())
+            m_face = NavMesh::InvalidIndex;
+
+        m_pos = pos;
+        m_face = mesh.GetClampedFaceIndex(m_face, &m_pos);
+        m_revision = mesh.GetRevision();
+    }
+
+    void NavAgent::Reset()
+    { m_face = NavMesh::InvalidIndex; }
+
+
+
     Navigation::Navigation()
-        : m_world(nullptr)
+        : m_alloc(nullptr)
+        , m_jobs(nullptr)
+        , m_world(nullptr)
         , m_mesh()
-    { }
+        , m_hierarchy()
+        , m_hierarchical(true)
+        , m_contexts(nullptr)
+        , m_contextCount(0)
+        , m_sliceContexts(nullptr)
+        , m_sliceCount(0)
+        , m_nodeCapacity(0)
+        , m_batchRequests(nullptr)
+        , m_batchResults()
+        , m_asyncOrderCount(0)
+        , m_asyncNext(0)
+        , m_asyncSequence(0)
+        , m_asyncFrame(0)
+        , m_searchTimeLeft(0)
+        , m_asyncRunning(false)
+        , m_asyncCounter()
+        , m_flowUse(0)
+    {
+        for (size_t i = 0; i < MAX_ASYNC_QUERIES; i++)
+        {
+            AsyncQuery &query = m_async[i];
+            query.startFace = NavMesh::InvalidIndex;
+            query.path = nullptr;
+            query.generation = 0;
+            query.state = AsyncState::Free;
+            query.cancelled = false;
+            query.started = false;
+            query.finished = false;
+            query.found = false;
+        }
+
+        m_ticker.Init();
+        ResetQueryStats();
+
+        for (size_t i = 0; i < FLOW_FIELD_COUNT; i++)
+        {
+            FlowField &field = m_flowFields[i];
+            field.goalFace = NavMesh::InvalidIndex;
+            field.revision = 0;
+            field.lastUse = 0;
+            field.dist = nullptr;
+            field.next = nullptr;
+        }
+    }
 
     Navigation::~Navigation()
-    { }
+    {
+        WaitQueries();
+        for (size_t i = 0; i < m_contextCount; i++)
+            m_alloc->del_object(m_contexts[i]);
+    }
 
-    bool Navigation::CreateNavMesh(rob::LinearAllocator &alloc, const b2World *world, const float worldHalfW, const float worldHalfH, const float agentRadius)
+    bool Navigation::CreateNavMesh(rob::LinearAllocator &alloc, rob::JobSystem &jobs, const b2World *world, const float worldHalfW, const float worldHalfH, const float agentRadius, const uint32_t seed,
+                                   const bool bake, NavMesh::Obstacles *obstacles)
     {
+        m_alloc = &alloc;
+        m_jobs = &jobs;
         m_world = world;
         m_mesh.Allocate(alloc);
-        m_mesh.Create(world, worldHalfW, worldHalfH, agentRadius);
-        m_nodes = alloc.AllocateArray<Node>(m_mesh.GetFaceCount());
-        m_np.SetMemory(alloc.AllocateArray<NavPath>(16), rob::GetArraySize<NavPath>(16));
-        return false;
+
+        char filename[64];
+        rob::StringPrintF(filename, "navmesh_%u_%u.nav", seed, uint32_t(agentRadius * 100.0f + 0.5f));
+
+        const bool baked = bake && m_mesh.Load(filename, seed, agentRadius);
+        if (!baked)
+        {
+            m_mesh.Create(world, worldHalfW, worldHalfH, agentRadius, jobs, obstacles);
+            if (bake) m_mesh.Save(filename, seed, agentRadius);
+        }
+
+        // The asynchronous queries are searched by one job per worker, and each
+        // job keeps its unfinished search in its own context between the frames.
+        m_sliceCount = (jobs.GetWorkerCount() > 0) ? jobs.GetWorkerCount() : 1;
+        m_contextCount = jobs.GetThreadCount() + m_sliceCount;
+        m_contexts = alloc.AllocateArray<QueryContext*>(m_contextCount);
+        for (size_t i = 0; i < m_contextCount; i++)
+        {
+            QueryContext *ctx = alloc.new_object<QueryContext>();
+            ctx->nodes = nullptr;
+            ctx->query = 0;
+            ctx->points = nullptr;
+            ctx->pointCount = 0;
+            ctx->phase = SearchPhase::Done;
+            ctx->active = NO_QUERY;
+            ctx->sliceTime = 0;
+            m_contexts[i] = ctx;
+        }
+        m_sliceContexts = m_contexts + jobs.GetThreadCount();
+
+        m_hierarchy.SetAllocator(alloc);
+        BuildHierarchy();
+        ReserveQueries();
+        m_pathBuffers.SetAllocator(alloc);
+        m_np.SetMemory(alloc.AllocateArray<NavPath>(MAX_NAV_PATHS), rob::GetArraySize<NavPath>(MAX_NAV_PATHS));
+
+#if defined(ROB_DEBUG)
+        // The packed edges used for clamping must agree with the scalar closest points.
+        ROB_ASSERT(m_mesh.TestClosestPoints(seed, 10000) == 0);
+#endif
+        return baked;
+    }
+
+    void Navigation::RebuildNavMesh(const vec2f &minP, const vec2f &maxP, NavMesh::Obstacles *obstacles)
+    {
+        WaitQueries();
+
+        const size_t tiles = m_mesh.RebuildTiles(m_world, minP, maxP, *m_jobs, obstacles);
+        const NavMesh::BuildStats &stats = m_mesh.GetBuildStats();
+        rob::log::Info("NavMesh: Rebuilt ", tiles, " tiles in ", stats.totalTime, " us, faces: ", m_mesh.GetFaceCount());
+
+        BuildHierarchy();
+        ReserveQueries();
+    }
+
+    void Navigation::UpdateVisibility(rob::Time_t budget)
+    {
+        if (!m_mesh.IsVisibilityPending())
+            return;
+
+        if (m_mesh.UpdateVisibility(m_world, *m_jobs, budget))
+        {
+            const NavMesh::BuildStats &stats = m_mesh.GetBuildStats();
+            rob::log::Info("NavMesh: Updated the visibility of ", stats.visibilityFaces, " faces in ", stats.visibilityTime,
+                           " us, visible pairs: ", stats.visiblePairs);
+        }
+    }
+
+    void Navigation::BuildHierarchy()
+    {
+        m_hierarchy.Build(m_mesh);
+        rob::log::Info("NavHierarchy: Built in ", m_hierarchy.GetBuildTime(), " us, clusters: ", m_hierarchy.GetClusterCount(),
+                       ", nodes: ", m_hierarchy.GetNodeCount(), ", edges: ", m_hierarchy.GetEdgeCount());
+    }
+
+    void Navigation::ReserveQueries()
+    {
+        for (size_t i = 0; i < m_contextCount; i++)
+        {
+            QueryContext &ctx = *m_contexts[i];
+            ctx.path.len = 0;
+            ctx.pointCount = 0;
+            ctx.phase = SearchPhase::Done;
+            m_hierarchy.ReserveQuery(ctx.hierarchy);
+        }
+
+        // Queued queries locate their start again on the new faces, and the
+        // searches paused on the old faces start over.
+        for (size_t i = 0; i < MAX_ASYNC_QUERIES; i++)
+            m_async[i].startFace = NavMesh::InvalidIndex;
+        for (size_t i = 0; i < m_sliceCount; i++)
+        {
+            QueryContext &ctx = *m_sliceContexts[i];
+            if (ctx.active != NO_QUERY)
+                m_async[ctx.active].started = false;
+            ctx.active = NO_QUERY;
+        }
+
+        const size_t faceCount = m_mesh.GetFaceCount();
+        if (faceCount <= m_nodeCapacity)
+            return;
+
+        // Node storage grows with the mesh a chunk at a time.
+        const size_t capacity = (faceCount + NODE_CHUNK - 1) & ~(NODE_CHUNK - 1);
+        for (size_t i = 0; i < m_contextCount; i++)
+        {
+            QueryContext &ctx = *m_contexts[i];
+            ctx.nodes = m_alloc->AllocateArray<Node>(capacity);
+            for (size_t n = 0; n < capacity; n++)
+                ctx.nodes[n].query = 0;
+            ctx.query = 0;
+            ctx.path.path = m_alloc->AllocateArray<index_t>(capacity);
+            ctx.open.Allocate(*m_alloc, capacity);
+            // The straight path has the start, the end, and at most one vertex per portal.
+            ctx.points = m_alloc->AllocateArray<vec2f>(capacity + 2);
+        }
+        m_nodeCapacity = capacity;
+
+        for (size_t i = 0; i < FLOW_FIELD_COUNT; i++)
+        {
+            FlowField &field = m_flowFields[i];
+            field.goalFace = NavMesh::InvalidIndex;
+            field.dist = m_alloc->AllocateArray<float>(capacity);
+            field.next = m_alloc->AllocateArray<index_t>(capacity);
+        }
     }
 
     NavPath *Navigation::ObtainNavPath()
-    { return m_np.Obtain(); }
+    {
+        NavPath *path = m_np.Obtain();
+        path->m_buffers = &m_pathBuffers;
+        return path;
+    }
 
     void Navigation::ReturnNavPath(NavPath *path)
     { m_np.Return(path); }
@@ -117,126 +408,220 @@ namespace sneaky
 
     vec2f Navigation::CalculateNodePos(index_t face, int edge, const vec2f &prevPos) const
     {
-        static const int nextV[] = { 1, 2, 0 };
         const NavMesh::Face &f = m_mesh.GetFace(face);
         const NavMesh::Vert &vert0 = m_mesh.GetVertex(f.vertices[edge]);
-        const NavMesh::Vert &vert1 = m_mesh.GetVertex(f.vertices[nextV[edge]]);
+        const NavMesh::Vert &vert1 = m_mesh.GetVertex(f.vertices[(edge + 1) % f.vertexCount]);
         return ClosestPointOnEdge(vec2f(vert0.x, vert0.y), vec2f(vert1.x, vert1.y), prevPos);
     }
 
-    bool Navigation::FindNodePath(const vec2f &start, const vec2f &end, index_t startFace, index_t endFace)
+    Navigation::Node &Navigation::VisitNode(QueryContext &ctx, index_t face)
     {
-//        rob::log::Info("Nav: Start node: ", startFace, ", end node: ", endFace, ", faces:", m_mesh.GetFaceCount());
+        Node &node = ctx.nodes[face];
+        if (node.query != ctx.query)
+        {
+            node.dist = 1e6f;
+            node.prev = NavMesh::InvalidIndex;
+            node.query = ctx.query;
+            node.closed = false;
+        }
+        return node;
+    }
 
-        m_path.len = 0;
-        if (startFace == endFace) return true;
+    void Navigation::BeginNodePath(QueryContext &ctx, bool inCorridor) const
+    {
+//        rob::log::Info("Nav: Start node: ", ctx.startFace, ", end node: ", ctx.endFace, ", faces:", m_mesh.GetFaceCount());
 
-        const float inf = 1e6f;
-        const int nodeCount = m_mesh.GetFaceCount();
+        ctx.phase = inCorridor ? SearchPhase::Corridor : SearchPhase::Flat;
+        ctx.path.len = 0;
+
+        // Nodes are reset lazily, when they are first visited by the current query.
+        ctx.query++;
+        ctx.open.Clear();
+
+        Node &endNode = VisitNode(ctx, ctx.endFace);
+        endNode.pos = ctx.end;
+
+        Node &startNode = VisitNode(ctx, ctx.startFace);
+        startNode.dist = 0.0f;
+        startNode.pos = ctx.start;
+
+        ctx.bestFace = ctx.startFace;
+        ctx.bestHeuristicCost = rob::Distance2(ctx.start, ctx.end);
+        ctx.found = (ctx.startFace == ctx.endFace);
+        if (!ctx.found)
+            ctx.open.Push(ctx.startFace, rob::Distance(ctx.start, ctx.end));
+    }
+
+    // Returns true when the search has ended.
+    bool Navigation::StepNodePath(QueryContext &ctx, size_t iterations) const
+    {
+        const bool inCorridor = (ctx.phase == SearchPhase::Corridor);
+        const vec2f &end = ctx.end;
+
+        for (size_t n = 0; n < iterations && !ctx.open.IsEmpty(); n++)
+        {
+            const index_t u = ctx.open.Pop();
+            if (u == ctx.endFace)
+            {
+                ctx.found = true;
+                ctx.open.Clear();
+                break;
+            }
+
+            Node &nodeU = ctx.nodes[u];
+            nodeU.closed = true;
+
+            const NavMesh::Face &face = m_mesh.GetFace(u);
+            for (int i = 0; i < int(face.vertexCount); i++)
+            {
+                const index_t v = face.neighbours[i];
+                if (v == NavMesh::InvalidIndex)
+                    continue;
+                if (inCorridor && !m_hierarchy.IsInCorridor(ctx.hierarchy, v))
+                    continue;
+
+                const bool discovered = (ctx.nodes[v].query == ctx.query);
+                Node &nodeV = VisitNode(ctx, v);
+                if (nodeV.closed) // TODO: This is bad if the navmesh is not a grid (maybe)
+                    continue;
 
-        int n = nodeCount;
+                if (!discovered)
+                {
+                    nodeV.pos = m_mesh.GetEdgeCenter(u, i);
+//                    nodeV.pos = CalculateNodePos(u, i, nodeU.pos);
+                }
+
+                const float alt = nodeU.dist + rob::Distance(nodeU.pos, nodeV.pos);
+                if (alt < nodeV.dist)
+                {
+                    const bool open = (nodeV.dist < 1e6f);
+                    nodeV.dist = alt;
+                    nodeV.prev = u;
+
+                    // Straight line distance to the end is never greater than the
+                    // remaining path cost, so the heuristic is admissible.
+                    const float total = alt + rob::Distance(nodeV.pos, end);
+                    if (open)
+                        ctx.open.DecreaseKey(v, total);
+                    else
+                        ctx.open.Push(v, total);
+                }
 
-        for (int i = 0; i < nodeCount; i++)
+                const float heuristic = rob::Distance2(m_mesh.GetFaceCenter(m_mesh.GetFace(v)), end);
+                if (heuristic < ctx.bestHeuristicCost)
+                {
+                    ctx.bestHeuristicCost = heuristic;
+                    ctx.bestFace = v;
+                }
+            }
+        }
+        return ctx.open.IsEmpty();
+    }
+
+    // The search before the open heap, picking the next face by scanning every
+    // face. Kept only for the benchmark to compare with.
+    void Navigation::ScanNodePath(QueryContext &ctx) const
+    {
+        const float inf = 1e6f;
+        const size_t nodeCount = m_mesh.GetFaceCount();
+
+        ctx.query++;
+        for (size_t i = 0; i < nodeCount; i++)
         {
-            m_nodes[i].dist = inf;
-            m_nodes[i].prev = NavMesh::InvalidIndex;
-            m_nodes[i].pos.x = 0.0f;
-            m_nodes[i].pos.y = 0.0f;
-            m_nodes[i].posCalculated = false;
-            m_nodes[i].closed = false;
+            ctx.nodes[i].dist = inf;
+            ctx.nodes[i].prev = NavMesh::InvalidIndex;
+            ctx.nodes[i].pos = vec2f::Zero;
+            ctx.nodes[i].query = ctx.query;
+            ctx.nodes[i].closed = false;
         }
 
-        m_nodes[startFace].dist = 0.0f;
-        m_nodes[startFace].pos = start;
-        m_nodes[startFace].posCalculated = true;
-        m_nodes[endFace].pos = end;
-        m_nodes[endFace].posCalculated = true;
+        ctx.nodes[ctx.startFace].dist = 0.0f;
+        ctx.nodes[ctx.startFace].pos = ctx.start;
+        ctx.nodes[ctx.endFace].pos = ctx.end;
 
-        index_t bestFace = startFace;
-        float bestHeuristicCost = rob::Distance2(start, end);
-        bool found = true;
+        ctx.bestFace = ctx.startFace;
+        ctx.bestHeuristicCost = rob::Distance2(ctx.start, ctx.end);
+        ctx.found = (ctx.startFace == ctx.endFace);
+        if (ctx.found) return;
 
-        while (n > 0)
+        for (;;)
         {
             index_t u = NavMesh::InvalidIndex;
             float d = inf;
-            for (int i = 0; i < nodeCount; i++)
+            for (size_t i = 0; i < nodeCount; i++)
             {
-                if (m_nodes[i].closed) continue;
-                if (m_nodes[i].dist < d)
+                if (ctx.nodes[i].closed) continue;
+                if (ctx.nodes[i].dist < d)
                 {
-                    u = i;
-                    d = m_nodes[i].dist;
+                    u = index_t(i);
+                    d = ctx.nodes[i].dist;
                 }
             }
 
-            if(u == endFace) break;
-            if(u == NavMesh::InvalidIndex)
+            if (u == ctx.endFace)
             {
-                found = false; // Did not find full path.
-                endFace = bestFace;
-                break;
+                ctx.found = true;
+                return;
             }
+            if (u == NavMesh::InvalidIndex)
+                return;
 
-            m_nodes[u].closed = true;
-            n--;
+            ctx.nodes[u].closed = true;
 
-            for (int i = 0; i < 3; i++)
+            const NavMesh::Face &face = m_mesh.GetFace(u);
+            for (int i = 0; i < int(face.vertexCount); i++)
             {
-                index_t v = m_mesh.GetFace(u).neighbours[i];
-                if (v == NavMesh::InvalidIndex)
-                    continue;
-                if (m_nodes[v].closed) // TODO: This is bad if the navmesh is not a grid (maybe)
+                const index_t v = face.neighbours[i];
+                if (v == NavMesh::InvalidIndex || ctx.nodes[v].closed)
                     continue;
 
-                if (!m_nodes[v].posCalculated)
-                {
-                    m_nodes[v].pos = m_mesh.GetEdgeCenter(u, i);
-//                    m_nodes[v].pos = CalculateNodePos(u, i, m_nodes[u].pos);
-                    m_nodes[v].posCalculated = true;
-                }
-
-//                const float alt = d + m_mesh.GetDist(u, v);
-//                const float alt = d + m_mesh.GetDist(u, v, i);
-                const float alt = d + rob::Distance(m_nodes[u].pos, m_nodes[v].pos);
-                const float heuristic = rob::Distance2(m_mesh.GetFaceCenter(m_mesh.GetFace(v)), end);
+                Node &nodeV = ctx.nodes[v];
+                if (nodeV.dist == inf && v != ctx.endFace)
+                    nodeV.pos = m_mesh.GetEdgeCenter(u, i);
 
-                if (alt < m_nodes[v].dist)
+                const float alt = d + rob::Distance(ctx.nodes[u].pos, nodeV.pos);
+                if (alt < nodeV.dist)
                 {
-                    m_nodes[v].dist = alt;
-                    m_nodes[v].prev = u;
+                    nodeV.dist = alt;
+                    nodeV.prev = u;
                 }
-                if (heuristic < bestHeuristicCost)
+
+                const float heuristic = rob::Distance2(m_mesh.GetFaceCenter(m_mesh.GetFace(v)), ctx.end);
+                if (heuristic < ctx.bestHeuristicCost)
                 {
-                    bestHeuristicCost = heuristic;
-                    bestFace = v;
+                    ctx.bestHeuristicCost = heuristic;
+                    ctx.bestFace = v;
                 }
             }
         }
+    }
+
+    void Navigation::EndNodePath(QueryContext &ctx) const
+    {
+        ctx.path.len = 0;
+        if (ctx.startFace == ctx.endFace) return;
+
+        // Did not find full path.
+        const index_t endFace = ctx.found ? ctx.endFace : ctx.bestFace;
 
         index_t v = endFace;
-        m_path.len++;
-        while (m_nodes[v].prev != NavMesh::InvalidIndex)
+        ctx.path.len++;
+        while (ctx.nodes[v].prev != NavMesh::InvalidIndex)
         {
-            v = m_nodes[v].prev;
-            m_path.len++;
+            v = ctx.nodes[v].prev;
+            ctx.path.len++;
         }
 
-        if (m_path.len > MAX_PATH_LEN)
-            return false;
-
         index_t u = endFace;
-        for (int i = m_path.len - 1; i >= 0; i--)
+        for (int i = ctx.path.len - 1; i >= 0; i--)
         {
-            m_path.path[i] = u;
-            u = m_nodes[u].prev;
+            ctx.path.path[i] = u;
+            u = ctx.nodes[u].prev;
         }
 
-//        rob::log::Info("Path length: ", m_nodes[endFace].dist);
-
-//        rob::log::Info("Nav: Nodes in node path: ", m_path.len);
+//        rob::log::Info("Path length: ", ctx.nodes[endFace].dist);
 
-        return found;
+//        rob::log::Info("Nav: Nodes in node path: ", ctx.path.len);
     }
 
     struct PathRayCast : public b2RayCastCallback
@@ -280,11 +665,11 @@ namespace sneaky
         return offt.Length2();
     }
 
-    void Navigation::FindStraightPath(const vec2f &start, const vec2f &end, NavPath *path, bool fullPath)
+    void Navigation::FindStraightPath(QueryContext &ctx, const vec2f &start, const vec2f &end) const
     {
-        path->Clear();
-        path->AppendVertex(start.x, start.y);
-        if (m_path.len > 1)
+        ctx.pointCount = 0;
+        ctx.points[ctx.pointCount++] = start;
+        if (ctx.path.len > 1)
         {
             vec2f apex, portalLeft, portalRight;
             apex = portalLeft = portalRight = start;
@@ -292,12 +677,12 @@ namespace sneaky
             int leftInd = 0;
             int rightInd = 0;
 
-            for (size_t i = 0; i < m_path.len; i++)
+            for (size_t i = 0; i < ctx.path.len; i++)
             {
                 vec2f left, right;
-                if (i + 1 < m_path.len)
+                if (i + 1 < ctx.path.len)
                 {
-                    m_mesh.GetPortalPoints(m_path.path[i], m_path.path[i + 1], left, right);
+                    m_mesh.GetPortalPoints(ctx.path.path[i], ctx.path.path[i + 1], left, right);
 
                     if (i == 0 && DistanceFromEdge2(apex, left, right) < 0.001f * 0.001f)
                         continue;
@@ -320,7 +705,8 @@ namespace sneaky
                         apex = portalLeft;
                         apexInd = leftInd;
 
-                        path->AppendVertex(apex);
+                        ROB_ASSERT(ctx.pointCount + 1 < m_nodeCapacity + 2);
+                        ctx.points[ctx.pointCount++] = apex;
 
                         portalLeft = portalRight = apex;
                         leftInd = rightInd = apexInd;
@@ -343,7 +729,8 @@ namespace sneaky
                         apex = portalRight;
                         apexInd = rightInd;
 
-                        path->AppendVertex(apex);
+                        ROB_ASSERT(ctx.pointCount + 1 < m_nodeCapacity + 2);
+                        ctx.points[ctx.pointCount++] = apex;
 
                         portalLeft = portalRight = apex;
                         leftInd = rightInd = apexInd;
@@ -354,25 +741,934 @@ namespace sneaky
                 }
             }
         }
-        path->AppendVertex(end.x, end.y);
+        ctx.points[ctx.pointCount++] = end;
     }
 
-    bool Navigation::Navigate(const vec2f &start, const vec2f &end, NavPath *path)
+    void Navigation::CopyPath(const vec2f *points, size_t count, NavPath *path)
+    {
+        path->Clear();
+        for (size_t i = 0; i < count; i++)
+            path->AppendVertex(points[i]);
+    }
+
+    // The node path is empty, when the start and the end are on the same face.
+    const index_t *Navigation::GetCorridor(const QueryContext &ctx, size_t *count)
+    {
+        if (ctx.path.len == 0)
+        {
+            *count = 1;
+            return &ctx.startFace;
+        }
+        *count = ctx.path.len;
+        return ctx.path.path;
+    }
+
+    index_t Navigation::GetAgentFace(const NavAgent &agent) const
+    { return (agent.m_revision == m_mesh.GetRevision()) ? agent.m_face : NavMesh::InvalidIndex; }
+
+    // The start face is given for the queries from an agent, otherwise it is
+    // located with the end.
+    void Navigation::LocateEnds(vec2f *points, index_t *faces) const
     {
-        vec2f s = start, e = end;
-        const index_t startFace = m_mesh.GetClampedFaceIndex(&s);
-        const index_t endFace = m_mesh.GetClampedFaceIndex(&e);
+        if (faces[0] != NavMesh::InvalidIndex)
+            faces[1] = m_mesh.GetClampedFaceIndex(&points[1]);
+        else
+            m_mesh.GetClampedFaceIndices(points, faces, 2);
+    }
+
+    void Navigation::BeginPath(QueryContext &ctx, const vec2f &start, index_t startFace, const vec2f &end) const
+    {
+        vec2f points[2] = { start, end };
+        index_t faces[2] = { startFace, NavMesh::InvalidIndex };
+        LocateEnds(points, faces);
+
+        // The search would visit every face it can reach before giving up on a
+        // goal in another component. The goal is moved to the closest point of
+        // the component of the start instead.
+        ctx.reachable = true;
+        if (faces[0] != NavMesh::InvalidIndex && faces[1] != NavMesh::InvalidIndex)
+        {
+            const index_t component = m_mesh.GetFaceComponent(faces[0]);
+            if (m_mesh.GetFaceComponent(faces[1]) != component)
+            {
+                faces[1] = m_mesh.GetClampedComponentFaceIndex(component, &points[1]);
+                ctx.reachable = false;
+            }
+        }
+
+        ctx.start = points[0];
+        ctx.end = points[1];
+        ctx.startFace = faces[0];
+        ctx.endFace = faces[1];
+
+        // The face search is limited to the corridor of clusters planned on the
+        // abstract graph, and searches the whole mesh only if that fails.
+        const bool inCorridor = m_hierarchical && m_hierarchy.FindCorridor(m_mesh, ctx.hierarchy, ctx.start, ctx.end, ctx.startFace, ctx.endFace);
+        BeginNodePath(ctx, inCorridor);
+    }
+
+    // Searches at most the given number of faces. Returns true, when the straight
+    // path has been found.
+    bool Navigation::StepPath(QueryContext &ctx, size_t iterations) const
+    {
+        ROB_ASSERT(ctx.phase != SearchPhase::Done);
+        if (!StepNodePath(ctx, iterations))
+            return false;
 
-        const bool found = FindNodePath(s, e, startFace, endFace);
-        if (!found) // If no full path was found, fix the end point
+        if (!ctx.found && ctx.phase == SearchPhase::Corridor)
         {
-            const NavMesh::Face &lastFace = m_mesh.GetFace(m_path.path[m_path.len - 1]);
+            BeginNodePath(ctx, false);
+            return false;
+        }
+
+        EndNodePath(ctx);
+        vec2f e = ctx.end;
+        if (!ctx.found) // If no full path was found, fix the end point
+        {
+            const NavMesh::Face &lastFace = m_mesh.GetFace(ctx.path.path[ctx.path.len - 1]);
             e = m_mesh.GetClosestPointOnFace(lastFace, e);
         }
-        FindStraightPath(s, e, path, found);
+        FindStraightPath(ctx, ctx.start, e);
+        ctx.found = ctx.found && ctx.reachable;
+        ctx.phase = SearchPhase::Done;
+        return true;
+    }
+
+    bool Navigation::FindPath(QueryContext &ctx, const vec2f &start, index_t startFace, const vec2f &end) const
+    {
+        BeginPath(ctx, start, startFace, end);
+        while (!StepPath(ctx, ~size_t(0))) { }
+        return ctx.found;
+    }
+
+    bool Navigation::Navigate(const vec2f &start, const vec2f &end, NavPath *path)
+    { return NavigateFrom(start, NavMesh::InvalidIndex, end, path); }
+
+    bool Navigation::Navigate(const NavAgent &agent, const vec2f &end, NavPath *path)
+    { return NavigateFrom(agent.GetPosition(), GetAgentFace(agent), end, path); }
+
+    bool Navigation::NavigateFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path)
+    {
+        QueryContext &ctx = *m_contexts[0];
+        const bool found = FindPath(ctx, start, startFace, end);
+        CopyPath(ctx.points, ctx.pointCount, path);
+
+        size_t corridorLen;
+        const index_t *corridor = GetCorridor(ctx, &corridorLen);
+        path->SetCorridor(corridor, corridorLen, m_mesh.GetRevision());
         return found;
     }
 
+    // Searches the faces around the face for the closest one in the corridor. The
+    // faces from the joining face back to the face are linked by the nodes.
+    bool Navigation::FindJoin(QueryContext &ctx, index_t face, const vec2f &pos, const index_t *corridor, size_t count, size_t *join) const
+    {
+        ctx.query++;
+        ctx.open.Clear();
+
+        Node &startNode = VisitNode(ctx, face);
+        startNode.dist = 0.0f;
+        startNode.pos = pos;
+        ctx.open.Push(face, 0.0f);
+
+        for (size_t visits = 0; visits < MAX_REPAIR_VISITS && !ctx.open.IsEmpty(); visits++)
+        {
+            const index_t u = ctx.open.Pop();
+            for (size_t i = 0; i < count; i++)
+            {
+                if (corridor[i] == u)
+                {
+                    *join = i;
+                    return true;
+                }
+            }
+
+            Node &nodeU = ctx.nodes[u];
+            nodeU.closed = true;
+
+            const NavMesh::Face &f = m_mesh.GetFace(u);
+            for (int i = 0; i < int(f.vertexCount); i++)
+            {
+                const index_t v = f.neighbours[i];
+                if (v == NavMesh::InvalidIndex)
+                    continue;
+
+                const bool discovered = (ctx.nodes[v].query == ctx.query);
+                Node &nodeV = VisitNode(ctx, v);
+                if (nodeV.closed)
+                    continue;
+                if (!discovered)
+                    nodeV.pos = m_mesh.GetEdgeCenter(u, i);
+
+                const float alt = nodeU.dist + rob::Distance(nodeU.pos, nodeV.pos);
+                if (alt < nodeV.dist)
+                {
+                    const bool open = (nodeV.dist < 1e6f);
+                    nodeV.dist = alt;
+                    nodeV.prev = u;
+                    if (open)
+                        ctx.open.DecreaseKey(v, alt);
+                    else
+                        ctx.open.Push(v, alt);
+                }
+            }
+        }
+        return false;
+    }
+
+    bool Navigation::RepairPath(const vec2f &start, const vec2f &end, NavPath *path)
+    { return RepairPathFrom(start, NavMesh::InvalidIndex, end, path); }
+
+    bool Navigation::RepairPath(const NavAgent &agent, const vec2f &end, NavPath *path)
+    { return RepairPathFrom(agent.GetPosition(), GetAgentFace(agent), end, path); }
+
+    bool Navigation::RepairPathFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path)
+    {
+        if (path->m_corridorLen == 0 || path->m_revision != m_mesh.GetRevision())
+            return false;
+
+        vec2f points[2] = { start, end };
+        index_t faces[2] = { startFace, NavMesh::InvalidIndex };
+        LocateEnds(points, faces);
+
+        QueryContext &ctx = *m_contexts[0];
+        const index_t *corridor = path->m_corridor;
+        const size_t corridorLen = path->m_corridorLen;
+
+        // The joins would search in vain for a corridor in another component.
+        const index_t component = m_mesh.GetFaceComponent(corridor[0]);
+        if (m_mesh.GetFaceComponent(faces[0]) != component || m_mesh.GetFaceComponent(faces[1]) != component)
+            return false;
+
+        // The start is joined to the corridor, and the faces before the joining
+        // face are replaced by the faces found from the start.
+        size_t join;
+        if (!FindJoin(ctx, faces[0], points[0], corridor, corridorLen, &join))
+            return false;
+
+        size_t len = 0;
+        for (index_t f = corridor[join]; f != NavMesh::InvalidIndex; f = ctx.nodes[f].prev)
+            len++;
+        index_t f = corridor[join];
+        for (size_t i = len; i > 0; i--)
+        {
+            ctx.path.path[i - 1] = f;
+            f = ctx.nodes[f].prev;
+        }
+        ctx.path.len = len;
+        for (size_t i = join + 1; i < corridorLen; i++)
+            ctx.path.path[ctx.path.len++] = corridor[i];
+
+        // The end is joined to the new corridor, and the faces after the joining
+        // face are replaced by the faces found back to the end.
+        if (!FindJoin(ctx, faces[1], points[1], ctx.path.path, ctx.path.len, &join))
+            return false;
+
+        ctx.path.len = join;
+        for (f = ctx.path.path[join]; f != NavMesh::InvalidIndex; f = ctx.nodes[f].prev)
+            ctx.path.path[ctx.path.len++] = f;
+
+        FindStraightPath(ctx, points[0], points[1]);
+        CopyPath(ctx.points, ctx.pointCount, path);
+        path->SetCorridor(ctx.path.path, ctx.path.len, m_mesh.GetRevision());
+        return true;
+    }
+
+    void Navigation::BatchJob(void *data, size_t index, size_t thread)
+    {
+        Navigation *nav = static_cast<Navigation*>(data);
+        QueryContext &ctx = *nav->m_contexts[thread];
+        const NavRequest &request = nav->m_batchRequests[index];
+
+        // The paths are staged per thread, and copied to the requests after the
+        // batch, because the path buffers are not shared between the threads.
+        BatchResult &result = nav->m_batchResults[index];
+        result.found = nav->FindPath(ctx, request.start, NavMesh::InvalidIndex, request.end);
+        result.thread = thread;
+        result.offset = ctx.staging.size();
+        result.count = ctx.pointCount;
+        ctx.staging.insert(ctx.staging.end(), ctx.points, ctx.points + ctx.pointCount);
+    }
+
+    void Navigation::NavigateBatch(const NavRequest *requests, bool *results, size_t count)
+    {
+        m_batchRequests = requests;
+        m_batchResults.resize(count);
+        m_jobs->ParallelFor(&Navigation::BatchJob, this, count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const BatchResult &result = m_batchResults[i];
+            const QueryContext &ctx = *m_contexts[result.thread];
+            CopyPath(ctx.staging.data() + result.offset, result.count, requests[i].path);
+            results[i] = result.found;
+        }
+        for (size_t i = 0; i < m_contextCount; i++)
+            m_contexts[i]->staging.clear();
+        m_batchRequests = nullptr;
+    }
+
+    // A query job resumes the search of its context, and then takes the next
+    // queued queries until the time budget shared by the jobs has been used.
+    void Navigation::AsyncJob(void *data, size_t index, size_t thread)
+    {
+        Navigation *nav = static_cast<Navigation*>(data);
+        QueryContext &ctx = *nav->m_sliceContexts[index];
+
+        rob::MicroTicker ticker;
+        ticker.Init();
+        const rob::Time_t sliceStart = ticker.GetTicks();
+        rob::Time_t stepStart = sliceStart;
+
+        while (nav->m_searchTimeLeft.load(std::memory_order_relaxed) > 0)
+        {
+            if (ctx.active == NO_QUERY)
+            {
+                const size_t next = nav->m_asyncNext.fetch_add(1, std::memory_order_relaxed);
+                if (next >= nav->m_asyncOrderCount)
+                    break;
+
+                ctx.active = nav->m_asyncOrder[next];
+                AsyncQuery &query = nav->m_async[ctx.active];
+                query.started = true;
+                nav->BeginPath(ctx, query.start, query.startFace, query.end);
+            }
+
+            if (nav->StepPath(ctx, SLICE_ITERATIONS))
+            {
+                AsyncQuery &query = nav->m_async[ctx.active];
+                query.found = ctx.found;
+                query.points.assign(ctx.points, ctx.points + ctx.pointCount);
+
+                size_t corridorLen;
+                const index_t *corridor = GetCorridor(ctx, &corridorLen);
+                query.corridor.assign(corridor, corridor + corridorLen);
+                query.revision = nav->m_mesh.GetRevision();
+                query.finished = true;
+                ctx.active = NO_QUERY;
+            }
+
+            const rob::Time_t now = ticker.GetTicks();
+            nav->m_searchTimeLeft.fetch_sub(int64_t(now - stepStart), std::memory_order_relaxed);
+            stepStart = now;
+        }
+        ctx.sliceTime = stepStart - sliceStart;
+    }
+
+    // The ticket is the generation of the query slot and the slot index.
+    NavTicket Navigation::SubmitNavigate(const vec2f &start, const vec2f &end, NavPath *path, NavPriority priority)
+    { return SubmitNavigateFrom(start, NavMesh::InvalidIndex, end, path, priority); }
+
+    NavTicket Navigation::SubmitNavigate(const NavAgent &agent, const vec2f &end, NavPath *path, NavPriority priority)
+    { return SubmitNavigateFrom(agent.GetPosition(), GetAgentFace(agent), end, path, priority); }
+
+    NavTicket Navigation::SubmitNavigateFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path, NavPriority priority)
+    {
+        for (size_t i = 0; i < MAX_ASYNC_QUERIES; i++)
+        {
+            AsyncQuery &query = m_async[i];
+            if (query.state != AsyncState::Free)
+                continue;
+
+            query.start = start;
+            query.end = end;
+            query.startFace = startFace;
+            query.path = path;
+            query.generation++;
+            query.sequence = m_asyncSequence++;
+            query.submitFrame = m_asyncFrame;
+            query.submitTime = m_ticker.GetTicks();
+            query.priority = priority;
+            query.state = AsyncState::Queued;
+            query.cancelled = false;
+            query.started = false;
+            query.finished = false;
+            query.found = false;
+            return ((query.generation & 0xffffff) << 8) | NavTicket(i + 1);
+        }
+
+        // All the slots are taken, the query is run right away.
+        NavigateFrom(start, startFace, end, path);
+        return InvalidNavTicket;
+    }
+
+    bool Navigation::PollNavigate(NavTicket ticket, bool *found)
+    {
+        if (found) *found = false;
+
+        const size_t index = (ticket & 0xff);
+        if (index == 0 || index > MAX_ASYNC_QUERIES)
+            return true;
+
+        AsyncQuery &query = m_async[index - 1];
+        if ((query.generation & 0xffffff) != (ticket >> 8) || query.state == AsyncState::Free || query.cancelled)
+            return true;
+
+        if (query.state != AsyncState::Done)
+            return false;
+
+        if (found) *found = query.found;
+        query.state = AsyncState::Free;
+        return true;
+    }
+
+    void Navigation::CancelNavigate(NavTicket ticket)
+    {
+        const size_t index = (ticket & 0xff);
+        if (index == 0 || index > MAX_ASYNC_QUERIES)
+            return;
+
+        AsyncQuery &query = m_async[index - 1];
+        if ((query.generation & 0xffffff) != (ticket >> 8))
+            return;
+
+        // A running query is freed when it has been collected.
+        if (query.state == AsyncState::Running)
+            query.cancelled = true;
+        else
+            query.state = AsyncState::Free;
+    }
+
+    void Navigation::CollectQueries()
+    {
+        for (size_t i = 0; i < m_sliceCount; i++)
+        {
+            QueryContext &ctx = *m_sliceContexts[i];
+            if (ctx.active != NO_QUERY && m_async[ctx.active].cancelled)
+            {
+                m_async[ctx.active].started = false;
+                ctx.active = NO_QUERY;
+            }
+        }
+
+        const rob::Time_t now = m_ticker.GetTicks();
+        for (size_t i = 0; i < MAX_ASYNC_QUERIES; i++)
+        {
+            AsyncQuery &query = m_async[i];
+            if (query.state != AsyncState::Running)
+                continue;
+
+            if (query.cancelled)
+            {
+                query.state = AsyncState::Free;
+            }
+            else if (query.finished)
+            {
+                CopyPath(query.points.data(), query.points.size(), query.path);
+                query.path->SetCorridor(query.corridor.data(), query.corridor.size(), query.revision);
+                query.state = AsyncState::Done;
+
+                const rob::Time_t latency = now - query.submitTime;
+                const uint32_t frames = m_asyncFrame - query.submitFrame;
+                m_queryStats.completed++;
+                m_queryStats.totalLatency += latency;
+                if (latency > m_queryStats.maxLatency)
+                    m_queryStats.maxLatency = latency;
+                if (frames > m_queryStats.maxLatencyFrames)
+                    m_queryStats.maxLatencyFrames = frames;
+            }
+            else if (!query.started)
+            {
+                // Not reached by the jobs before the budget ran out.
+                query.state = AsyncState::Queued;
+            }
+        }
+
+        m_queryStats.sliceTime = 0;
+        for (size_t i = 0; i < m_sliceCount; i++)
+        {
+            m_queryStats.sliceTime += m_sliceContexts[i]->sliceTime;
+            m_sliceContexts[i]->sliceTime = 0;
+        }
+    }
+
+    void Navigation::UpdateQueries(rob::Time_t budget)
+    {
+        if (!m_asyncCounter.IsDone())
+            return;
+
+        m_asyncFrame++;
+        CollectQueries();
+
+        // The queued queries are ordered by priority and then by submit order.
+        m_asyncOrderCount = 0;
+        size_t depth = 0;
+        for (size_t i = 0; i < MAX_ASYNC_QUERIES; i++)
+        {
+            AsyncQuery &query = m_async[i];
+            if (query.state == AsyncState::Running)
+            {
+                depth++;
+            }
+            else if (query.state == AsyncState::Queued)
+            {
+                size_t n = m_asyncOrderCount++;
+                for (; n > 0; n--)
+                {
+                    const AsyncQuery &prev = m_async[m_asyncOrder[n - 1]];
+                    if (prev.priority > query.priority || (prev.priority == query.priority && int32_t(query.sequence - prev.sequence) > 0))
+                        break;
+                    m_asyncOrder[n] = m_asyncOrder[n - 1];
+                }
+                m_asyncOrder[n] = i;
+                query.state = AsyncState::Running;
+                depth++;
+            }
+        }
+
+        m_queryStats.queueDepth = depth;
+        if (depth > m_queryStats.maxQueueDepth)
+            m_queryStats.maxQueueDepth = depth;
+        if (depth == 0)
+            return;
+
+        m_asyncNext.store(0, std::memory_order_relaxed);
+        m_searchTimeLeft.store(int64_t(budget), std::memory_order_relaxed);
+        m_asyncRunning = true;
+        m_jobs->Submit(&Navigation::AsyncJob, this, m_sliceCount, m_asyncCounter);
+        // Without workers the jobs only run when waited for.
+        if (m_jobs->GetWorkerCount() == 0)
+            m_jobs->Wait(m_asyncCounter);
+    }
+
+    void Navigation::WaitQueries()
+    {
+        if (m_asyncRunning)
+            m_jobs->Wait(m_asyncCounter);
+        m_asyncRunning = false;
+    }
+
+    void Navigation::ResetQueryStats()
+    {
+        m_queryStats.queueDepth = 0;
+        m_queryStats.maxQueueDepth = 0;
+        m_queryStats.completed = 0;
+        m_queryStats.sliceTime = 0;
+        m_queryStats.totalLatency = 0;
+        m_queryStats.maxLatency = 0;
+        m_queryStats.maxLatencyFrames = 0;
+    }
+
+    const Navigation::FlowField &Navigation::ObtainFlowField(index_t goalFace, const vec2f &goal)
+    {
+        const uint32_t revision = m_mesh.GetRevision();
+        FlowField *oldest = &m_flowFields[0];
+        for (size_t i = 0; i < FLOW_FIELD_COUNT; i++)
+        {
+            FlowField &field = m_flowFields[i];
+            if (field.goalFace == goalFace && field.revision == revision)
+            {
+                field.lastUse = ++m_flowUse;
+                return field;
+            }
+            if (field.lastUse < oldest->lastUse)
+                oldest = &field;
+        }
+
+        BuildFlowField(*oldest, goalFace, goal);
+        oldest->lastUse = ++m_flowUse;
+        return *oldest;
+    }
+
+    // Dijkstra from the goal face over the whole mesh. The next face of a face
+    // is the one it was reached from.
+    void Navigation::BuildFlowField(FlowField &field, index_t goalFace, const vec2f &goal)
+    {
+        QueryContext &ctx = *m_contexts[0];
+        ctx.query++;
+        ctx.open.Clear();
+
+        Node &goalNode = VisitNode(ctx, goalFace);
+        goalNode.dist = 0.0f;
+        goalNode.pos = goal;
+        ctx.open.Push(goalFace, 0.0f);
+
+        while (!ctx.open.IsEmpty())
+        {
+            const index_t u = ctx.open.Pop();
+            Node &nodeU = ctx.nodes[u];
+            nodeU.closed = true;
+
+            const NavMesh::Face &face = m_mesh.GetFace(u);
+            for (int i = 0; i < int(face.vertexCount); i++)
+            {
+                const index_t v = face.neighbours[i];
+                if (v == NavMesh::InvalidIndex)
+                    continue;
+
+                const bool discovered = (ctx.nodes[v].query == ctx.query);
+                Node &nodeV = VisitNode(ctx, v);
+                if (nodeV.closed)
+                    continue;
+
+                if (!discovered)
+                    nodeV.pos = m_mesh.GetEdgeCenter(u, i);
+
+                const float alt = nodeU.dist + rob::Distance(nodeU.pos, nodeV.pos);
+                if (alt < nodeV.dist)
+                {
+                    const bool open = (nodeV.dist < 1e6f);
+                    nodeV.dist = alt;
+                    nodeV.prev = u;
+                    if (open)
+                        ctx.open.DecreaseKey(v, alt);
+                    else
+                        ctx.open.Push(v, alt);
+                }
+            }
+        }
+
+        const size_t faceCount = m_mesh.GetFaceCount();
+        for (size_t f = 0; f < faceCount; f++)
+        {
+            const Node &node = ctx.nodes[f];
+            const bool reached = (node.query == ctx.query);
+            field.dist[f] = reached ? node.dist : 1e6f;
+            field.next[f] = reached ? node.prev : NavMesh::InvalidIndex;
+        }
+        field.goalFace = goalFace;
+        field.revision = m_mesh.GetRevision();
+    }
+
+    bool Navigation::NavigateFlow(const vec2f &start, const vec2f &goal, NavPath *path)
+    { return NavigateFlowFrom(start, NavMesh::InvalidIndex, goal, path); }
+
+    bool Navigation::NavigateFlow(const NavAgent &agent, const vec2f &goal, NavPath *path)
+    { return NavigateFlowFrom(agent.GetPosition(), GetAgentFace(agent), goal, path); }
+
+    bool Navigation::NavigateFlowFrom(const vec2f &start, index_t startFace, const vec2f &goal, NavPath *path)
+    {
+        vec2f points[2] = { start, goal };
+        index_t faces[2] = { startFace, NavMesh::InvalidIndex };
+        LocateEnds(points, faces);
+
+        // A field to a goal in another component would never lead to the start.
+        if (m_mesh.GetFaceComponent(faces[0]) != m_mesh.GetFaceComponent(faces[1]))
+            return NavigateFrom(points[0], faces[0], goal, path);
+
+        const FlowField &field = ObtainFlowField(faces[1], points[1]);
+        if (field.dist[faces[0]] >= 1e6f) // The goal cannot be reached, search for the closest point
+            return NavigateFrom(points[0], faces[0], goal, path);
+
+        QueryContext &ctx = *m_contexts[0];
+        ctx.path.len = 0;
+        for (index_t f = faces[0]; f != NavMesh::InvalidIndex; f = field.next[f])
+            ctx.path.path[ctx.path.len++] = f;
+
+        FindStraightPath(ctx, points[0], points[1]);
+        CopyPath(ctx.points, ctx.pointCount, path);
+        path->SetCorridor(ctx.path.path, ctx.path.len, m_mesh.GetRevision());
+        return true;
+    }
+
+    vec2f Navigation::GetFlowDirection(const vec2f &pos, const vec2f &goal)
+    {
+        vec2f p = pos;
+        const index_t face = m_mesh.GetClampedFaceIndex(&p);
+        vec2f g = goal;
+        const index_t goalFace = m_mesh.GetClampedFaceIndex(&g);
+        if (m_mesh.GetFaceComponent(face) != m_mesh.GetFaceComponent(goalFace))
+            return vec2f(0.0f, 0.0f);
+
+        const FlowField &field = ObtainFlowField(goalFace, g);
+        if (face == goalFace)
+            return (g - pos).SafeNormalized();
+
+        const index_t next = field.next[face];
+        if (next == NavMesh::InvalidIndex)
+            return vec2f(0.0f, 0.0f);
+
+        vec2f left, right;
+        m_mesh.GetPortalPoints(face, next, left, right);
+        return (ClosestPointOnEdge(left, right, pos) - pos).SafeNormalized();
+    }
+
+    static vec2f WalkPath(const NavPath *path, float dist)
+    {
+        vec2f pos = path->GetVertex(0);
+        for (size_t i = 1; i < path->GetLength(); i++)
+        {
+            const vec2f &next = path->GetVertex(i);
+            const float len = rob::Distance(pos, next);
+            if (len > dist)
+                return pos + (next - pos) * (dist / len);
+            dist -= len;
+            pos = next;
+        }
+        return pos;
+    }
+
+    void Navigation::RunBenchmark(uint32_t seed, size_t queryCount)
+    {
+        WaitQueries();
+
+        rob::MicroTicker ticker;
+        ticker.Init();
+
+        // The closest points on the packed edges are checked before the queries
+        // that clamp to them are timed.
+        const size_t pointCount = queryCount * 100;
+        const size_t closestFailed = m_mesh.TestClosestPoints(seed, pointCount);
+        rob::log::Info("Nav test (closest points): ", pointCount, " points, ", closestFailed, " failed");
+
+        // Runs the same face searches by scanning every face for the next one, and
+        // by popping it from the open heap.
+        QueryContext &ctx = *m_contexts[0];
+        for (int mode = 0; mode < 2; mode++)
+        {
+            rob::Random rand;
+            rand.Seed(seed);
+
+            size_t found = 0;
+            rob::Time_t totalTime = 0;
+            rob::Time_t maxTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                vec2f points[2] = { GetRandomNavigableWorldPoint(rand), GetRandomNavigableWorldPoint(rand) };
+                index_t faces[2] = { NavMesh::InvalidIndex, NavMesh::InvalidIndex };
+                LocateEnds(points, faces);
+                if (faces[0] == NavMesh::InvalidIndex || faces[1] == NavMesh::InvalidIndex)
+                    continue;
+
+                ctx.start = points[0];
+                ctx.end = points[1];
+                ctx.startFace = faces[0];
+                ctx.endFace = faces[1];
+
+                const rob::Time_t queryStart = ticker.GetTicks();
+                if (mode == 0)
+                {
+                    ScanNodePath(ctx);
+                }
+                else
+                {
+                    BeginNodePath(ctx, false);
+                    while (!StepNodePath(ctx, ~size_t(0))) { }
+                }
+                EndNodePath(ctx);
+                const rob::Time_t queryTime = ticker.GetTicks() - queryStart;
+                if (queryTime > maxTime) maxTime = queryTime;
+                totalTime += queryTime;
+                if (ctx.found) found++;
+            }
+
+            const char * const modeName = (mode == 0) ? "face scan" : "open heap";
+            rob::log::Info("Nav benchmark (", modeName, "): seed ", seed, ", faces ", m_mesh.GetFaceCount(), ", ", queryCount, " queries, ", found, " found");
+            rob::log::Info("Nav benchmark (", modeName, "): total ", totalTime, " us, avg ", float(totalTime) / queryCount, " us, max ", maxTime, " us");
+        }
+
+        // Runs the same queries with the flat and the hierarchical search.
+        const bool hierarchical = m_hierarchical;
+        NavPath *path = ObtainNavPath();
+        for (int mode = 0; mode < 2; mode++)
+        {
+            m_hierarchical = (mode == 1);
+
+            rob::Random rand;
+            rand.Seed(seed);
+
+            size_t found = 0;
+            float pathLength = 0.0f;
+            rob::Time_t totalTime = 0;
+            rob::Time_t maxTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                const vec2f start = GetRandomNavigableWorldPoint(rand);
+                const vec2f end = GetRandomNavigableWorldPoint(rand);
+
+                const rob::Time_t queryStart = ticker.GetTicks();
+                if (Navigate(start, end, path)) found++;
+                const rob::Time_t queryTime = ticker.GetTicks() - queryStart;
+                if (queryTime > maxTime) maxTime = queryTime;
+                totalTime += queryTime;
+
+                for (size_t v = 1; v < path->GetLength(); v++)
+                    pathLength += rob::Distance(path->GetVertex(v - 1), path->GetVertex(v));
+            }
+
+            const char * const modeName = m_hierarchical ? "hierarchical" : "flat";
+            rob::log::Info("Nav benchmark (", modeName, "): seed ", seed, ", faces ", m_mesh.GetFaceCount(), ", ", queryCount, " queries, ", found, " found");
+            rob::log::Info("Nav benchmark (", modeName, "): total ", totalTime, " us, avg ", float(totalTime) / queryCount, " us, max ", maxTime, " us, path length ", pathLength);
+        }
+        m_hierarchical = hierarchical;
+
+        // Groups of agents heading to the same goal, like the guards chasing the player.
+        const size_t groupSize = 16;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            rob::Random rand;
+            rand.Seed(seed);
+
+            vec2f goal(0.0f, 0.0f);
+            rob::Time_t totalTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                if (i % groupSize == 0)
+                    goal = GetRandomNavigableWorldPoint(rand);
+                const vec2f start = GetRandomNavigableWorldPoint(rand);
+
+                const rob::Time_t queryStart = ticker.GetTicks();
+                if (mode == 0) Navigate(start, goal, path);
+                else NavigateFlow(start, goal, path);
+                totalTime += ticker.GetTicks() - queryStart;
+            }
+
+            const char * const modeName = (mode == 0) ? "search" : "flow field";
+            rob::log::Info("Nav benchmark (shared goal, ", modeName, "): ", groupSize, " agents per goal, total ", totalTime, " us, avg ", float(totalTime) / queryCount, " us");
+        }
+
+        // An agent chasing a wandering target, with the path searched again or
+        // repaired on every step.
+        const size_t chaseSteps = 16;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            rob::Random rand;
+            rand.Seed(seed);
+
+            vec2f agent(0.0f, 0.0f), target(0.0f, 0.0f);
+            size_t repaired = 0;
+            float pathLength = 0.0f;
+            rob::Time_t totalTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                if (i % chaseSteps == 0)
+                {
+                    agent = GetRandomNavigableWorldPoint(rand);
+                    target = GetRandomNavigableWorldPoint(rand);
+                    Navigate(agent, target, path);
+                }
+                else
+                {
+                    agent = WalkPath(path, 1.5f);
+                    target += rand.GetDirection() * 1.5f;
+                    m_mesh.GetClampedFaceIndex(&target);
+                }
+
+                const rob::Time_t queryStart = ticker.GetTicks();
+                if (mode == 1 && RepairPath(agent, target, path)) repaired++;
+                else Navigate(agent, target, path);
+                totalTime += ticker.GetTicks() - queryStart;
+
+                for (size_t v = 1; v < path->GetLength(); v++)
+                    pathLength += rob::Distance(path->GetVertex(v - 1), path->GetVertex(v));
+            }
+
+            const char * const modeName = (mode == 0) ? "search" : "repair";
+            rob::log::Info("Nav benchmark (chase, ", modeName, "): ", repaired, " repaired, total ", totalTime, " us, avg ", float(totalTime) / queryCount, " us, path length ", pathLength);
+        }
+
+        // Agents walking along their paths a step of an update at a time, with the
+        // face located on the grid or tracked by walking the neighbours.
+        const size_t walkSteps = 64;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            rob::Random rand;
+            rand.Seed(seed);
+
+            NavAgent agent;
+            size_t located = 0;
+            rob::Time_t totalTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                const vec2f start = GetRandomNavigableWorldPoint(rand);
+                Navigate(start, GetRandomNavigableWorldPoint(rand), path);
+
+                for (size_t step = 0; step < walkSteps; step++)
+                {
+                    vec2f pos = WalkPath(path, step * 0.15f);
+                    const rob::Time_t queryStart = ticker.GetTicks();
+                    if (mode == 0)
+                    {
+                        if (m_mesh.GetClampedFaceIndex(&pos) != NavMesh::InvalidIndex) located++;
+                    }
+                    else
+                    {
+                        agent.Update(m_mesh, pos);
+                        if (agent.GetFace() != NavMesh::InvalidIndex) located++;
+                    }
+                    totalTime += ticker.GetTicks() - queryStart;
+                }
+            }
+
+            const char * const modeName = (mode == 0) ? "grid" : "walk";
+            rob::log::Info("Nav benchmark (agent faces, ", modeName, "): ", located, " located, total ", totalTime, " us, avg ", float(totalTime) / (queryCount * walkSteps), " us");
+        }
+
+        // Lines of sight from an agent to a few targets, cast against the physics,
+        // walked on the mesh in a batch, or rejected by the potentially visible
+        // set before the physics. The mesh is shrunk by the agent radius and finds
+        // fewer of the lines clear. The rejected lines are cast afterwards, to
+        // count the clear ones the sampled set missed.
+        const size_t sightCount = 8;
+        for (int mode = 0; mode < 3; mode++)
+        {
+            rob::Random rand;
+            rand.Seed(seed);
+
+            NavMesh::Segment segments[sightCount];
+            bool clear[sightCount];
+            size_t clearCount = 0;
+            size_t rejectCount = 0;
+            size_t missCount = 0;
+            rob::Time_t totalTime = 0;
+            for (size_t i = 0; i < queryCount; i++)
+            {
+                const vec2f start = GetRandomNavigableWorldPoint(rand);
+                for (size_t s = 0; s < sightCount; s++)
+                {
+                    segments[s].start = start;
+                    segments[s].end = GetRandomNavigableWorldPoint(rand);
+                    segments[s].startFace = NavMesh::InvalidIndex;
+                }
+
+                const rob::Time_t queryStart = ticker.GetTicks();
+                if (mode == 0)
+                {
+                    for (size_t s = 0; s < sightCount; s++)
+                        clear[s] = (RayCast(start, segments[s].end, 0xffff, GuardBit|PlayerBit|CakeBit) == nullptr);
+                }
+                else if (mode == 1)
+                {
+                    m_mesh.RayCast(segments, clear, sightCount);
+                }
+                else
+                {
+                    const index_t startFace = m_mesh.GetFaceIndex(start);
+                    for (size_t s = 0; s < sightCount; s++)
+                    {
+                        clear[s] = false;
+                        if (!m_mesh.IsPotentiallyVisible(startFace, m_mesh.GetFaceIndex(segments[s].end)))
+                        {
+                            rejectCount++;
+                            continue;
+                        }
+                        clear[s] = (RayCast(start, segments[s].end, 0xffff, GuardBit|PlayerBit|CakeBit) == nullptr);
+                    }
+                }
+                totalTime += ticker.GetTicks() - queryStart;
+
+                for (size_t s = 0; s < sightCount; s++)
+                    if (clear[s]) clearCount++;
+
+                if (mode == 2)
+                {
+                    const index_t startFace = m_mesh.GetFaceIndex(start);
+                    for (size_t s = 0; s < sightCount; s++)
+                    {
+                        if (m_mesh.IsPotentiallyVisible(startFace, m_mesh.GetFaceIndex(segments[s].end)))
+                            continue;
+                        if (RayCast(start, segments[s].end, 0xffff, GuardBit|PlayerBit|CakeBit) == nullptr)
+                            missCount++;
+                    }
+                }
+            }
+
+            const char * const modeNames[] = { "physics", "mesh", "pvs" };
+            rob::log::Info("Nav benchmark (line of sight, ", modeNames[mode], "): ", clearCount, " clear, ", rejectCount, " rejected, ", missCount, " missed, total ", totalTime, " us, avg ", float(totalTime) / (queryCount * sightCount), " us");
+        }
+        ReturnNavPath(path);
+    }
+
     struct RayCastCb : public b2RayCastCallback
     {
         b2Body *body;
@@ -432,6 +1728,17 @@ namespace sneaky
         renderer->DrawLine(v0.x, v0.y, v1.x, v1.y);
     }
 
+    static void RenderFace(rob::Renderer *renderer, const NavMesh &mesh, const NavMesh::Face &face)
+    {
+        const NavMesh::Vert *prev = &mesh.GetVertex(face.vertices[face.vertexCount - 1]);
+        for (size_t i = 0; i < face.vertexCount; i++)
+        {
+            const NavMesh::Vert *vert = &mesh.GetVertex(face.vertices[i]);
+            renderer->DrawLine(prev->x, prev->y, vert->x, vert->y);
+            prev = vert;
+        }
+    }
+
     void Navigation::RenderMesh(rob::Renderer *renderer) const
     {
         renderer->SetModel(mat4f::Identity);
@@ -453,9 +1760,7 @@ namespace sneaky
         for (size_t i = 0; i < faceCount; i++)
         {
             const NavMesh::Face &f = m_mesh.GetFace(i);
-            const NavMesh::Vert &v0 = m_mesh.GetVertex(f.vertices[0]);
-            const NavMesh::Vert &v1 = m_mesh.GetVertex(f.vertices[1]);
-            const NavMesh::Vert &v2 = m_mesh.GetVertex(f.vertices[2]);
+            if (f.vertexCount == 0) continue; // Unused face of a rebuilt tile
 
 //        if (f.flags == 0)
 //            renderer->SetColor(rob::Color::LightGreen);
@@ -464,46 +1769,31 @@ namespace sneaky
 //        else
 //            renderer->SetColor(rob::Color::DarkGreen);
 
-            renderer->SetColor(colors[f.flags & 0x7]);
-
-            renderer->DrawLine(v0.x, v0.y, v1.x, v1.y);
-            renderer->DrawLine(v1.x, v1.y, v2.x, v2.y);
-            renderer->DrawLine(v2.x, v2.y, v0.x, v0.y);
+            renderer->SetColor(colors[f.component & 0x7]);
+            RenderFace(renderer, m_mesh, f);
         }
 
+        // The faces of the last query run on the main thread.
+        const QueryContext &ctx = *m_contexts[0];
         renderer->SetColor(rob::Color::Magenta);
-        const size_t pathLen = m_path.len;
+        const size_t pathLen = ctx.path.len;
         for (size_t i = 0; i < pathLen; i++)
         {
-            const NavMesh::Face &f = m_mesh.GetFace(m_path.path[i]);
-            const NavMesh::Vert &v0 = m_mesh.GetVertex(f.vertices[0]);
-            const NavMesh::Vert &v1 = m_mesh.GetVertex(f.vertices[1]);
-            const NavMesh::Vert &v2 = m_mesh.GetVertex(f.vertices[2]);
+            const NavMesh::Face &f = m_mesh.GetFace(ctx.path.path[i]);
 
-            const vec2f &np = m_nodes[m_path.path[i]].pos;
+            const vec2f &np = ctx.nodes[ctx.path.path[i]].pos;
             renderer->DrawCircle(np.x, np.y, 0.2f);
-
-            renderer->DrawLine(v0.x, v0.y, v1.x, v1.y);
-            renderer->DrawLine(v1.x, v1.y, v2.x, v2.y);
-            renderer->DrawLine(v2.x, v2.y, v0.x, v0.y);
+            RenderFace(renderer, m_mesh, f);
         }
 
-        if (m_path.len > 0)
+        if (ctx.path.len > 0)
         {
             renderer->SetColor(rob::Color::Blue);
-            const NavMesh::Face &f = m_mesh.GetFace(m_path.path[0]);
-            for (int n = 0; n < 3; n++)
+            const NavMesh::Face &f = m_mesh.GetFace(ctx.path.path[0]);
+            for (int n = 0; n < int(f.vertexCount); n++)
             {
                 if (f.neighbours[n] == NavMesh::InvalidIndex) continue;
-
-                const NavMesh::Face &nf = m_mesh.GetFace(f.neighbours[n]);
-                const NavMesh::Vert &v0 = m_mesh.GetVertex(nf.vertices[0]);
-                const NavMesh::Vert &v1 = m_mesh.GetVertex(nf.vertices[1]);
-                const NavMesh::Vert &v2 = m_mesh.GetVertex(nf.vertices[2]);
-
-                renderer->DrawLine(v0.x, v0.y, v1.x, v1.y);
-                renderer->DrawLine(v1.x, v1.y, v2.x, v2.y);
-                renderer->DrawLine(v2.x, v2.y, v0.x, v0.y);
+                RenderFace(renderer, m_mesh, m_mesh.GetFace(f.neighbours[n]));
             }
         }
 
@@ -4,9 +4,16 @@
 
 #include "Physics.h"
 #include "NavMesh.h"
+#include "NavHierarchy.h"
+#include "NodeHeap.h"
 
 #include "rob/memory/Pool.h"
+#include "rob/memory/Freelist.h"
 #include "rob/math/Random.h"
+#include "rob/thread/JobSystem.h"
+#include "rob/time/MicroTicker.h"
+
+#include <vector>
 
 namespace rob
 {
@@ -17,12 +24,33 @@ namespace rob
 namespace sneaky
 {
 
-    constexpr size_t MAX_PATH_LEN = 128;
+    // Vertex and face buffers for NavPaths in power of two size classes. Returned
+    // buffers are reused by later paths, and new ones are allocated from the arena.
+    class NavPathBuffers
+    {
+    public:
+        static const size_t MIN_BUFFER_SIZE = 128;
+        static const size_t SIZE_CLASSES = 16;
+
+        NavPathBuffers();
+
+        void SetAllocator(rob::LinearAllocator &alloc);
+
+        void *Obtain(size_t minSize, size_t *size);
+        void Return(void *buffer, size_t size);
+
+    private:
+        static size_t GetSizeClass(size_t size);
+
+        rob::LinearAllocator *m_alloc;
+        rob::Freelist m_free[SIZE_CLASSES];
+    };
 
     class NavPath
     {
     public:
         NavPath();
+        ~NavPath();
 
         void Clear();
 
@@ -41,34 +69,205 @@ namespace sneaky
         bool IsEmpty() const;
 
     private:
+        void Reserve(size_t len);
+        void SetCorridor(const index_t *faces, size_t count, uint32_t revision);
+
+        friend class Navigation;
+        NavPathBuffers *m_buffers;
         size_t m_len;
-        vec2f m_path[MAX_PATH_LEN];
+        size_t m_capacity;
+        vec2f *m_path;
+
+        // The faces the path goes through, for repairing the path later.
+        size_t m_corridorLen;
+        size_t m_corridorCapacity;
+        index_t *m_corridor;
+        uint32_t m_revision; // Of the mesh the corridor is on
+    };
+
+    // Tracks the face an agent is on. The agent moves little between the updates,
+    // so the face is found by walking from the previous one, and the queries from
+    // the agent do not need to locate it on the mesh.
+    class NavAgent
+    {
+    public:
+        NavAgent();
+
+        void Update(const NavMesh &mesh, const vec2f &pos);
+        void Reset();
+
+        index_t GetFace() const
+        { return m_face; }
+        // The position clamped to the mesh.
+        const vec2f &GetPosition() const
+        { return m_pos; }
+
+    private:
+        friend class Navigation;
+        index_t m_face;
+        vec2f m_pos;
+        uint32_t m_revision; // Of the mesh the face is on
+    };
+
+    struct NavRequest
+    {
+        vec2f start;
+        vec2f end;
+        NavPath *path;
+    };
+
+    // Identifies a query submitted to run asynchronously.
+    typedef uint32_t NavTicket;
+    static const NavTicket InvalidNavTicket = 0;
+
+    // Queued queries of higher priority are searched first.
+    enum class NavPriority
+    {
+        Low,
+        Normal,
+        High
+    };
+
+    struct NavQueryStats
+    {
+        size_t queueDepth; // Queries waiting or being searched
+        size_t maxQueueDepth;
+        size_t completed;
+        rob::Time_t sliceTime; // Time searched on the last frame by all the jobs
+        rob::Time_t totalLatency; // From submitting to collecting, in microseconds
+        rob::Time_t maxLatency;
+        uint32_t maxLatencyFrames;
     };
 
     class Navigation
     {
+        // A path visits each face at most once, so the path is sized by the face count.
         struct NodePath
         {
             size_t len;
-            index_t path[MAX_PATH_LEN];
+            index_t *path;
 
-            NodePath() : len(0) { }
+            NodePath() : len(0), path(nullptr) { }
+        };
+
+        static const size_t NODE_CHUNK = 256;
+
+        // Distances to a goal and the next face toward it from every face.
+        struct FlowField
+        {
+            index_t goalFace;
+            uint32_t revision;
+            uint32_t lastUse;
+            float *dist;
+            index_t *next;
         };
 
+        static const size_t FLOW_FIELD_COUNT = 4;
+
         struct Node
         {
             float dist;
             index_t prev;
             vec2f pos;
-            bool posCalculated;
+            uint32_t query;
             bool closed;
         };
 
+        enum class SearchPhase
+        {
+            Corridor,
+            Flat,
+            Done
+        };
+
+        // Scratch of the path queries. Each thread running queries has its own,
+        // so the queries can run in parallel. The search is stepped a slice at a
+        // time, and can be resumed from the context on a later frame.
+        struct QueryContext
+        {
+            NodePath path;
+            Node *nodes;
+            NodeHeap open;
+            uint32_t query;
+            vec2f *points; // The straight path
+            size_t pointCount;
+            NavHierarchy::Query hierarchy;
+            std::vector<vec2f> staging; // Straight paths of a batch
+
+            vec2f start;
+            vec2f end;
+            index_t startFace;
+            index_t endFace;
+            index_t bestFace;
+            float bestHeuristicCost;
+            SearchPhase phase;
+            bool found;
+            bool reachable; // False, if the end was moved into the component of the start
+            size_t active; // The asynchronous query being searched
+            rob::Time_t sliceTime;
+        };
+
+        struct BatchResult
+        {
+            size_t thread;
+            size_t offset;
+            size_t count;
+            bool found;
+        };
+
+        enum class AsyncState
+        {
+            Free,
+            Queued,
+            Running,
+            Done
+        };
+
+        struct AsyncQuery
+        {
+            vec2f start;
+            vec2f end;
+            index_t startFace;
+            NavPath *path;
+            std::vector<vec2f> points;
+            std::vector<index_t> corridor;
+            uint32_t revision;
+            uint32_t generation;
+            uint32_t sequence;
+            uint32_t submitFrame;
+            rob::Time_t submitTime;
+            NavPriority priority;
+            AsyncState state;
+            bool cancelled;
+            bool started;
+            bool finished;
+            bool found;
+        };
+
+        static const size_t MAX_ASYNC_QUERIES = 64;
+        static const size_t NO_QUERY = ~size_t(0);
+        // Nodes searched between the checks of the time budget.
+        static const size_t SLICE_ITERATIONS = 32;
+        // Faces searched at most to join a moved end to the corridor of a path.
+        static const size_t MAX_REPAIR_VISITS = 64;
+        // Enough for a path per guard, and a few more.
+        static const size_t MAX_NAV_PATHS = 272;
+
     public:
         Navigation();
         ~Navigation();
 
-        bool CreateNavMesh(rob::LinearAllocator &alloc, const b2World *world, const float worldHalfW, const float worldHalfH, const float agentRadius);
+        // Loads the nav mesh baked for the world seed if there is one, otherwise builds
+        // it, and bakes it if baking is asked for. Returns true, if the baked nav mesh
+        // was loaded. The obstacles can be shared with the nav meshes of other agent radii.
+        bool CreateNavMesh(rob::LinearAllocator &alloc, rob::JobSystem &jobs, const b2World *world, const float worldHalfW, const float worldHalfH, const float agentRadius, const uint32_t seed,
+                           const bool bake, NavMesh::Obstacles *obstacles = nullptr);
+
+        // Rebuilds the nav mesh tiles around an area after static bodies have changed there.
+        void RebuildNavMesh(const vec2f &minP, const vec2f &maxP, NavMesh::Obstacles *obstacles = nullptr);
+        // Continues computing the visibility of the rebuilt tiles for about the
+        // budget in microseconds.
+        void UpdateVisibility(rob::Time_t budget);
 
         const NavMesh& GetMesh() const { return m_mesh; }
         NavMesh& GetMesh() { return m_mesh; }
@@ -98,21 +297,129 @@ namespace sneaky
 
         bool Navigate(const vec2f &start, const vec2f &end, NavPath *path);
 
+        // Patches a path for the moved start and end. They are joined to the faces
+        // the path goes through with short local searches, and the faces passed
+        // or left behind are dropped. Returns false, if the path has no corridor
+        // on the current mesh or an end is too far from it, when the path must be
+        // searched again. Paths found by NavigateBatch have no corridor.
+        bool RepairPath(const vec2f &start, const vec2f &end, NavPath *path);
+
+        // Queries from an agent start from its tracked face and position.
+        bool Navigate(const NavAgent &agent, const vec2f &end, NavPath *path);
+        bool RepairPath(const NavAgent &agent, const vec2f &end, NavPath *path);
+
+        // Runs the queries in parallel on the job system and waits for them. The
+        // results tell which queries found a full path.
+        void NavigateBatch(const NavRequest *requests, bool *results, size_t count);
+
+        // Queues a query to run on the job system. The path is written on a later
+        // frame, when the query is collected by UpdateQueries, and the ticket is
+        // then reported done by PollNavigate.
+        NavTicket SubmitNavigate(const vec2f &start, const vec2f &end, NavPath *path, NavPriority priority = NavPriority::Normal);
+        NavTicket SubmitNavigate(const NavAgent &agent, const vec2f &end, NavPath *path, NavPriority priority = NavPriority::Normal);
+        // Returns true when the query is done, or the ticket is not valid.
+        bool PollNavigate(NavTicket ticket, bool *found = nullptr);
+        // The path is left untouched by a cancelled query.
+        void CancelNavigate(NavTicket ticket);
+
+        // Collects the finished asynchronous queries and continues searching the
+        // queued ones in priority order. The query jobs search together for about
+        // the budget in microseconds per frame, and unfinished searches are resumed
+        // on the next frame. The budget is the sum of the wall times the jobs spend
+        // searching, so it is spread over the workers running them.
+        void UpdateQueries(rob::Time_t budget);
+        // Waits for the running asynchronous queries. The mesh may not change
+        // while they run.
+        void WaitQueries();
+
+        const NavQueryStats& GetQueryStats() const
+        { return m_queryStats; }
+        void ResetQueryStats();
+
+        // Long paths are planned on the cluster graph first, when hierarchical.
+        void SetHierarchical(bool hierarchical)
+        { m_hierarchical = hierarchical; }
+        bool IsHierarchical() const
+        { return m_hierarchical; }
+        const NavHierarchy& GetHierarchy() const
+        { return m_hierarchy; }
+
+        // Many agents heading to the same goal share a flow field, which is built
+        // once per goal face. The path is then traced along the field without a
+        // search. Flow fields are only used from the main thread.
+        bool NavigateFlow(const vec2f &start, const vec2f &goal, NavPath *path);
+        bool NavigateFlow(const NavAgent &agent, const vec2f &goal, NavPath *path);
+        vec2f GetFlowDirection(const vec2f &pos, const vec2f &goal);
+
+        void RunBenchmark(uint32_t seed, size_t queryCount);
+
         b2Body *RayCast(const vec2f &start, const vec2f &end, uint16_t mask = 0xffff, uint16_t ignore = 0x0);
 
         void RenderMesh(rob::Renderer *renderer) const;
         void RenderPath(rob::Renderer *renderer, const NavPath *path) const;
 
     private:
+        void ReserveQueries();
+        void BuildHierarchy();
         vec2f CalculateNodePos(index_t face, int edge, const vec2f &prevPos) const;
-        bool FindNodePath(const vec2f &start, const vec2f &end, index_t startFace, index_t endFace);
-        void FindStraightPath(const vec2f &start, const vec2f &end, NavPath *path, bool fullPath);
+        static Node &VisitNode(QueryContext &ctx, index_t face);
+        index_t GetAgentFace(const NavAgent &agent) const;
+        void LocateEnds(vec2f *points, index_t *faces) const;
+        bool NavigateFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path);
+        NavTicket SubmitNavigateFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path, NavPriority priority);
+        bool RepairPathFrom(const vec2f &start, index_t startFace, const vec2f &end, NavPath *path);
+        bool NavigateFlowFrom(const vec2f &start, index_t startFace, const vec2f &goal, NavPath *path);
+        bool FindPath(QueryContext &ctx, const vec2f &start, index_t startFace, const vec2f &end) const;
+        void BeginPath(QueryContext &ctx, const vec2f &start, index_t startFace, const vec2f &end) const;
+        bool StepPath(QueryContext &ctx, size_t iterations) const;
+        void BeginNodePath(QueryContext &ctx, bool inCorridor) const;
+        bool StepNodePath(QueryContext &ctx, size_t iterations) const;
+        void ScanNodePath(QueryContext &ctx) const;
+        void EndNodePath(QueryContext &ctx) const;
+        void FindStraightPath(QueryContext &ctx, const vec2f &start, const vec2f &end) const;
+        static void CopyPath(const vec2f *points, size_t count, NavPath *path);
+        static const index_t *GetCorridor(const QueryContext &ctx, size_t *count);
+        bool FindJoin(QueryContext &ctx, index_t face, const vec2f &pos, const index_t *corridor, size_t count, size_t *join) const;
+
+        static void BatchJob(void *data, size_t index, size_t thread);
+        static void AsyncJob(void *data, size_t index, size_t thread);
+        void CollectQueries();
+
+        const FlowField &ObtainFlowField(index_t goalFace, const vec2f &goal);
+        void BuildFlowField(FlowField &field, index_t goalFace, const vec2f &goal);
 
     private:
+        rob::LinearAllocator *m_alloc;
+        rob::JobSystem *m_jobs;
         const b2World *m_world;
         NavMesh m_mesh;
-        NodePath m_path;
-        Node *m_nodes;
+        NavHierarchy m_hierarchy;
+        bool m_hierarchical;
+
+        QueryContext **m_contexts;
+        size_t m_contextCount;
+        QueryContext **m_sliceContexts; // One per query job, after the thread contexts
+        size_t m_sliceCount;
+        size_t m_nodeCapacity;
+
+        const NavRequest *m_batchRequests;
+        std::vector<BatchResult> m_batchResults;
+
+        AsyncQuery m_async[MAX_ASYNC_QUERIES];
+        size_t m_asyncOrder[MAX_ASYNC_QUERIES]; // Queued queries in priority order
+        size_t m_asyncOrderCount;
+        std::atomic<size_t> m_asyncNext;
+        uint32_t m_asyncSequence;
+        uint32_t m_asyncFrame;
+        std::atomic<int64_t> m_searchTimeLeft; // Of the budget of the frame, shared by the query jobs
+        bool m_asyncRunning;
+        rob::JobCounter m_asyncCounter;
+        rob::MicroTicker m_ticker;
+        NavQueryStats m_queryStats;
+
+        FlowField m_flowFields[FLOW_FIELD_COUNT];
+        uint32_t m_flowUse;
+        NavPathBuffers m_pathBuffers;
         rob::Pool<NavPath> m_np;
     };
 
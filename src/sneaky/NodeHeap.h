@@ -0,0 +1,129 @@
+
+#ifndef H_SNEAKY_NODE_HEAP_H
+#define H_SNEAKY_NODE_HEAP_H
+
+#include "NavMesh.h"
+
+#include "rob/memory/LinearAllocator.h"
+#include "rob/Assert.h"
+
+namespace sneaky
+{
+
+    // Indexed binary min-heap of node indices keyed by cost. The position of each
+    // node in the heap is tracked, so that the key of a node can be decreased in place.
+    class NodeHeap
+    {
+        struct Entry
+        {
+            float key;
+            index_t node;
+        };
+
+    public:
+        NodeHeap()
+            : m_entries(nullptr)
+            , m_positions(nullptr)
+            , m_size(0)
+            , m_capacity(0)
+        { }
+
+        void Allocate(rob::LinearAllocator &alloc, size_t capacity)
+        {
+            m_entries = alloc.AllocateArray<Entry>(capacity);
+            m_positions = alloc.AllocateArray<index_t>(capacity);
+            m_capacity = capacity;
+            m_size = 0;
+        }
+
+        void Clear()
+        { m_size = 0; }
+
+        bool IsEmpty() const
+        { return m_size == 0; }
+
+        size_t GetSize() const
+        { return m_size; }
+
+        void Push(index_t node, float key)
+        {
+            ROB_ASSERT(m_size < m_capacity);
+            const size_t pos = m_size++;
+            m_entries[pos].key = key;
+            m_entries[pos].node = node;
+            m_positions[node] = pos;
+            SiftUp(pos);
+        }
+
+        // The node must be in the heap, and the new key must not be greater than the old.
+        void DecreaseKey(index_t node, float key)
+        {
+            const size_t pos = m_positions[node];
+            ROB_ASSERT(pos < m_size && m_entries[pos].node == node);
+            ROB_ASSERT(key <= m_entries[pos].key);
+            m_entries[pos].key = key;
+            SiftUp(pos);
+        }
+
+        index_t Pop()
+        {
+            ROB_ASSERT(m_size > 0);
+            const index_t node = m_entries[0].node;
+            m_size--;
+            if (m_size > 0)
+            {
+                m_entries[0] = m_entries[m_size];
+                m_positions[m_entries[0].node] = 0;
+                SiftDown(0);
+            }
+            return node;
+        }
+
+    private:
+        void SiftUp(size_t pos)
+        {
+            const Entry entry = m_entries[pos];
+            while (pos > 0)
+            {
+                const size_t parent = (pos - 1) / 2;
+                if (m_entries[parent].key <= entry.key)
+                    break;
+                m_entries[pos] = m_entries[parent];
+                m_positions[m_entries[pos].node] = pos;
+                pos = parent;
+            }
+            m_entries[pos] = entry;
+            m_positions[entry.node] = pos;
+        }
+
+        void SiftDown(size_t pos)
+        {
+            const Entry entry = m_entries[pos];
+            for (;;)
+            {
+                size_t child = pos * 2 + 1;
+                if (child >= m_size)
+                    break;
+                if (child + 1 < m_size && m_entries[child + 1].key < m_entries[child].key)
+                    child++;
+                if (entry.key <= m_entries[child].key)
+                    break;
+                m_entries[pos] = m_entries[child];
+                m_positions[m_entries[pos].node] = pos;
+                pos = child;
+            }
+            m_entries[pos] = entry;
+            m_positions[entry.node] = pos;
+        }
+
+    private:
+        Entry *m_entries;
+        index_t *m_positions;
+        size_t m_size;
+        size_t m_capacity;
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_NODE_HEAP_H
+
@@ -27,6 +27,7 @@ namespace sneaky
     static const float PLAY_AREA_TOP    = -PLAY_AREA_BOTTOM;
 
     static const float CHARACTER_SCALE = 1.2f;
+    static const float CHARACTER_RADIUS = 1.0f;
 
     static const size_t MAX_DRAWABLES = 256;
 
@@ -48,6 +49,14 @@ namespace sneaky
 
     static const size_t MAX_OBJECTS = 1000;
 
+    // Time the path query jobs may search together per update, in microseconds.
+    static const rob::Time_t NAV_QUERY_BUDGET = 500;
+    // Time the visibility of rebuilt nav mesh tiles may take per update, in microseconds.
+    static const rob::Time_t NAV_VISIBILITY_BUDGET = 1000;
+
+    static const float SOUND_RANGE = 16.0f;
+    static const float LOUD_SOUND_VOLUME = 32.0f; // As loud as running
+
     SneakyState::SneakyState(GameData &gameData)
         : m_gameData(gameData)
         , m_view()
@@ -61,10 +70,14 @@ namespace sneaky
         , m_objectPool()
         , m_objects(nullptr)
         , m_objectCount(0)
+        , m_player(nullptr)
         , m_drawables(nullptr)
         , m_drawableCount(0)
         , m_input()
-        , m_nav()
+        , m_navLayers()
+        , m_nav(nullptr)
+        , m_vision()
+        , m_guards(this)
         , m_debugAi(false)
         , m_path(nullptr)
         , m_pathStart(0.0f, 0.0f)
@@ -72,10 +85,14 @@ namespace sneaky
         , m_drawNav(false)
         , m_sensorListener()
         , m_fadeEffect(Color(0.04f, 0.01f, 0.01f))
+        , m_soundBus(SOUND_RANGE)
+        , m_seed(gameData.m_worldSeed ? gameData.m_worldSeed : GetTicks())
+        , m_replayedSeed(gameData.m_worldSeed != 0)
         , m_random()
     {
         m_gameData.m_score = 0;
-        m_random.Seed(GetTicks());
+        m_gameData.m_worldSeed = 0;
+        m_random.Seed(m_seed);
         GetWindow().GrabMouse();
     }
 
@@ -88,7 +105,7 @@ namespace sneaky
         GetAudio().Update();
         GetWindow().UnGrabMouse();
 
-        m_nav.ReturnNavPath(m_path);
+        m_nav->ReturnNavPath(m_path);
     }
 
     bool SneakyState::Initialize()
@@ -121,7 +138,7 @@ namespace sneaky
 //        static uint32_t seed = 2013034;
 //        m_random.Seed(seed);
 //        CreateWorld();
-//        if (m_nav.GetMesh().GetFaceCount() < 10)
+//        if (m_nav->GetMesh().GetFaceCount() < 10)
 //        {
 //            rob::log::Info("Seed: ", seed);
 //            return true;
@@ -132,7 +149,7 @@ namespace sneaky
 //        static uint32_t seed = 2013034;
 //        m_random.Seed(seed);
 //        CreateWorld();
-//        if (m_nav.GetMesh().Flood() != m_nav.GetMesh().m_solids.size())
+//        if (m_nav->GetMesh().GetComponentCount() != m_nav->GetMesh().m_solids.size())
 //        {
 //            rob::log::Info("Seed: ", seed);
 //            return true;
@@ -146,7 +163,7 @@ namespace sneaky
     {
         m_pathStart = start;
         m_pathEnd = end;
-        m_nav.Navigate(start, end, m_path);
+        m_nav->Navigate(start, end, m_path);
     }
 
 
@@ -202,25 +219,34 @@ namespace sneaky
         CreateWall(vec2f(PLAY_AREA_LEFT - wallSize3, 0.0f), 0.0f, wallSize2, PLAY_AREA_H / 2.0f); // Left wall
         CreateWall(vec2f(PLAY_AREA_RIGHT + wallSize3, 0.0f), 0.0f, wallSize2, PLAY_AREA_H / 2.0f); // Right wall
 
-        m_nav.CreateNavMesh(GetAllocator(), m_world, PLAY_AREA_W / 2.0f, PLAY_AREA_H / 2.0f, 1.0f);
-        log::Info("NavMesh size: ", m_nav.GetMesh().GetByteSizeUsed(), " / ", m_nav.GetMesh().GetByteSize(), " bytes");
-        log::Info("NavMesh faces: ", m_nav.GetMesh().GetFaceCount(), ", vertices: ", m_nav.GetMesh().GetVertexCount());
-
-//        m_nav.GetMesh().Flood();
-
-        m_path = m_nav.ObtainNavPath();
+        const float agentRadii[] = { CHARACTER_RADIUS };
+        const bool baked = m_navLayers.Create(GetAllocator(), GetJobs(), m_world, PLAY_AREA_W / 2.0f, PLAY_AREA_H / 2.0f,
+                                              agentRadii, sizeof(agentRadii) / sizeof(agentRadii[0]), m_seed, m_replayedSeed);
+        m_nav = &m_navLayers.GetLayer(CHARACTER_RADIUS);
+        m_vision.SetNavigation(m_nav);
+        m_guards.SetNavigation(m_nav);
+        log::Info("World seed: ", m_seed, (baked ? ", baked nav mesh loaded" : ""));
+        log::Info("NavMesh size: ", m_nav->GetMesh().GetByteSizeUsed(), " / ", m_nav->GetMesh().GetByteSize(), " bytes");
+        const NavMesh::BuildStats &navStats = m_nav->GetMesh().GetBuildStats();
+        log::Info("NavMesh faces: ", m_nav->GetMesh().GetFaceCount(), " (", navStats.triangleCount, " triangles), vertices: ", m_nav->GetMesh().GetVertexCount(),
+                  ", shared edges: ", navStats.sharedEdges, ", build: ", navStats.totalTime, " us (clip ", navStats.clipTime,
+                  ", triangulate ", navStats.triangulateTime, ", neighbours ", navStats.neighbourTime, ", merge ", navStats.mergeTime,
+                  ", visibility ", navStats.visibilityTime, ")");
+        log::Info("NavMesh visibility: ", navStats.visiblePairs, " visible face pairs, ", m_nav->GetMesh().GetVisibilityByteSize(), " bytes");
+
+        m_path = m_nav->ObtainNavPath();
         m_pathStart = vec2f(-PLAY_AREA_W, -PLAY_AREA_W);
         m_pathEnd = vec2f(PLAY_AREA_W, PLAY_AREA_W);
         Navigate(m_pathStart, m_pathEnd);
 
-        m_cake = CreateCake(m_nav.GetRandomNavigableWorldPoint(m_random));
+        m_cake = CreateCake(m_nav->GetRandomNavigableWorldPoint(m_random));
 
         const vec2f cakePos = m_cake->GetPosition();
         vec2f plPos(PLAY_AREA_LEFT, PLAY_AREA_BOTTOM);
         if (cakePos.x < 0.0f) plPos.x = PLAY_AREA_RIGHT;
         if (cakePos.y < 0.0f) plPos.y = PLAY_AREA_TOP;
 
-        m_nav.GetMesh().GetClampedFaceIndex(&plPos);
+        m_nav->GetMesh().GetClampedFaceIndex(&plPos);
         CreatePlayer(plPos);
 
         const float minDistFromPlayer = 45.0f;
@@ -230,7 +256,7 @@ namespace sneaky
             vec2f pos;
             do
             {
-                pos = m_nav.GetRandomNavigableWorldPoint(m_random);
+                pos = m_nav->GetRandomNavigableWorldPoint(m_random);
             } while (rob::Distance2(pos, plPos) < minDistFromPlayerSqr);
             CreateGuard(pos);
         }
@@ -324,7 +350,7 @@ namespace sneaky
 //        object->AddDrawable(GetCache().GetTexture("character_shadow.tex"), CHARACTER_SCALE * 1.2f, false, 1);
 
         b2CircleShape shape;
-        shape.m_radius = 1.0f;
+        shape.m_radius = CHARACTER_RADIUS;
         b2FixtureDef fixDef;
         fixDef.shape = &shape;
         fixDef.density = 1.0f;
@@ -344,7 +370,9 @@ namespace sneaky
 
         PlayerBrain *brain = GetAllocator().new_object<PlayerBrain>(this, &m_input);
         pl->SetBrain(brain);
+        m_vision.AddTarget(pl, CHARACTER_RADIUS, PlayerBit);
 
+        m_player = pl;
         return pl;
     }
 
@@ -356,8 +384,9 @@ namespace sneaky
         light->SetColor(Color(1.0f, 1.0f, 1.0f, 0.25f));
         guard->AddDrawable(GetCache().GetTexture("guard.tex"), CHARACTER_SCALE, false, 2);
 
-        Brain *brain = GetAllocator().new_object<GuardBrain>(this, &m_nav, m_random);
+        Brain *brain = GetAllocator().new_object<GuardBrain>(&m_guards, uint32_t(m_random.GetInt()));
         guard->SetBrain(brain);
+        m_soundBus.AddListener(guard);
 
         return guard;
     }
@@ -413,6 +442,9 @@ namespace sneaky
                     m_objects[m_objectCount - 1] : nullptr;
                 m_objectCount--;
 
+                m_soundBus.RemoveListener(object);
+                m_vision.RemoveObject(object);
+                if (object == m_player) m_player = nullptr;
                 m_world->DestroyBody(object->GetBody());
                 m_objectPool.Return(object);
                 return;
@@ -437,6 +469,10 @@ namespace sneaky
             m_objects[i] = nullptr;
         }
         m_objectCount = 0;
+        m_soundBus.ClearListeners();
+        m_vision.Clear();
+        m_guards.Clear();
+        m_player = nullptr;
     }
 
     void SneakyState::CakeEaten()
@@ -444,6 +480,7 @@ namespace sneaky
         if (m_gameOver) return;
 
         m_sounds.PlayCakeSound(m_cake->GetPosition());
+        m_soundBus.Post(m_cake->GetPosition(), LOUD_SOUND_VOLUME, SOUND_RANGE);
 
         DestroyObject(m_cake);
         m_gameOver = true;
@@ -458,6 +495,7 @@ namespace sneaky
         if (g_punchTimer <= 0.0f)
         {
             m_sounds.PlayPunchSound(pos);
+            m_soundBus.Post(pos, LOUD_SOUND_VOLUME, SOUND_RANGE);
             g_punchTimer = m_random.GetReal(0.2f, 0.8f);
         }
         m_gameOver = true;
@@ -522,6 +560,19 @@ namespace sneaky
 
         m_world->Step(deltaTime, 8, 8, 1);
 
+        // Paths queried on the previous frames are handed to the guards.
+        m_navLayers.UpdateQueries(NAV_QUERY_BUDGET);
+        m_navLayers.UpdateVisibility(NAV_VISIBILITY_BUDGET);
+
+        // The guards think together before the other objects are updated, and
+        // the ones away from the player or the screen think less often.
+        if (m_player)
+        {
+            const vec2f viewMin(PLAY_AREA_LEFT * g_zoom, PLAY_AREA_BOTTOM * g_zoom);
+            const vec2f viewMax(PLAY_AREA_RIGHT * g_zoom, PLAY_AREA_TOP * g_zoom);
+            m_guards.SetLodFocus(m_player->GetPosition(), viewMin, viewMax);
+        }
+        m_guards.Update(gameTime, GetJobs());
 
         size_t deadCount = 0;
         GameObject *dead[MAX_OBJECTS];
@@ -543,6 +594,10 @@ namespace sneaky
             DestroySingleObject(dead[i]);
         }
 
+        // The guards hear the sounds and see the targets of the frame on the next one.
+        m_soundBus.Dispatch();
+        m_vision.Update();
+
         m_inUpdate = false;
     }
 
@@ -656,8 +711,8 @@ namespace sneaky
 
         if (m_drawNav)
         {
-            m_nav.RenderMesh(&renderer);
-            m_nav.RenderPath(&renderer, m_path);
+            m_nav->RenderMesh(&renderer);
+            m_nav->RenderPath(&renderer, m_path);
         }
 
         renderer.SetModel(mat4f::Identity);
@@ -718,19 +773,48 @@ namespace sneaky
             if (key == Keyboard::Key::LAlt)
                 GetWindow().ToggleGrabMouse();
             if (key == Keyboard::Key::F)
-                m_nav.GetMesh().Flood();
-            if (key == Keyboard::Key::R)
-                m_nav.GetMesh().Refine2();
-            if (key == Keyboard::Key::T)
-                m_nav.GetMesh().Refine();
+                log::Info("NavMesh components: ", m_nav->GetMesh().GetComponentCount());
             if (key == Keyboard::Key::G)
                 m_drawNav = !m_drawNav;
+            if (key == Keyboard::Key::B)
+                m_nav->RunBenchmark(m_seed, 1000);
+            if (key == Keyboard::Key::J)
+            {
+                const NavQueryStats &stats = m_nav->GetQueryStats();
+                const rob::Time_t avgLatency = (stats.completed > 0) ? stats.totalLatency / stats.completed : 0;
+                log::Info("Nav queries: ", stats.completed, " completed, queue depth ", stats.queueDepth, " (max ", stats.maxQueueDepth,
+                          "), latency avg ", avgLatency, " us, max ", stats.maxLatency, " us (", stats.maxLatencyFrames, " frames), last slice ", stats.sliceTime, " us");
+                m_nav->ResetQueryStats();
+            }
+            if (key == Keyboard::Key::L)
+            {
+                const GuardSystem::LodStats &stats = m_guards.GetLodStats();
+                for (size_t i = 0; i < GuardSystem::MAX_LOD_TIERS; i++)
+                {
+                    if (stats.ticks[i] + stats.skips[i] == 0) continue;
+                    log::Info("Guard LOD tier ", i, ": ", stats.ticks[i], " thinking updates, ", stats.skips[i], " moving only");
+                }
+                m_guards.ResetLodStats();
+            }
+            if (key == Keyboard::Key::N)
+            {
+                // Drop a crate at the last clicked point and rebuild the nav mesh around it
+                const vec2f halfSize(1.0f, 1.0f);
+                CreateWall(m_mouseWorld, 0.0f, halfSize.x, halfSize.y);
+                m_navLayers.Rebuild(m_mouseWorld - halfSize, m_mouseWorld + halfSize);
+            }
             if (key == Keyboard::Key::H)
                 m_debugAi = !m_debugAi;
             if (key == Keyboard::Key::Tab)
                 m_drawBox2D = !m_drawBox2D;
             if (key == Keyboard::Key::Space && !IsGameOver())
                 ChangeState(STATE_Game);
+            if (key == Keyboard::Key::Backspace)
+            {
+                // Restart with the same world
+                m_gameData.m_worldSeed = m_seed;
+                ChangeState(STATE_Game);
+            }
             if (key == Keyboard::Key::Kp_Plus)
             {
                 g_zoom = Clamp(g_zoom / 1.5f, 0.4444f, 4.0f);
@@ -12,9 +12,12 @@
 #include "GameObject.h"
 #include "FadeEffect.h"
 #include "SoundPlayer.h"
+#include "SoundBus.h"
 #include "Sensor.h"
 #include "Input.h"
-#include "Navigation.h"
+#include "NavLayers.h"
+#include "VisionSystem.h"
+#include "GuardSystem.h"
 
 namespace sneaky
 {
@@ -57,6 +60,9 @@ namespace sneaky
         bool IsGameOver() const;
 
         SoundPlayer& GetSoundPlayer() { return m_sounds; }
+        SoundBus& GetSoundBus() { return m_soundBus; }
+        VisionSystem& GetVision() { return m_vision; }
+        GuardSystem& GetGuards() { return m_guards; }
         Random& GetRandom() { return m_random; }
 
         void RecalcProj();
@@ -96,13 +102,17 @@ namespace sneaky
         size_t m_objectCount;
 
         GameObject *m_cake;
+        GameObject *m_player;
 
         const Drawable **m_drawables;
         size_t m_drawableCount;
 
         Input m_input;
 
-        Navigation m_nav;
+        NavLayers m_navLayers;
+        Navigation *m_nav;
+        VisionSystem m_vision;
+        GuardSystem m_guards;
         bool m_debugAi;
 
         NavPath *m_path;
@@ -113,6 +123,9 @@ namespace sneaky
         FadeEffect m_fadeEffect;
 
         SoundPlayer m_sounds;
+        SoundBus m_soundBus;
+        uint32_t m_seed;
+        bool m_replayedSeed; // The nav meshes are baked only for the worlds played again
         rob::Random m_random;
     };
 
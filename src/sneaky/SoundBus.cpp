@@ -0,0 +1,146 @@
+
+#include "SoundBus.h"
+#include "GameObject.h"
+#include "Brain.h"
+
+#include "rob/Assert.h"
+#include "rob/Log.h"
+
+#include <cmath>
+
+namespace sneaky
+{
+
+    SoundBus::SoundBus(float cellSize /*= 16.0f*/)
+        : m_eventCount(0)
+        , m_listenerCount(0)
+        , m_invCellSize(1.0f / cellSize)
+        , m_stamp(0)
+    { }
+
+    void SoundBus::AddListener(GameObject *listener)
+    {
+        ROB_ASSERT(m_listenerCount < MAX_LISTENERS);
+        m_listeners[m_listenerCount] = listener;
+        m_listenerStamps[m_listenerCount] = m_stamp;
+        m_listenerCount++;
+    }
+
+    void SoundBus::RemoveListener(GameObject *listener)
+    {
+        for (size_t i = 0; i < m_listenerCount; i++)
+        {
+            if (m_listeners[i] == listener)
+            {
+                m_listenerCount--;
+                m_listeners[i] = m_listeners[m_listenerCount];
+                m_listenerStamps[i] = m_listenerStamps[m_listenerCount];
+                return;
+            }
+        }
+    }
+
+    void SoundBus::ClearListeners()
+    {
+        m_listenerCount = 0;
+    }
+
+    bool SoundBus::Post(const vec2f &position, float volume, float range)
+    {
+        if (m_eventCount == MAX_EVENTS)
+        {
+            rob::log::Debug("SoundBus: Event queue full");
+            return false;
+        }
+        Event &event = m_events[m_eventCount++];
+        event.position = position;
+        event.volume = volume;
+        event.range = range;
+        return true;
+    }
+
+    int SoundBus::GetCell(float x) const
+    { return int(std::floor(x * m_invCellSize)); }
+
+    size_t SoundBus::HashCell(int x, int y)
+    { return (uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u) & (HASH_SIZE - 1); }
+
+    void SoundBus::BuildListenerHash()
+    {
+        size_t listenerBuckets[MAX_LISTENERS];
+
+        for (size_t i = 0; i <= HASH_SIZE; i++)
+            m_bucketStart[i] = 0;
+
+        for (size_t i = 0; i < m_listenerCount; i++)
+        {
+            const vec2f pos = m_listeners[i]->GetPosition();
+            const size_t bucket = HashCell(GetCell(pos.x), GetCell(pos.y));
+            m_listenerPositions[i] = pos;
+            listenerBuckets[i] = bucket;
+            m_bucketStart[bucket + 1]++;
+        }
+        for (size_t i = 0; i < HASH_SIZE; i++)
+            m_bucketStart[i + 1] += m_bucketStart[i];
+
+        uint16_t bucketFill[HASH_SIZE];
+        for (size_t i = 0; i < HASH_SIZE; i++)
+            bucketFill[i] = m_bucketStart[i];
+        for (size_t i = 0; i < m_listenerCount; i++)
+            m_bucketListeners[bucketFill[listenerBuckets[i]]++] = uint16_t(i);
+    }
+
+    void SoundBus::DispatchEvent(const Event &event)
+    {
+        const uint32_t stamp = ++m_stamp;
+        const float rangeSqr = event.range * event.range;
+
+        const int x0 = GetCell(event.position.x - event.range);
+        const int y0 = GetCell(event.position.y - event.range);
+        const int x1 = GetCell(event.position.x + event.range);
+        const int y1 = GetCell(event.position.y + event.range);
+
+        if (size_t(x1 - x0 + 1) * size_t(y1 - y0 + 1) >= HASH_SIZE)
+        {
+            // Covers most of the buckets, cheaper to test every listener.
+            for (size_t i = 0; i < m_listenerCount; i++)
+            {
+                if (rob::Distance2(m_listenerPositions[i], event.position) <= rangeSqr)
+                    m_listeners[i]->GetBrain()->ReportSound(event.position, event.volume);
+            }
+            return;
+        }
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                const size_t bucket = HashCell(x, y);
+                for (size_t i = m_bucketStart[bucket]; i < m_bucketStart[bucket + 1]; i++)
+                {
+                    // Cells of the same bucket are visited again.
+                    const size_t listener = m_bucketListeners[i];
+                    if (m_listenerStamps[listener] == stamp) continue;
+                    m_listenerStamps[listener] = stamp;
+
+                    if (rob::Distance2(m_listenerPositions[listener], event.position) <= rangeSqr)
+                        m_listeners[listener]->GetBrain()->ReportSound(event.position, event.volume);
+                }
+            }
+        }
+    }
+
+    void SoundBus::Dispatch()
+    {
+        if (m_eventCount == 0) return;
+
+        if (m_listenerCount > 0)
+        {
+            BuildListenerHash();
+            for (size_t i = 0; i < m_eventCount; i++)
+                DispatchEvent(m_events[i]);
+        }
+        m_eventCount = 0;
+    }
+
+} // sneaky
@@ -0,0 +1,77 @@
+
+#ifndef H_SNEAKY_SOUND_BUS_H
+#define H_SNEAKY_SOUND_BUS_H
+
+#include "Physics.h"
+
+#include "rob/Types.h"
+
+namespace sneaky
+{
+
+    class GameObject;
+
+    // Delivers the sounds of the frame to the objects listening to them. The
+    // emitters post the sounds to a queue, and the queue is dispatched once per
+    // frame to the listeners in range. The listeners are hashed to a grid for
+    // the dispatch only, so a silent frame costs nothing.
+    class SoundBus
+    {
+        struct Event
+        {
+            vec2f position;
+            float volume;
+            float range;
+        };
+
+    public:
+        static const size_t MAX_EVENTS = 32;
+        static const size_t MAX_LISTENERS = 256;
+        static const size_t HASH_SIZE = 64; // Power of two
+
+        explicit SoundBus(float cellSize = 16.0f);
+
+        void AddListener(GameObject *listener);
+        void RemoveListener(GameObject *listener);
+        void ClearListeners();
+
+        // Queues a sound heard by the listeners within the range until the next
+        // dispatch. Returns false if the queue of the frame is full.
+        bool Post(const vec2f &position, float volume, float range);
+
+        // Reports the queued sounds to the brains of the listeners in range and
+        // clears the queue.
+        void Dispatch();
+
+        size_t GetEventCount() const
+        { return m_eventCount; }
+        size_t GetListenerCount() const
+        { return m_listenerCount; }
+
+    private:
+        void BuildListenerHash();
+        void DispatchEvent(const Event &event);
+
+        int GetCell(float x) const;
+        static size_t HashCell(int x, int y);
+
+    private:
+        Event m_events[MAX_EVENTS];
+        size_t m_eventCount;
+
+        GameObject *m_listeners[MAX_LISTENERS];
+        vec2f m_listenerPositions[MAX_LISTENERS];
+        uint32_t m_listenerStamps[MAX_LISTENERS]; // The last event reported to the listener
+        size_t m_listenerCount;
+
+        // The listeners sorted by the hash of their cell.
+        uint16_t m_bucketStart[HASH_SIZE + 1];
+        uint16_t m_bucketListeners[MAX_LISTENERS];
+
+        float m_invCellSize;
+        uint32_t m_stamp;
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_SOUND_BUS_H
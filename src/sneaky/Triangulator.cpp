@@ -0,0 +1,598 @@
+
+#include "Triangulator.h"
+
+#include "rob/Assert.h"
+#include "rob/Log.h"
+
+#include <cmath>
+
+namespace sneaky
+{
+
+    const uint32_t Triangulator::InvalidIndex;
+
+    static const int nextV[] = { 1, 2, 0 };
+    static const int prevV[] = { 2, 0, 1 };
+
+    static inline int VertexIndex(const Triangulator::Triangle &t, uint32_t v)
+    {
+        for (int i = 0; i < 3; i++)
+            if (t.v[i] == v) return i;
+        ROB_ASSERT(0);
+        return 0;
+    }
+
+    static inline bool IsConstrained(const Triangulator::Triangle &t, int e)
+    { return (t.constrained & (1u << e)) != 0; }
+
+    static inline uint32_t GetConstrained(const Triangulator::Triangle &t, int e, int to)
+    { return ((t.constrained >> e) & 1u) << to; }
+
+
+    Triangulator::Triangulator()
+        : m_points()
+        , m_constraints()
+        , m_triangles()
+        , m_vertexTriangle()
+        , m_output()
+        , m_legalize()
+        , m_crossing()
+        , m_newEdges()
+        , m_pending()
+        , m_depth()
+        , m_pointCount(0)
+        , m_walkSeed(0)
+    { }
+
+    void Triangulator::Clear()
+    {
+        m_points.clear();
+        m_constraints.clear();
+        m_triangles.clear();
+        m_output.clear();
+        m_pointCount = 0;
+    }
+
+    uint32_t Triangulator::AddPoint(double x, double y)
+    {
+        const Point p = { x, y };
+        m_points.push_back(p);
+        return m_points.size() - 1;
+    }
+
+    void Triangulator::AddConstraint(uint32_t p0, uint32_t p1)
+    {
+        ROB_ASSERT(p0 < m_points.size() && p1 < m_points.size());
+        if (p0 == p1) return;
+        const Edge e = { p0, p1 };
+        m_constraints.push_back(e);
+    }
+
+    bool Triangulator::Triangulate()
+    {
+        m_pointCount = m_points.size();
+        m_triangles.clear();
+        m_output.clear();
+        if (m_pointCount < 3)
+            return false;
+
+        CreateSuperTriangle();
+
+        // The points are inserted in the order of the outlines, so each point
+        // is usually found a few steps from the previous one.
+        uint32_t t = 0;
+        for (uint32_t p = 0; p < m_pointCount; p++)
+        {
+            t = InsertPoint(p, t);
+            if (t == InvalidIndex)
+            {
+                rob::log::Error("Triangulator: Duplicate point ", p);
+                return false;
+            }
+        }
+
+        for (size_t c = 0; c < m_constraints.size(); c++)
+        {
+            m_pending.clear();
+            m_pending.push_back(m_constraints[c]);
+            while (!m_pending.empty())
+            {
+                const Edge e = m_pending.back();
+                m_pending.pop_back();
+                if (!InsertConstraint(e.v0, e.v1))
+                {
+                    rob::log::Error("Triangulator: Could not recover constraint ", e.v0, " - ", e.v1);
+                    return false;
+                }
+            }
+        }
+
+        Classify();
+        return true;
+    }
+
+    double Triangulator::Orient(uint32_t a, uint32_t b, uint32_t c) const
+    {
+        const Point &pa = m_points[a];
+        const Point &pb = m_points[b];
+        const Point &pc = m_points[c];
+        return (pb.x - pa.x) * (pc.y - pa.y) - (pb.y - pa.y) * (pc.x - pa.x);
+    }
+
+    bool Triangulator::InCircle(const Triangle &t, uint32_t d) const
+    {
+        const Point &pa = m_points[t.v[0]];
+        const Point &pb = m_points[t.v[1]];
+        const Point &pc = m_points[t.v[2]];
+        const Point &pd = m_points[d];
+
+        const double adx = pa.x - pd.x, ady = pa.y - pd.y;
+        const double bdx = pb.x - pd.x, bdy = pb.y - pd.y;
+        const double cdx = pc.x - pd.x, cdy = pc.y - pd.y;
+        const double alift = adx * adx + ady * ady;
+        const double blift = bdx * bdx + bdy * bdy;
+        const double clift = cdx * cdx + cdy * cdy;
+
+        const double det = alift * (bdx * cdy - cdx * bdy)
+            + blift * (cdx * ady - adx * cdy)
+            + clift * (adx * bdy - bdx * ady);
+        const double permanent = alift * (std::fabs(bdx * cdy) + std::fabs(cdx * bdy))
+            + blift * (std::fabs(cdx * ady) + std::fabs(adx * cdy))
+            + clift * (std::fabs(adx * bdy) + std::fabs(bdx * ady));
+
+        // Cocircular points are not flipped, so that rounding cannot make the
+        // flips cycle.
+        return det > permanent * 1e-12;
+    }
+
+    void Triangulator::CreateSuperTriangle()
+    {
+        double minX = m_points[0].x, maxX = minX;
+        double minY = m_points[0].y, maxY = minY;
+        for (uint32_t i = 1; i < m_pointCount; i++)
+        {
+            minX = std::fmin(minX, m_points[i].x);
+            maxX = std::fmax(maxX, m_points[i].x);
+            minY = std::fmin(minY, m_points[i].y);
+            maxY = std::fmax(maxY, m_points[i].y);
+        }
+        const double cx = (minX + maxX) * 0.5;
+        const double cy = (minY + maxY) * 0.5;
+        const double d = std::fmax(maxX - minX, maxY - minY) + 1.0;
+
+        const uint32_t s0 = AddPoint(cx - 20.0 * d, cy - 10.0 * d);
+        const uint32_t s1 = AddPoint(cx + 20.0 * d, cy - 10.0 * d);
+        const uint32_t s2 = AddPoint(cx, cy + 20.0 * d);
+
+        m_vertexTriangle.assign(m_points.size(), InvalidIndex);
+        const uint32_t t = NewTriangle();
+        SetTriangle(t, s0, s1, s2, InvalidIndex, InvalidIndex, InvalidIndex);
+    }
+
+    uint32_t Triangulator::Locate(uint32_t p, uint32_t start, int *edge)
+    {
+        uint32_t t = start;
+        for (size_t steps = 0; steps <= m_triangles.size(); steps++)
+        {
+            const Triangle &tri = m_triangles[t];
+
+            // The first edge is varied to not walk in circles.
+            const int first = m_walkSeed++ % 3;
+            int onEdge = -1, onEdgeCount = 0;
+            bool moved = false;
+            for (int k = 0; k < 3; k++)
+            {
+                const int e = (first + k) % 3;
+                const double o = Orient(tri.v[e], tri.v[nextV[e]], p);
+                if (o < 0.0)
+                {
+                    ROB_ASSERT(tri.n[e] != InvalidIndex);
+                    t = tri.n[e];
+                    moved = true;
+                    break;
+                }
+                if (o == 0.0)
+                {
+                    onEdge = e;
+                    onEdgeCount++;
+                }
+            }
+
+            if (!moved)
+            {
+                // On two edges, the point is on a vertex.
+                if (onEdgeCount > 1) return InvalidIndex;
+                *edge = onEdge;
+                return t;
+            }
+        }
+        return InvalidIndex;
+    }
+
+    uint32_t Triangulator::InsertPoint(uint32_t p, uint32_t start)
+    {
+        int edge = -1;
+        const uint32_t t = Locate(p, start, &edge);
+        if (t == InvalidIndex)
+            return InvalidIndex;
+
+        m_legalize.clear();
+        if (edge < 0)
+            SplitTriangle(t, p);
+        else
+            SplitEdge(t, edge, p);
+        Legalize();
+        return m_vertexTriangle[p];
+    }
+
+    void Triangulator::SplitTriangle(uint32_t t, uint32_t p)
+    {
+        const Triangle tri = m_triangles[t];
+        const uint32_t a = tri.v[0], b = tri.v[1], c = tri.v[2];
+        const uint32_t t1 = NewTriangle();
+        const uint32_t t2 = NewTriangle();
+
+        SetTriangle(t, a, b, p, tri.n[0], t1, t2);
+        SetTriangle(t1, b, c, p, tri.n[1], t2, t);
+        SetTriangle(t2, c, a, p, tri.n[2], t, t1);
+        m_triangles[t].constrained = GetConstrained(tri, 0, 0);
+        m_triangles[t1].constrained = GetConstrained(tri, 1, 0);
+        m_triangles[t2].constrained = GetConstrained(tri, 2, 0);
+        ReplaceNeighbour(tri.n[1], t, t1);
+        ReplaceNeighbour(tri.n[2], t, t2);
+
+        // The edges opposite to the new point are checked.
+        const uint32_t checks[] = { t, 0, t1, 0, t2, 0 };
+        m_legalize.insert(m_legalize.end(), checks, checks + 6);
+    }
+
+    void Triangulator::SplitEdge(uint32_t t, int e, uint32_t p)
+    {
+        const Triangle tri = m_triangles[t];
+        const uint32_t u = tri.n[e];
+        ROB_ASSERT(u != InvalidIndex);
+        const int f = FindNeighbour(u, t);
+        const Triangle utri = m_triangles[u];
+
+        // Triangles (a, b, c) and (b, a, d) split at p on the edge ab.
+        const uint32_t a = tri.v[e], b = tri.v[nextV[e]], c = tri.v[prevV[e]];
+        const uint32_t d = utri.v[prevV[f]];
+        const uint32_t tBC = tri.n[nextV[e]], tCA = tri.n[prevV[e]];
+        const uint32_t uAD = utri.n[nextV[f]], uDB = utri.n[prevV[f]];
+        const uint32_t cAB = GetConstrained(tri, e, 0);
+
+        const uint32_t t1 = NewTriangle();
+        const uint32_t u1 = NewTriangle();
+        SetTriangle(t, a, p, c, u, t1, tCA);
+        SetTriangle(t1, p, b, c, u1, tBC, t);
+        SetTriangle(u1, b, p, d, t1, u, uDB);
+        SetTriangle(u, p, a, d, t, uAD, u1);
+        m_triangles[t].constrained = cAB | GetConstrained(tri, prevV[e], 2);
+        m_triangles[t1].constrained = cAB | GetConstrained(tri, nextV[e], 1);
+        m_triangles[u1].constrained = cAB | GetConstrained(utri, prevV[f], 2);
+        m_triangles[u].constrained = cAB | GetConstrained(utri, nextV[f], 1);
+        ReplaceNeighbour(tBC, t, t1);
+        ReplaceNeighbour(uDB, u, u1);
+
+        const uint32_t checks[] = { t, 2, t1, 1, u1, 2, u, 1 };
+        m_legalize.insert(m_legalize.end(), checks, checks + 8);
+    }
+
+    void Triangulator::Legalize()
+    {
+        while (!m_legalize.empty())
+        {
+            const int e = m_legalize.back();
+            m_legalize.pop_back();
+            const uint32_t t = m_legalize.back();
+            m_legalize.pop_back();
+
+            const Triangle &tri = m_triangles[t];
+            const uint32_t u = tri.n[e];
+            if (u == InvalidIndex || IsConstrained(tri, e))
+                continue;
+
+            const Triangle &utri = m_triangles[u];
+            const uint32_t d = utri.v[prevV[FindNeighbour(u, t)]];
+            if (!InCircle(tri, d))
+                continue;
+
+            // After the flip, the edges opposite to the point are the two that
+            // were in the other triangle.
+            Flip(t, e);
+            const uint32_t checks[] = { t, 1, u, 0 };
+            m_legalize.insert(m_legalize.end(), checks, checks + 4);
+        }
+    }
+
+    // Flips the edge e of the triangle t, so that the triangles (v0, v1, v2) and
+    // (v1, v0, w) become (v2, v0, w) and (w, v1, v2).
+    void Triangulator::Flip(uint32_t t, int e)
+    {
+        const Triangle tri = m_triangles[t];
+        const uint32_t u = tri.n[e];
+        const int f = FindNeighbour(u, t);
+        const Triangle utri = m_triangles[u];
+
+        const uint32_t v0 = tri.v[e], v1 = tri.v[nextV[e]], v2 = tri.v[prevV[e]];
+        const uint32_t w = utri.v[prevV[f]];
+        const uint32_t nA = tri.n[nextV[e]], nB = tri.n[prevV[e]];
+        const uint32_t nC = utri.n[nextV[f]], nD = utri.n[prevV[f]];
+
+        SetTriangle(t, v2, v0, w, nB, nC, u);
+        SetTriangle(u, w, v1, v2, nD, nA, t);
+        m_triangles[t].constrained = GetConstrained(tri, prevV[e], 0) | GetConstrained(utri, nextV[f], 1);
+        m_triangles[u].constrained = GetConstrained(utri, prevV[f], 0) | GetConstrained(tri, nextV[e], 1);
+        ReplaceNeighbour(nC, u, t);
+        ReplaceNeighbour(nA, t, u);
+    }
+
+    uint32_t Triangulator::NewTriangle()
+    {
+        m_triangles.push_back(Triangle());
+        return m_triangles.size() - 1;
+    }
+
+    void Triangulator::SetTriangle(uint32_t t, uint32_t v0, uint32_t v1, uint32_t v2, uint32_t n0, uint32_t n1, uint32_t n2)
+    {
+        Triangle &tri = m_triangles[t];
+        tri.v[0] = v0;
+        tri.v[1] = v1;
+        tri.v[2] = v2;
+        tri.n[0] = n0;
+        tri.n[1] = n1;
+        tri.n[2] = n2;
+        tri.constrained = 0;
+        m_vertexTriangle[v0] = t;
+        m_vertexTriangle[v1] = t;
+        m_vertexTriangle[v2] = t;
+    }
+
+    void Triangulator::ReplaceNeighbour(uint32_t t, uint32_t from, uint32_t to)
+    {
+        if (t == InvalidIndex) return;
+        Triangle &tri = m_triangles[t];
+        for (int i = 0; i < 3; i++)
+        {
+            if (tri.n[i] == from)
+            {
+                tri.n[i] = to;
+                return;
+            }
+        }
+        ROB_ASSERT(0);
+    }
+
+    int Triangulator::FindNeighbour(uint32_t t, uint32_t neighbour) const
+    {
+        const Triangle &tri = m_triangles[t];
+        for (int i = 0; i < 3; i++)
+            if (tri.n[i] == neighbour) return i;
+        ROB_ASSERT(0);
+        return 0;
+    }
+
+    // Finds the triangle with the directed edge from v0 to v1 by going around v0.
+    uint32_t Triangulator::FindEdge(uint32_t v0, uint32_t v1, int *edge) const
+    {
+        const uint32_t start = m_vertexTriangle[v0];
+        for (int dir = 0; dir < 2; dir++)
+        {
+            uint32_t t = start;
+            do
+            {
+                const Triangle &tri = m_triangles[t];
+                const int i = VertexIndex(tri, v0);
+                if (tri.v[nextV[i]] == v1)
+                {
+                    *edge = i;
+                    return t;
+                }
+                t = (dir == 0) ? tri.n[prevV[i]] : tri.n[i];
+            } while (t != InvalidIndex && t != start);
+
+            // Only the super triangle vertices are on the hull, where the way
+            // around is open.
+            if (t == start) break;
+        }
+        return InvalidIndex;
+    }
+
+    bool Triangulator::CrossesConstraint(const Edge &edge, uint32_t a, uint32_t b) const
+    {
+        if (edge.v0 == a || edge.v0 == b || edge.v1 == a || edge.v1 == b)
+            return false;
+        const double o0 = Orient(a, b, edge.v0);
+        const double o1 = Orient(a, b, edge.v1);
+        return (o0 > 0.0 && o1 < 0.0) || (o0 < 0.0 && o1 > 0.0);
+    }
+
+    void Triangulator::SetConstrained(uint32_t t, int e)
+    {
+        Triangle &tri = m_triangles[t];
+        tri.constrained |= 1u << e;
+        const uint32_t u = tri.n[e];
+        if (u != InvalidIndex)
+            m_triangles[u].constrained |= 1u << FindNeighbour(u, t);
+    }
+
+    bool Triangulator::InsertConstraint(uint32_t a, uint32_t b)
+    {
+        int edge;
+        uint32_t t = FindEdge(a, b, &edge);
+        if (t != InvalidIndex)
+        {
+            SetConstrained(t, edge);
+            return true;
+        }
+
+        // Find the triangle around a, that the segment ab enters.
+        const uint32_t start = m_vertexTriangle[a];
+        t = start;
+        uint32_t right = InvalidIndex;
+        do
+        {
+            const Triangle &tri = m_triangles[t];
+            const int i = VertexIndex(tri, a);
+            const uint32_t v1 = tri.v[nextV[i]];
+            const uint32_t v2 = tri.v[prevV[i]];
+            const double o1 = Orient(a, v1, b);
+            const double o2 = Orient(a, v2, b);
+
+            // A vertex on the segment splits the constraint.
+            const Point &pa = m_points[a];
+            if (o1 == 0.0 && (m_points[v1].x - pa.x) * (m_points[b].x - pa.x) + (m_points[v1].y - pa.y) * (m_points[b].y - pa.y) > 0.0)
+            {
+                const Edge rest = { v1, b };
+                m_pending.push_back(rest);
+                SetConstrained(t, i);
+                return true;
+            }
+            if (o1 > 0.0 && o2 < 0.0)
+            {
+                right = v1;
+                edge = nextV[i];
+                break;
+            }
+            t = tri.n[prevV[i]];
+        } while (t != InvalidIndex && t != start);
+
+        if (right == InvalidIndex)
+            return false;
+
+        // Walk along the segment collecting the crossed edges. The first vertex of
+        // a crossed edge is on the right of the segment.
+        m_crossing.clear();
+        for (;;)
+        {
+            const Triangle &tri = m_triangles[t];
+            if (IsConstrained(tri, edge))
+                return false;
+
+            const Edge crossed = { tri.v[edge], tri.v[nextV[edge]] };
+            m_crossing.push_back(crossed);
+
+            const uint32_t u = tri.n[edge];
+            const int j = FindNeighbour(u, t);
+            const Triangle &utri = m_triangles[u];
+            const uint32_t w = utri.v[prevV[j]];
+            if (w == b)
+                break;
+
+            const double o = Orient(a, b, w);
+            if (o == 0.0)
+            {
+                const Edge rest = { w, b };
+                m_pending.push_back(rest);
+                b = w;
+                break;
+            }
+            t = u;
+            edge = (o > 0.0) ? nextV[j] : prevV[j];
+        }
+
+        // Flip the crossed edges until none cross. An edge of a non-convex
+        // quadrilateral is put back to the queue to be flipped later.
+        m_newEdges.clear();
+        size_t head = 0;
+        const size_t maxFlips = m_crossing.size() * m_crossing.size() * 4 + 64;
+        for (size_t flips = 0; head < m_crossing.size(); flips++)
+        {
+            if (flips > maxFlips)
+                return false;
+
+            const Edge crossed = m_crossing[head++];
+            t = FindEdge(crossed.v0, crossed.v1, &edge);
+            if (t == InvalidIndex)
+                return false;
+
+            const Triangle &tri = m_triangles[t];
+            const uint32_t u = tri.n[edge];
+            const uint32_t p = tri.v[prevV[edge]];
+            const uint32_t q = m_triangles[u].v[prevV[FindNeighbour(u, t)]];
+            const double o0 = Orient(p, q, crossed.v0);
+            const double o1 = Orient(p, q, crossed.v1);
+            if (!((o0 > 0.0 && o1 < 0.0) || (o0 < 0.0 && o1 > 0.0)))
+            {
+                m_crossing.push_back(crossed);
+                continue;
+            }
+
+            Flip(t, edge);
+            const Edge flipped = { q, p };
+            if (CrossesConstraint(flipped, a, b))
+                m_crossing.push_back(flipped);
+            else
+                m_newEdges.push_back(flipped);
+        }
+
+        t = FindEdge(a, b, &edge);
+        if (t == InvalidIndex)
+            return false;
+        SetConstrained(t, edge);
+
+        // Restore the Delaunay property of the new edges.
+        bool flipped = true;
+        for (size_t rounds = 0; flipped && rounds < m_newEdges.size() + 8; rounds++)
+        {
+            flipped = false;
+            for (size_t i = 0; i < m_newEdges.size(); i++)
+            {
+                Edge &e = m_newEdges[i];
+                t = FindEdge(e.v0, e.v1, &edge);
+                if (t == InvalidIndex || IsConstrained(m_triangles[t], edge))
+                    continue;
+
+                const Triangle &tri = m_triangles[t];
+                const uint32_t u = tri.n[edge];
+                const uint32_t q = m_triangles[u].v[prevV[FindNeighbour(u, t)]];
+                if (!InCircle(tri, q))
+                    continue;
+
+                const uint32_t p = tri.v[prevV[edge]];
+                Flip(t, edge);
+                e.v0 = q;
+                e.v1 = p;
+                flipped = true;
+            }
+        }
+        return true;
+    }
+
+    // Triangles are inside, when an odd number of constraints is crossed to
+    // get to them from the super triangle.
+    void Triangulator::Classify()
+    {
+        m_depth.assign(m_triangles.size(), InvalidIndex);
+        m_legalize.clear();
+
+        const uint32_t start = m_vertexTriangle[m_pointCount];
+        m_depth[start] = 0;
+        m_legalize.push_back(start);
+        while (!m_legalize.empty())
+        {
+            const uint32_t t = m_legalize.back();
+            m_legalize.pop_back();
+            const Triangle &tri = m_triangles[t];
+            for (int e = 0; e < 3; e++)
+            {
+                const uint32_t u = tri.n[e];
+                if (u == InvalidIndex || m_depth[u] != InvalidIndex)
+                    continue;
+                m_depth[u] = m_depth[t] + (IsConstrained(tri, e) ? 1 : 0);
+                m_legalize.push_back(u);
+            }
+        }
+
+        for (uint32_t t = 0; t < m_triangles.size(); t++)
+        {
+            const Triangle &tri = m_triangles[t];
+            if (m_depth[t] == InvalidIndex || (m_depth[t] & 1) == 0)
+                continue;
+            if (tri.v[0] >= m_pointCount || tri.v[1] >= m_pointCount || tri.v[2] >= m_pointCount)
+                continue;
+            m_output.push_back(t);
+        }
+    }
+
+} // sneaky
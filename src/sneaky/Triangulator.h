@@ -0,0 +1,106 @@
+
+#ifndef H_SNEAKY_TRIANGULATOR_H
+#define H_SNEAKY_TRIANGULATOR_H
+
+#include "rob/Types.h"
+
+#include <vector>
+
+namespace sneaky
+{
+
+    // Constrained Delaunay triangulation of polygons with holes. The points are
+    // inserted incrementally with Lawson flips, after which the constraint edges
+    // are recovered by flipping the edges crossing them (Sloan). Triangles are
+    // classified inside by the parity of the constraints crossed from outside,
+    // so the outlines and the holes only need to be added as constraint edges.
+    class Triangulator
+    {
+    public:
+        static const uint32_t InvalidIndex = -1;
+
+        struct Triangle
+        {
+            uint32_t v[3]; // Counter clockwise
+            uint32_t n[3]; // Neighbour across the edge from v[i] to v[i + 1]
+            uint32_t constrained; // Bit per edge
+        };
+
+    public:
+        Triangulator();
+
+        // Keeps the memory for reuse.
+        void Clear();
+
+        // Points must be unique.
+        uint32_t AddPoint(double x, double y);
+        size_t GetPointCount() const
+        { return m_points.size(); }
+
+        void AddConstraint(uint32_t p0, uint32_t p1);
+
+        // Returns false if the constraints could not be recovered, which happens
+        // when they intersect each other.
+        bool Triangulate();
+
+        // The triangles inside the constraints, in counter clockwise order.
+        size_t GetTriangleCount() const
+        { return m_output.size(); }
+
+        const Triangle& GetTriangle(size_t index) const
+        { return m_triangles[m_output[index]]; }
+
+    private:
+        struct Point
+        {
+            double x, y;
+        };
+
+        struct Edge
+        {
+            uint32_t v0, v1;
+        };
+
+        double Orient(uint32_t a, uint32_t b, uint32_t c) const;
+        bool InCircle(const Triangle &t, uint32_t d) const;
+
+        void CreateSuperTriangle();
+        uint32_t Locate(uint32_t p, uint32_t start, int *edge);
+        uint32_t InsertPoint(uint32_t p, uint32_t start);
+        void SplitTriangle(uint32_t t, uint32_t p);
+        void SplitEdge(uint32_t t, int e, uint32_t p);
+        void Legalize();
+        void Flip(uint32_t t, int e);
+
+        uint32_t NewTriangle();
+        void SetTriangle(uint32_t t, uint32_t v0, uint32_t v1, uint32_t v2, uint32_t n0, uint32_t n1, uint32_t n2);
+        void ReplaceNeighbour(uint32_t t, uint32_t from, uint32_t to);
+        int FindNeighbour(uint32_t t, uint32_t neighbour) const;
+        uint32_t FindEdge(uint32_t v0, uint32_t v1, int *edge) const;
+
+        bool InsertConstraint(uint32_t a, uint32_t b);
+        bool CrossesConstraint(const Edge &edge, uint32_t a, uint32_t b) const;
+        void SetConstrained(uint32_t t, int e);
+        void Classify();
+
+    private:
+        std::vector<Point> m_points;
+        std::vector<Edge> m_constraints;
+        std::vector<Triangle> m_triangles;
+        std::vector<uint32_t> m_vertexTriangle; // A triangle of each vertex
+        std::vector<uint32_t> m_output;
+
+        // Scratch
+        std::vector<uint32_t> m_legalize; // Triangle and edge pairs
+        std::vector<Edge> m_crossing;
+        std::vector<Edge> m_newEdges;
+        std::vector<Edge> m_pending;
+        std::vector<uint32_t> m_depth;
+
+        uint32_t m_pointCount; // Without the super triangle
+        uint32_t m_walkSeed;
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_TRIANGULATOR_H
@@ -0,0 +1,235 @@
+
+#include "VisionSystem.h"
+#include "GameObject.h"
+#include "Sensor.h"
+
+#include "rob/math/simd/Simd.h"
+#include "rob/Assert.h"
+
+namespace sneaky
+{
+
+    // The other characters do not block the sight.
+    static const uint16_t SIGHT_IGNORE_BITS = GuardBit | CakeBit;
+
+    VisionSystem::VisionSystem()
+        : m_nav(nullptr)
+        , m_viewerCount(0)
+        , m_targetCount(0)
+    {
+        for (size_t i = 0; i < MAX_VIEWERS; i++)
+        {
+            m_viewers[i] = nullptr;
+            m_agents[i] = nullptr;
+            m_x[i] = m_y[i] = 0.0f;
+            m_forwardX[i] = m_forwardY[i] = 0.0f;
+            m_sightings[i].target = nullptr;
+            m_sightings[i].position = vec2f::Zero;
+            m_sightings[i].categoryBits = 0;
+            m_sightings[i].visible = false;
+        }
+        SetCone(15.0f);
+    }
+
+    void VisionSystem::SetCone(float range)
+    {
+        // Forward is up in the frame of the viewer.
+        const vec2f cone[CONE_PLANES] = {
+            vec2f(0.0f, 0.0f),
+            vec2f(range / 3.0f, range * (2.0f/3.0f)),
+            vec2f(2.6f * range/16.0f, range),
+            vec2f(-2.6f * range/16.0f, range),
+            vec2f(-range / 3.0f, range * (2.0f/3.0f))
+        };
+        for (size_t i = 0; i < CONE_PLANES; i++)
+        {
+            const vec2f &a = cone[i];
+            const vec2f &b = cone[(i + 1) % CONE_PLANES];
+            const vec2f normal = vec2f(b.y - a.y, a.x - b.x).Normalized();
+            m_planeX[i] = normal.x;
+            m_planeY[i] = normal.y;
+            m_planeD[i] = normal.Dot(a);
+        }
+    }
+
+    void VisionSystem::SetNavigation(Navigation *nav)
+    { m_nav = nav; }
+
+    size_t VisionSystem::AddViewer(GameObject *viewer, const NavAgent *agent)
+    {
+        ROB_ASSERT(m_viewerCount < MAX_VIEWERS);
+        m_viewers[m_viewerCount] = viewer;
+        m_agents[m_viewerCount] = agent;
+        return m_viewerCount++;
+    }
+
+    void VisionSystem::AddTarget(GameObject *target, float radius, uint16_t categoryBits)
+    {
+        ROB_ASSERT(m_targetCount < MAX_TARGETS);
+        m_targets[m_targetCount] = target;
+        m_targetRadii[m_targetCount] = radius;
+        m_targetBits[m_targetCount] = categoryBits;
+        m_targetCount++;
+    }
+
+    // The slot of a viewer is kept, as the viewers hold on to their index.
+    void VisionSystem::RemoveObject(GameObject *object)
+    {
+        for (size_t i = 0; i < m_viewerCount; i++)
+        {
+            if (m_viewers[i] == object)
+            {
+                m_viewers[i] = nullptr;
+                m_agents[i] = nullptr;
+                m_sightings[i].target = nullptr;
+                m_sightings[i].visible = false;
+            }
+        }
+        for (size_t i = 0; i < m_targetCount; i++)
+        {
+            if (m_targets[i] == object)
+            {
+                m_targetCount--;
+                m_targets[i] = m_targets[m_targetCount];
+                m_targetRadii[i] = m_targetRadii[m_targetCount];
+                m_targetBits[i] = m_targetBits[m_targetCount];
+                return;
+            }
+        }
+    }
+
+    void VisionSystem::Clear()
+    {
+        for (size_t i = 0; i < m_viewerCount; i++)
+        {
+            m_viewers[i] = nullptr;
+            m_agents[i] = nullptr;
+            m_sightings[i].target = nullptr;
+            m_sightings[i].visible = false;
+        }
+        m_viewerCount = 0;
+        m_targetCount = 0;
+    }
+
+    // Writes how far outside the cone of each viewer the target is. Instantiated
+    // with a non-zero S, the packets are computed without SIMD.
+    template <size_t S>
+    void VisionSystem::TestCones(const vec2f &target, float *outside) const
+    {
+        typedef rob::simd::Simd<float, S> simd;
+        typedef typename simd::v4 v4;
+
+        const v4 tx = simd::Set(target.x);
+        const v4 ty = simd::Set(target.y);
+
+        for (size_t i = 0; i < m_viewerCount; i += 4)
+        {
+            const v4 dx = simd::Sub(tx, simd::Load(m_x + i));
+            const v4 dy = simd::Sub(ty, simd::Load(m_y + i));
+            const v4 fx = simd::Load(m_forwardX + i);
+            const v4 fy = simd::Load(m_forwardY + i);
+
+            // To the frame of the viewer, where the right is (fy, -fx).
+            const v4 lx = simd::Sub(simd::Mul(dx, fy), simd::Mul(dy, fx));
+            const v4 ly = simd::Add(simd::Mul(dx, fx), simd::Mul(dy, fy));
+
+            v4 dist = simd::Sub(simd::Add(simd::Mul(lx, m_planeX[0]), simd::Mul(ly, m_planeY[0])), simd::Set(m_planeD[0]));
+            for (size_t p = 1; p < CONE_PLANES; p++)
+            {
+                const v4 d = simd::Sub(simd::Add(simd::Mul(lx, m_planeX[p]), simd::Mul(ly, m_planeY[p])), simd::Set(m_planeD[p]));
+                dist = simd::Max(dist, d);
+            }
+            simd::Store(outside + i, dist);
+        }
+    }
+
+    void VisionSystem::Update()
+    {
+        ROB_ASSERT(m_nav != nullptr);
+
+        for (size_t i = 0; i < m_viewerCount; i++)
+        {
+            m_sightings[i].target = nullptr;
+            m_sightings[i].visible = false;
+            if (!m_viewers[i]) continue;
+
+            const vec2f pos = m_viewers[i]->GetPosition();
+            const vec2f forward = m_viewers[i]->GetForward();
+            m_x[i] = pos.x;
+            m_y[i] = pos.y;
+            m_forwardX[i] = forward.x;
+            m_forwardY[i] = forward.y;
+        }
+
+        alignas(16) float outside[MAX_VIEWERS];
+        float closestDist2[MAX_VIEWERS];
+
+        for (size_t t = 0; t < m_targetCount; t++)
+        {
+            const vec2f targetPos = m_targets[t]->GetPosition();
+            TestCones<0>(targetPos, outside);
+
+            // The target is in the cone if any part of it is.
+            for (size_t i = 0; i < m_viewerCount; i++)
+            {
+                if (!m_viewers[i] || outside[i] > m_targetRadii[t]) continue;
+
+                const float dist2 = rob::Distance2(vec2f(m_x[i], m_y[i]), targetPos);
+                Sighting &sighting = m_sightings[i];
+                if (!sighting.target || dist2 < closestDist2[i])
+                {
+                    sighting.target = m_targets[t];
+                    sighting.position = targetPos;
+                    sighting.categoryBits = m_targetBits[t];
+                    closestDist2[i] = dist2;
+                }
+            }
+        }
+
+        const NavMesh &mesh = m_nav->GetMesh();
+        NavMesh::Segment segments[MAX_VIEWERS];
+        bool clear[MAX_VIEWERS];
+        size_t segmentViewers[MAX_VIEWERS];
+        size_t segmentCount = 0;
+        for (size_t i = 0; i < m_viewerCount; i++)
+        {
+            if (!m_sightings[i].target) continue;
+
+            // The agent was clamped before the viewer moved this frame, so the line
+            // starts from the body. Its face is walked from the one of the agent,
+            // and a viewer off the mesh has none.
+            const vec2f start(m_x[i], m_y[i]);
+            vec2f facePos = start;
+            const index_t startFace = mesh.GetClampedFaceIndex(m_agents[i]->GetFace(), &facePos);
+            const bool onMesh = (facePos.x == start.x && facePos.y == start.y);
+
+            NavMesh::Segment &segment = segments[segmentCount];
+            segment.start = start;
+            segment.end = m_sightings[i].position;
+            segment.startFace = onMesh ? startFace : NavMesh::InvalidIndex;
+            segmentViewers[segmentCount++] = i;
+        }
+        if (segmentCount == 0) return;
+
+        // Only the static geometry blocks the sight, and none of it is on the
+        // mesh. The mesh is shrunk by the agent radius, so a sight line that
+        // leaves it is checked against the physics.
+        mesh.RayCast(segments, clear, segmentCount);
+
+        for (size_t s = 0; s < segmentCount; s++)
+        {
+            const size_t i = segmentViewers[s];
+            Sighting &sighting = m_sightings[i];
+            if (clear[s])
+            {
+                sighting.visible = true;
+                continue;
+            }
+
+            b2Body *targetBody = sighting.target->GetBody();
+            const vec2f rayOrigin = vec2f(m_x[i], m_y[i]) + vec2f(m_forwardX[i], m_forwardY[i]) * 1.5f;
+            sighting.visible = (m_nav->RayCast(rayOrigin, sighting.position, sighting.categoryBits, SIGHT_IGNORE_BITS) == targetBody);
+        }
+    }
+
+} // sneaky
@@ -0,0 +1,81 @@
+
+#ifndef H_SNEAKY_VISION_SYSTEM_H
+#define H_SNEAKY_VISION_SYSTEM_H
+
+#include "Navigation.h"
+
+namespace sneaky
+{
+
+    class GameObject;
+
+    // Sees the targets for every viewer once per frame. The view cones of all the
+    // viewers are tested against each target in packets of four, and the sight
+    // lines of the targets in a cone are cast on the nav mesh together. Only the
+    // lines that leave the mesh are checked against the physics.
+    class VisionSystem
+    {
+    public:
+        static const size_t MAX_VIEWERS = 256; // Multiple of four
+        static const size_t MAX_TARGETS = 4;
+        static const size_t CONE_PLANES = 5;
+
+        // The closest target in the view cone of a viewer.
+        struct Sighting
+        {
+            GameObject *target; // Null if none is in the cone
+            vec2f position;
+            uint16_t categoryBits; // Of the target body
+            bool visible; // The sight line is not blocked
+        };
+
+        VisionSystem();
+
+        // The cone of the viewers reaches the range in front of them.
+        void SetCone(float range);
+        void SetNavigation(Navigation *nav);
+
+        // The agent of the viewer must be on the mesh of the navigation.
+        size_t AddViewer(GameObject *viewer, const NavAgent *agent);
+        // The sight lines to the target hit the fixtures of the category.
+        void AddTarget(GameObject *target, float radius, uint16_t categoryBits);
+        void RemoveObject(GameObject *object);
+        void Clear();
+
+        void Update();
+
+        const Sighting& GetSighting(size_t viewer) const
+        { return m_sightings[viewer]; }
+
+    private:
+        template <size_t S>
+        void TestCones(const vec2f &target, float *outside) const;
+
+    private:
+        Navigation *m_nav;
+
+        // The planes of the cone in the frame of the viewer, facing out.
+        float m_planeX[CONE_PLANES];
+        float m_planeY[CONE_PLANES];
+        float m_planeD[CONE_PLANES];
+
+        GameObject *m_viewers[MAX_VIEWERS];
+        const NavAgent *m_agents[MAX_VIEWERS];
+        size_t m_viewerCount;
+
+        alignas(16) float m_x[MAX_VIEWERS];
+        alignas(16) float m_y[MAX_VIEWERS];
+        alignas(16) float m_forwardX[MAX_VIEWERS];
+        alignas(16) float m_forwardY[MAX_VIEWERS];
+
+        GameObject *m_targets[MAX_TARGETS];
+        float m_targetRadii[MAX_TARGETS];
+        uint16_t m_targetBits[MAX_TARGETS];
+        size_t m_targetCount;
+
+        Sighting m_sightings[MAX_VIEWERS];
+    };
+
+} // sneaky
+
+#endif // H_SNEAKY_VISION_SYSTEM_H